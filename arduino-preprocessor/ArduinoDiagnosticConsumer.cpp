@@ -36,6 +36,12 @@
 
 using namespace clang;
 
+static const size_t jsonFlushThreshold = 64 * 1024;
+
+ArduinoDiagnosticConsumer::~ArduinoDiagnosticConsumer() {
+    flushJsonDiagnostics();
+}
+
 void ArduinoDiagnosticConsumer::collectUndeclaredIdentifiersIn(IdentifiersList &list) {
     undeclaredIdentifiersList = &list;
 }
@@ -78,10 +84,7 @@ void ArduinoDiagnosticConsumer::HandleDiagnostic(DiagnosticsEngine::Level level,
             }
 
             // Save the identifier position for later processing
-            IdentifierLocation *m = new IdentifierLocation;
-            m->location = FullSourceLoc(loc, sm);
-            m->identifier = identifier.str();
-            undeclaredIdentifiersList->push_front(m);
+            undeclaredIdentifiersList->add(identifier, FullSourceLoc(loc, sm));
             return;
         }
 
@@ -93,13 +96,22 @@ void ArduinoDiagnosticConsumer::HandleDiagnostic(DiagnosticsEngine::Level level,
         SmallString<100> message;
         info.FormatDiagnostic(message);
 
-        json data = json{
-            {"location", encode(sm, info.getLocation())},
-            {"message", encode(message)},
-            {"ranges", encode(sm, info.getRanges())},
-            {"hints", encode(sm, info.getFixItHints())},
-        };
-        *jsonDiagnosticOutput << data.dump() << "\n";
+        // Same output of encode(...).dump(), keys in alphabetical order
+        raw_svector_ostream out(jsonBuffer);
+        out << "{\"hints\":";
+        writeJson(out, sm, info.getFixItHints());
+        out << ",\"location\":";
+        writeJson(out, sm, info.getLocation());
+        out << ",\"message\":";
+        writeJson(out, message.str());
+        out << ",\"ranges\":";
+        writeJson(out, sm, info.getRanges());
+        out << "}\n";
+
+        // Keep the diagnostics in order with the debugging messages
+        if (debugOutput || jsonBuffer.size() >= jsonFlushThreshold) {
+            flushJsonDiagnostics();
+        }
     }
 
     if (debugOutput) {
@@ -108,3 +120,14 @@ void ArduinoDiagnosticConsumer::HandleDiagnostic(DiagnosticsEngine::Level level,
         outs() << "(" << info.getID() << ") " << outStr << "\n";
     }
 }
+
+void ArduinoDiagnosticConsumer::finish() {
+    flushJsonDiagnostics();
+}
+
+void ArduinoDiagnosticConsumer::flushJsonDiagnostics() {
+    if (jsonDiagnosticOutput && !jsonBuffer.empty()) {
+        *jsonDiagnosticOutput << jsonBuffer;
+        jsonBuffer.clear();
+    }
+}
@@ -30,6 +30,7 @@
 #pragma once
 
 #include <clang/AST/ASTConsumer.h>
+#include <llvm/ADT/SmallString.h>
 
 #include "IdentifiersList.hpp"
 
@@ -39,13 +40,22 @@ using namespace llvm;
 class ArduinoDiagnosticConsumer : public DiagnosticConsumer {
 public:
 
+    ~ArduinoDiagnosticConsumer() override;
+
     void collectUndeclaredIdentifiersIn(IdentifiersList &list);
 
     void outputJsonDiagnosticsTo(raw_ostream &out);
 
+    // Writes out the buffered json diagnostics
+    void finish() override;
+
 private:
     IdentifiersList *undeclaredIdentifiersList = nullptr;
     raw_ostream *jsonDiagnosticOutput = nullptr;
+    // Json diagnostics are formatted here and written to the output in
+    // large chunks
+    SmallString<4096> jsonBuffer;
 
     void HandleDiagnostic(DiagnosticsEngine::Level level, const Diagnostic& info) override;
+    void flushJsonDiagnostics();
 };
@@ -31,18 +31,29 @@
 #include <clang/Frontend/CompilerInstance.h>
 #include <clang/Frontend/FrontendOptions.h>
 #include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/Utils.h>
 #include <clang/Lex/Preprocessor.h>
 #include <clang/Lex/PreprocessorOptions.h>
 #include <clang/Sema/Sema.h>
 #include <clang/Sema/CodeCompleteOptions.h>
 #include <clang/Sema/CodeCompleteConsumer.h>
 
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+#include <cctype>
 #include <iostream>
 
 #include "CodeCompletion.hpp"
 #include "CommandLine.hpp"
+#include "Config.hpp"
 #include "utils.hpp"
 #include "JsonImpl.hpp"
+#include "Trace.hpp"
 
 using namespace clang;
 using namespace llvm;
@@ -52,6 +63,8 @@ class CustomCodeCompleteConsumer : public CodeCompleteConsumer {
     CodeCompletionTUInfo TUInfo;
     json output;
     SourceManager &sm;
+    // The names already completed, the library index doesn't repeat them
+    StringSet<> names;
 
 public:
 
@@ -72,10 +85,30 @@ public:
             CodeCompletionString *ccs = res[i].CreateCodeCompletionString(s, ctx, getAllocator(), TUInfo, includeBriefComments());
             //outs() << encode(res[i], ccs, sm).dump(2) << "\n";
             output.push_back(encode(res[i], ccs, sm));
+            if (ccs->getTypedText()) {
+                names.insert(ccs->getTypedText());
+            }
         }
 
     }
 
+    // Adds the symbols of the libraries starting with prefix, with the source
+    // folder of their library: the IDE can add the missing #include. They
+    // rank after the completions found by clang.
+    void addLibrarySymbols(const LibraryIndex &libraries, StringRef prefix) {
+        for (const LibrarySymbol &s : libraries.findSymbols(prefix)) {
+            if (!names.insert(s.name).second) {
+                continue;
+            }
+            output.push_back(json{
+                {"completion", json::array({json{{"typedtext", s.name.str()}}})},
+                {"library", s.library.str()},
+                {"location", s.file.str()},
+                {"line", s.line},
+                {"type", s.getKindName()}});
+        }
+    }
+
     /*
     void ProcessOverloadCandidates(Sema &s, unsigned currArg, OverloadCandidate *candidates, unsigned n) {
     }
@@ -94,7 +127,7 @@ public:
     }
 };
 
-int FindRealLineForCodeCompletion(string &code, string &filename, int line) {
+int FindRealLineForCodeCompletion(const string &code, const string &filename, int line) {
     int curr = 1;
     int real = 1;
     bool inFile = false;
@@ -129,25 +162,128 @@ int FindRealLineForCodeCompletion(string &code, string &filename, int line) {
     return -1;
 }
 
-void DoCodeCompletion(const string &filename, const string &code, int line, int col) {
-    CompilerInstance ci;
+// Sets up ci with the options of the compile command of the sketch, args
+// starts with the name of the compiler. Without args, or if they can't be
+// parsed, the default target is used in C++11 mode.
+static void SetupCompilerInstance(CompilerInstance &ci, const vector<string> &args) {
     ci.createDiagnostics();
 
     // Hide diagnostics
     ci.getDiagnostics().setClient(new IgnoringDiagConsumer());
 
-    shared_ptr<clang::TargetOptions> tOpts = make_shared<clang::TargetOptions>();
-    tOpts->Triple = sys::getDefaultTargetTriple();
-    ci.setTarget(TargetInfo::CreateTargetInfo(ci.getDiagnostics(), tOpts));
+    vector<const char *> argv;
+    for (const string &arg : args) {
+        argv.push_back(arg.c_str());
+    }
+    auto invocation = argv.empty() ? nullptr : createInvocationFromCommandLine(argv, &ci.getDiagnostics());
+    if (invocation) {
+        ci.setInvocation(std::move(invocation));
+        // The inputs are added by the callers
+        ci.getFrontendOpts().Inputs.clear();
+        shared_ptr<clang::TargetOptions> tOpts = make_shared<clang::TargetOptions>(ci.getTargetOpts());
+        ci.setTarget(TargetInfo::CreateTargetInfo(ci.getDiagnostics(), tOpts));
+    } else {
+        shared_ptr<clang::TargetOptions> tOpts = make_shared<clang::TargetOptions>();
+        tOpts->Triple = sys::getDefaultTargetTriple();
+        ci.setTarget(TargetInfo::CreateTargetInfo(ci.getDiagnostics(), tOpts));
 
-    LangOptions &lOpts = ci.getLangOpts();
-    lOpts.CPlusPlus = true;
-    lOpts.CPlusPlus11 = true;
-    lOpts.Bool = true;
-    lOpts.GNUMode = true;
+        LangOptions &lOpts = ci.getLangOpts();
+        lOpts.CPlusPlus = true;
+        lOpts.CPlusPlus11 = true;
+        lOpts.Bool = true;
+        lOpts.GNUMode = true;
+    }
 
     ci.createFileManager();
     ci.createSourceManager(ci.getFileManager());
+}
+
+static string MD5Hex(StringRef data) {
+    MD5 hash;
+    hash.update(data);
+    MD5::MD5Result result;
+    hash.final(result);
+    SmallString<32> hex;
+    MD5::stringifyResult(result, hex);
+    return hex.str().str();
+}
+
+// The name of the header precompiled with the prefix of the sketch
+static string PrefixHeaderName(const string &filename) {
+    return filename + ".completion-prefix.hpp";
+}
+
+// Precompiles the prefix of the sketch in pchPath, returns false if the
+// prefix has errors.
+static bool BuildPrefixPCH(const vector<string> &args, const string &headerName, const string &prefix,
+        const string &pchPath) {
+    TraceScope trace("BuildPrefixPCH");
+    CompilerInstance ci;
+    SetupCompilerInstance(ci, args);
+
+    FrontendOptions& fOpts = ci.getFrontendOpts();
+    fOpts.Inputs.push_back(FrontendInputFile(headerName, InputKind::IK_CXX));
+    fOpts.OutputFile = pchPath;
+
+    unique_ptr<MemoryBuffer> buff(MemoryBuffer::getMemBuffer(prefix, headerName));
+    ci.getPreprocessorOpts().addRemappedFile(headerName, buff.release());
+
+    GeneratePCHAction action;
+    if (!action.BeginSourceFile(ci, fOpts.Inputs[0])) {
+        return false;
+    }
+    action.Execute();
+    // The output file is removed by EndSourceFile if errors occurred
+    bool ok = !ci.getDiagnostics().hasErrorOccurred();
+    action.EndSourceFile();
+    return ok;
+}
+
+// Returns in pchPath a precompiled header of the prefix, reusing the one
+// built by a previous run if the prefix didn't change. Only the PCH of the
+// last prefix is kept for each sketch.
+static bool GetPrefixPCH(const string &filename, const vector<string> &args, const string &prefix,
+        string &pchPath) {
+    SmallString<128> base;
+    sys::path::system_temp_directory(true, base);
+    sys::path::append(base, "arduino-preprocessor-completion-" + MD5Hex(filename));
+    string keyPath = base.str().str() + ".key";
+
+    // The PCH can only be used with the options it was built with
+    string key = VERSION;
+    for (const string &arg : args) {
+        key += '\0' + arg;
+    }
+    key = MD5Hex(key + '\0' + prefix);
+    pchPath = base.str().str() + "-" + key + ".pch";
+    if (sys::fs::exists(pchPath)) {
+        return true;
+    }
+
+    if (!BuildPrefixPCH(args, PrefixHeaderName(filename), prefix, pchPath)) {
+        return false;
+    }
+
+    ErrorOr<unique_ptr<MemoryBuffer>> oldKey = MemoryBuffer::getFile(keyPath);
+    if (oldKey && (*oldKey)->getBuffer() != key) {
+        sys::fs::remove(base.str().str() + "-" + (*oldKey)->getBuffer().str() + ".pch");
+    }
+    std::error_code ec;
+    raw_fd_ostream keyOut(keyPath, ec, sys::fs::F_None);
+    if (!ec) {
+        keyOut << key;
+    }
+    return true;
+}
+
+// Outputs the completions at line:col of code. The code above it can be
+// precompiled in pchPath, from the prefixCode buffer. Returns false, without
+// output, if the precompiled prefix is out of date.
+static bool Complete(const string &filename, const vector<string> &args, const string &code, int line, int col,
+        const string &prefixCode, const string &pchPath, const LibraryIndex *libraries, const string &prefix,
+        raw_ostream &out) {
+    CompilerInstance ci;
+    SetupCompilerInstance(ci, args);
 
     CodeCompleteOptions ccOpts;
     ccOpts.IncludeMacros = 1;
@@ -168,12 +304,94 @@ void DoCodeCompletion(const string &filename, const string &code, int line, int
     PreprocessorOptions& pOpts = ci.getPreprocessorOpts();
     pOpts.clearRemappedFiles();
     pOpts.addRemappedFile(filename, buff.release());
+    if (!pchPath.empty()) {
+        pOpts.ImplicitPCHInclude = pchPath;
+        // The prefix is mapped again with the same content, so that the PCH
+        // validation checks only the headers it includes
+        string headerName = PrefixHeaderName(filename);
+        pOpts.addRemappedFile(headerName, MemoryBuffer::getMemBufferCopy(prefixCode, headerName).release());
+    }
 
     SyntaxOnlyAction action;
     if (action.BeginSourceFile(ci, ci.getFrontendOpts().Inputs[0])) {
         action.Execute();
         action.EndSourceFile();
+    } else if (!pchPath.empty()) {
+        // The PCH can't be loaded
+        return false;
+    }
+
+    // An empty prefix would list every symbol of every library
+    if (libraries && !prefix.empty()) {
+        TraceScope trace("LibrarySymbols", prefix);
+        ccConsumer->addLibrarySymbols(*libraries, prefix);
+    }
+
+    out << ccConsumer->GetJSON()->dump();
+    return true;
+}
+
+void DoCodeCompletion(const string &filename, const vector<string> &args, const string &code, int line, int col,
+        raw_ostream &out, const vector<unsigned> &declOffsets, const LibraryIndex *libraries) {
+    // Find the start of the last top level declaration before the cursor line:
+    // everything above it is precompiled and reused by the following runs, so
+    // only the code from that point on is parsed again.
+    size_t lineStart = 0;
+    for (int l = 1; l < line && lineStart != string::npos; l++) {
+        lineStart = code.find('\n', lineStart);
+        if (lineStart != string::npos) {
+            lineStart++;
+        }
+    }
+    // The identifier typed before the cursor
+    string prefix;
+    if (lineStart != string::npos && col > 1) {
+        size_t end = min(lineStart + col - 1, code.size());
+        size_t begin = end;
+        while (begin > lineStart && (isalnum(static_cast<unsigned char>(code[begin - 1])) || code[begin - 1] == '_')) {
+            begin--;
+        }
+        prefix = code.substr(begin, end - begin);
+    }
+
+    size_t splitOffset = 0;
+    for (unsigned offset : declOffsets) {
+        if (offset > lineStart) {
+            break;
+        }
+        // Only declarations that start at the beginning of a line keep the
+        // line arithmetic below simple
+        if (offset > 0 && code[offset - 1] == '\n') {
+            splitOffset = offset;
+        }
     }
 
-    outs() << ccConsumer->GetJSON()->dump();
+    string pchPath;
+    string prefixCode;
+    string mainCode = code;
+    int mainLine = line;
+    if (lineStart != string::npos && splitOffset > 0) {
+        prefixCode = code.substr(0, splitOffset);
+        if (GetPrefixPCH(filename, args, prefixCode, pchPath)) {
+            int splitLine = 1 + count(code.begin(), code.begin() + splitOffset, '\n');
+            // The #line directive takes one line
+            mainLine = line - splitLine + 2;
+            mainCode = LineDirectiveAt(code, splitOffset) + code.substr(splitOffset);
+            if (debugOutput) {
+                cerr << "Code-completions using precompiled prefix " << pchPath << " up to line " << splitLine << "\n";
+            }
+        } else {
+            pchPath.clear();
+        }
+    }
+
+    if (pchPath.empty() || !Complete(filename, args, mainCode, mainLine, col, prefixCode, pchPath, libraries, prefix,
+            out)) {
+        if (!pchPath.empty()) {
+            // A header included by the prefix changed, the precompiled prefix
+            // is built again by the next request
+            sys::fs::remove(pchPath);
+        }
+        Complete(filename, args, code, line, col, "", "", libraries, prefix, out);
+    }
 }
@@ -29,8 +29,23 @@
 
 #pragma once
 
+#include <llvm/Support/raw_ostream.h>
+
+#include <string>
+#include <vector>
+
+#include "Libraries.hpp"
+
+using namespace llvm;
 using namespace std;
 
-int FindRealLineForCodeCompletion(string &code, string &filename, int line);
+int FindRealLineForCodeCompletion(const string &code, const string &filename, int line);
 
-void DoCodeCompletion(const string &sourceFilename, const string &code, int line, int col);
+// Outputs the completions at line:col of the preprocessed sketch, parsed with
+// the compile command args of the sketch. declOffsets
+// are the offsets of the top level declarations, as collected in
+// PreprocessorContext, used to precompile the code above the cursor.
+// The symbols of libraries, if not null, that start with the identifier
+// before the cursor follow the completions found by clang.
+void DoCodeCompletion(const string &sourceFilename, const vector<string> &args, const string &code, int line, int col,
+        raw_ostream &out, const vector<unsigned> &declOffsets, const LibraryIndex *libraries);
@@ -38,6 +38,13 @@ bool debugOutput;
 bool outputDiagnostics;
 bool outputOnlyNeededPrototypes;
 bool outputPreprocessedSketch = true;
+bool outputLibraries;
+vector<string> libraryDirs;
+bool serverMode;
+string statsFile;
+string traceFile;
+unsigned jobs = 1;
+string outputDir;
 
 // Code completion parameters
 bool outputCodeCompletions;
@@ -56,6 +63,13 @@ static cl::opt<bool> debugOutputOpt("debug");
 static cl::opt<bool> outputOnlyNeededPrototypesOpt("output-only-needed-prototypes");
 static cl::opt<bool> outputDiagnosticsOpt("output-diagnostics");
 static cl::opt<string> outputCodeCompletionsOpt("output-code-completions");
+static cl::list<string> librariesOpt("libraries");
+static cl::opt<bool> outputLibrariesOpt("output-libraries");
+static cl::opt<bool> serverModeOpt("server");
+static cl::opt<string> statsFileOpt("stats");
+static cl::opt<string> traceFileOpt("trace-json");
+static cl::opt<unsigned> jobsOpt("jobs");
+static cl::opt<string> outputDirOpt("output-dir");
 
 static void printVersion() {
     outs() << "Arduino (https://www.arduino.cc/):\n";
@@ -81,9 +95,50 @@ CommonOptionsParser doCommandLineParsing(int argc, const char **argv) {
             "Output code completions (suggestions) in json format.\n"
             "This option requires the cursor position in the format \"filename:line:col\"");
 
+    librariesOpt.setCategory(arduinoToolCategory);
+    librariesOpt.setMiscFlag(cl::CommaSeparated);
+    librariesOpt.setValueStr("dir,...");
+    librariesOpt.setDescription(
+            "Folders of the installed libraries. The includes not found in the include paths\n"
+            "are looked up in the libraries while the sketch is parsed");
+
+    outputLibrariesOpt.setCategory(arduinoToolCategory);
+    outputLibrariesOpt.setInitialValue(false);
+    outputLibrariesOpt.setDescription("Output the source folders of the libraries used by the sketch, one per line");
+
+    serverModeOpt.setCategory(arduinoToolCategory);
+    serverModeOpt.setInitialValue(false);
+    serverModeOpt.setDescription(
+            "Keep running and answer JSON-RPC requests read from stdin, one per line.\n"
+            "No source file is needed on the command line in this mode");
+
+    statsFileOpt.setCategory(arduinoToolCategory);
+    statsFileOpt.setInitialValue("");
+    statsFileOpt.setValueStr("file");
+    statsFileOpt.setDescription("Write the per-phase timings and the peak memory of the run in json format to the given file");
+
+    traceFileOpt.setCategory(arduinoToolCategory);
+    traceFileOpt.setInitialValue("");
+    traceFileOpt.setValueStr("file");
+    traceFileOpt.setDescription("Write a timeline of the run in the Chrome trace event format (chrome://tracing) to the given file");
+
+    jobsOpt.setCategory(arduinoToolCategory);
+    jobsOpt.setInitialValue(1);
+    jobsOpt.setValueStr("n");
+    jobsOpt.setDescription("Number of sketches preprocessed in parallel when more than one is given, 0 uses all the cores");
+
+    outputDirOpt.setCategory(arduinoToolCategory);
+    outputDirOpt.setInitialValue("");
+    outputDirOpt.setValueStr("dir");
+    outputDirOpt.setDescription(
+            "Write the output of each sketch to <dir>/<sketch name>.out instead of stdout. "
+            "Required when more than one sketch is given");
+
     cl::AddExtraVersionPrinter(printVersion);
 
-    CommonOptionsParser optParser(argc, argv, arduinoToolCategory);
+    // Source files are optional on the command line, the server mode receives
+    // them with each request.
+    CommonOptionsParser optParser(argc, argv, arduinoToolCategory, cl::ZeroOrMore);
 
     /* Parse outputCodeCompletion parameter */
     if (outputCodeCompletionsOpt.getValue() != "") {
@@ -107,8 +162,47 @@ CommonOptionsParser doCommandLineParsing(int argc, const char **argv) {
     debugOutput = debugOutputOpt.getValue();
     outputOnlyNeededPrototypes = outputOnlyNeededPrototypesOpt.getValue();
     outputDiagnostics = outputDiagnosticsOpt.getValue();
-    if (outputDiagnostics || outputCodeCompletions) {
+    outputLibraries = outputLibrariesOpt.getValue();
+    libraryDirs.assign(librariesOpt.begin(), librariesOpt.end());
+    if (outputDiagnostics || outputCodeCompletions || outputLibraries) {
         outputPreprocessedSketch = false;
     }
+
+    statsFile = statsFileOpt.getValue();
+    traceFile = traceFileOpt.getValue();
+
+    jobs = jobsOpt.getValue();
+    outputDir = outputDirOpt.getValue();
+
+    serverMode = serverModeOpt.getValue();
+    if (serverMode) {
+        if (debugOutput) {
+            // Debugging messages go to stdout and would break the protocol
+            cerr << "-debug is not supported together with -server, ignoring it\n";
+            debugOutput = false;
+        }
+        if (!statsFile.empty() || !traceFile.empty()) {
+            // The server never ends a run, there would be nothing to write
+            cerr << "-stats and -trace-json are not supported together with -server\n";
+            exit(1);
+        }
+    } else if (optParser.getSourcePathList().empty()) {
+        cerr << "no input file, a sketch is required unless -server is used\n";
+        exit(1);
+    } else if (optParser.getSourcePathList().size() > 1) {
+        if (outputDir.empty()) {
+            cerr << "more than one sketch requires -output-dir\n";
+            exit(1);
+        }
+        if (outputCodeCompletions) {
+            cerr << "code completion requires a single sketch\n";
+            exit(1);
+        }
+        if (debugOutput && jobs != 1) {
+            // Debugging messages of different sketches would be interleaved
+            cerr << "-debug requires -jobs=1\n";
+            exit(1);
+        }
+    }
     return optParser;
 }
\ No newline at end of file
@@ -41,6 +41,13 @@ extern bool debugOutput;
 extern bool outputOnlyNeededPrototypes;
 extern bool outputDiagnostics;
 extern bool outputPreprocessedSketch;
+extern bool outputLibraries;
+extern vector<string> libraryDirs;
+extern bool serverMode;
+extern string statsFile;
+extern string traceFile;
+extern unsigned jobs;
+extern string outputDir;
 
 // Code completion parameters
 extern bool outputCodeCompletions;
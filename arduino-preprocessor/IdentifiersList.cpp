@@ -29,19 +29,41 @@
 
 #include "IdentifiersList.hpp"
 
+void IdentifiersList::add(StringRef identifier, const FullSourceLoc &location) {
+    auto it = index.insert(make_pair(identifier, nullptr)).first;
+    IdentifierLocation *m = new (allocator.Allocate<IdentifierLocation>()) IdentifierLocation;
+    m->location = location;
+    m->identifier = it->getKey();
+    it->second = m;
+    entries.push_back(m);
+
+    if (!earliestEntry || location.isBeforeInTranslationUnitThan(earliestEntry->location)) {
+        earliestEntry = m;
+    }
+}
+
+IdentifierLocation *IdentifiersList::findFirst(StringRef name) {
+    auto it = index.find(name);
+    if (it == index.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+void IdentifiersList::clear() {
+    entries.clear();
+    index.clear();
+    earliestEntry = nullptr;
+    allocator.Reset();
+}
+
 void IdentifiersList::dump(ostream &out) {
     out << "Undeclared identifiers:\n";
-    for (IdentifierLocation *m : * this) {
+    // Most recent first
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it) {
+        IdentifierLocation *m = *it;
         const FullSourceLoc &sl = m->location.getSpellingLoc();
         out << "  " << sl.getSpellingLineNumber() << ":" << sl.getSpellingColumnNumber();
-        out << " " << m->identifier << "\n";
-    }
-}
-
-IdentifierLocation *IdentifiersList::findFirst(string name) {
-    for (IdentifierLocation *m : * this) {
-        if (m->identifier == name)
-            return m;
+        out << " " << m->identifier.str() << "\n";
     }
-    return nullptr;
 }
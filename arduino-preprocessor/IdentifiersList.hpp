@@ -30,21 +30,47 @@
 #pragma once
 
 #include <clang/AST/AST.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Allocator.h>
 
 #include <string>
 #include <iostream>
-#include <list>
+#include <vector>
 
 using namespace clang;
+using namespace llvm;
 using namespace std;
 
 typedef struct {
     FullSourceLoc location;
-    string identifier;
+    // Interned in the index of the list, valid until the list is cleared
+    StringRef identifier;
 } IdentifierLocation;
 
-class IdentifiersList : public list<IdentifierLocation *> {
+// The entries are allocated in an arena and indexed by identifier, they are
+// all released together by clear().
+class IdentifiersList {
 public:
-    IdentifierLocation *findFirst(string name);
+    void add(StringRef identifier, const FullSourceLoc &location);
+
+    // Returns the most recently added entry for name, or nullptr
+    IdentifierLocation *findFirst(StringRef name);
+
+    // Returns the entry with the earliest location in the translation unit
+    IdentifierLocation *earliest() {
+        return earliestEntry;
+    }
+
+    bool empty() {
+        return entries.empty();
+    }
+
+    void clear();
     void dump(ostream &out);
+
+private:
+    BumpPtrAllocator allocator;
+    vector<IdentifierLocation *> entries;
+    StringMap<IdentifierLocation *> index;
+    IdentifierLocation *earliestEntry = nullptr;
 };
@@ -264,4 +264,85 @@ inline json encode(const CodeCompletionResult &cc, const CodeCompletionString *c
         }
     };
     return res;
-}
\ No newline at end of file
+}
+// Streaming versions of the encode() functions used for diagnostics: they
+// write the json text straight to the stream, producing the same bytes of
+// encode(...).dump() without building a json object.
+
+inline void writeJson(raw_ostream &out, StringRef s) {
+    static const char hexify[] = "0123456789abcdef";
+    out << '"';
+    const char *chunk = s.begin();
+    for (const char *c = s.begin(); c != s.end(); ++c) {
+        char escape;
+        switch (*c) {
+            case '"': escape = '"'; break;
+            case '\\': escape = '\\'; break;
+            case '\b': escape = 'b'; break;
+            case '\f': escape = 'f'; break;
+            case '\n': escape = 'n'; break;
+            case '\r': escape = 'r'; break;
+            case '\t': escape = 't'; break;
+            default:
+                if (*c >= 0x00 && *c <= 0x1f) {
+                    escape = 'u';
+                    break;
+                }
+                continue;
+        }
+        out.write(chunk, c - chunk);
+        chunk = c + 1;
+        out << '\\' << escape;
+        if (escape == 'u') {
+            out << "00" << hexify[*c >> 4] << hexify[*c & 0x0f];
+        }
+    }
+    out.write(chunk, s.end() - chunk);
+    out << '"';
+}
+
+inline void writeJson(raw_ostream &out, const SourceManager &sm, const SourceLocation &loc) {
+    PresumedLoc presumed = sm.getPresumedLoc(loc);
+    std::string filename(presumed.getFilename());
+    filename = quoteCppString(filename);
+    out << "{\"file\":";
+    writeJson(out, filename);
+    out << ",\"pos\":\"" << presumed.getLine() << ":" << presumed.getColumn() << "\"}";
+}
+
+inline void writeJson(raw_ostream &out, const SourceManager &sm, const CharSourceRange &range) {
+    if (range.isInvalid()) {
+        out << "null";
+        return;
+    }
+    out << "{\"begin\":";
+    writeJson(out, sm, range.getBegin());
+    out << ",\"end\":";
+    writeJson(out, sm, range.getEnd());
+    out << "}";
+}
+
+inline void writeJson(raw_ostream &out, const SourceManager &sm, const FixItHint &hint) {
+    out << "{\"before_previous\":" << (hint.BeforePreviousInsertions ? "true" : "false");
+    out << ",\"insert_from\":";
+    writeJson(out, sm, hint.InsertFromRange);
+    out << ",\"remove\":";
+    writeJson(out, sm, hint.RemoveRange);
+    out << ",\"text\":";
+    writeJson(out, hint.CodeToInsert);
+    out << "}";
+}
+
+template<typename T>
+inline void writeJson(raw_ostream &out, const SourceManager &sm, const ArrayRef<T> &array) {
+    out << "[";
+    bool first = true;
+    for (const T &elem : array) {
+        if (!first) {
+            out << ",";
+        }
+        first = false;
+        writeJson(out, sm, elem);
+    }
+    out << "]";
+}
@@ -0,0 +1,381 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#include <clang/Basic/LangOptions.h>
+#include <clang/Lex/Lexer.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include <algorithm>
+
+#include "Config.hpp"
+#include "Libraries.hpp"
+#include "utils.hpp"
+
+using namespace clang;
+
+// Changes whenever the layout of the index does, so that the indexes written
+// by other versions are never read
+static const char *indexFormat = "3";
+
+const char *LibrarySymbol::getKindName() const {
+    switch (kind) {
+        case Function: return "Function";
+        case Class: return "CXXRecord";
+        case Macro: return "Macro";
+        case Variable: return "Var";
+    }
+    return "";
+}
+
+// Returns the source folders of the libraries in dirs, in order.
+static vector<string> listSourceDirs(const vector<string> &dirs) {
+    vector<string> sourceDirs;
+    for (const string &dir : dirs) {
+        error_code ec;
+        for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec)) {
+            if (!sys::fs::is_directory(it->path())) {
+                continue;
+            }
+            // Libraries in the 1.5 format keep their sources in src
+            SmallString<256> src(it->path());
+            sys::path::append(src, "src");
+            sourceDirs.push_back(sys::fs::is_directory(src) ? src.str().str() : it->path());
+        }
+    }
+    return sourceDirs;
+}
+
+// A symbol found while building the index, before it's written
+struct IndexedSymbol {
+    string name;
+    char kind;
+    string file;
+    unsigned line;
+    string library;
+};
+
+static bool isIdentifier(const Token &tok, StringRef name = StringRef()) {
+    return tok.is(tok::raw_identifier) && (name.empty() || tok.getRawIdentifier() == name);
+}
+
+static bool isKeyword(StringRef name) {
+    return name == "return" || name == "if" || name == "while" || name == "for" || name == "switch" ||
+            name == "sizeof" || name == "operator" || name == "decltype" || name == "alignof" ||
+            name == "static_assert" || name == "typedef" || name == "using";
+}
+
+// Collects the symbols declared at file or namespace scope by the header at
+// path, with a raw lexer: the headers are not preprocessed, so no include
+// path or compiler option is needed and the macros are found where they are
+// defined. The bodies of the classes and of the functions are skipped.
+static void scanHeader(const string &path, const string &library, vector<IndexedSymbol> &symbols) {
+    ErrorOr<unique_ptr<MemoryBuffer>> buff = MemoryBuffer::getFile(path);
+    if (!buff) {
+        return;
+    }
+    StringRef text = (*buff)->getBuffer();
+    LangOptions opts;
+    opts.CPlusPlus = true;
+    opts.CPlusPlus11 = true;
+    // A fake file location at offset 1 lets the lexer report the offsets of
+    // the tokens, as Lexer::ComputePreamble does
+    SourceLocation start = SourceLocation::getFromRawEncoding(1);
+    Lexer lexer(start, opts, text.begin(), text.begin(), text.end());
+
+    unsigned line = 1;
+    size_t lineOffset = 0;
+    auto lineOf = [&](const Token &tok) {
+        size_t offset = tok.getLocation().getRawEncoding() - start.getRawEncoding();
+        if (offset < lineOffset) {
+            line = 1;
+            lineOffset = 0;
+        }
+        line += std::count(text.begin() + lineOffset, text.begin() + offset, '\n');
+        lineOffset = offset;
+        return line;
+    };
+    auto add = [&](const Token &tok, char kind) {
+        if (!tok.getRawIdentifier().startswith("_")) {
+            symbols.push_back(IndexedSymbol{tok.getRawIdentifier().str(), kind, path, lineOf(tok), library});
+        }
+    };
+
+    // The braces of the namespaces and of extern "C" don't open a scope
+    vector<bool> braces;
+    unsigned depth = 0;
+    unsigned parens = 0;
+    bool isExtern = false;
+    Token prev, prevPrev, className;
+    prev.startToken();
+    prevPrev.startToken();
+    className.startToken();
+    Token tok;
+    lexer.LexFromRawLexer(tok);
+    while (tok.isNot(tok::eof)) {
+        if (tok.is(tok::hash) && tok.isAtStartOfLine()) {
+            lexer.LexFromRawLexer(tok);
+            if (isIdentifier(tok, "define") && !tok.isAtStartOfLine()) {
+                lexer.LexFromRawLexer(tok);
+                Token name = tok;
+                lexer.LexFromRawLexer(tok);
+                // The include guards define nothing
+                if (isIdentifier(name) && !name.isAtStartOfLine() && tok.isNot(tok::eof) && !tok.isAtStartOfLine()) {
+                    add(name, LibrarySymbol::Macro);
+                }
+            }
+            while (tok.isNot(tok::eof) && !tok.isAtStartOfLine()) {
+                lexer.LexFromRawLexer(tok);
+            }
+            continue;
+        }
+
+        if (depth == 0) {
+            // The return type, or the end of it, comes before the name
+            bool afterType = isIdentifier(prevPrev) ? !isKeyword(prevPrev.getRawIdentifier())
+                    : prevPrev.isOneOf(tok::star, tok::amp, tok::greater);
+            if (tok.is(tok::l_paren) && parens == 0 && isIdentifier(prev) && !isKeyword(prev.getRawIdentifier()) &&
+                    afterType) {
+                add(prev, LibrarySymbol::Function);
+            } else if (tok.isOneOf(tok::l_brace, tok::colon) && isIdentifier(className)) {
+                add(className, LibrarySymbol::Class);
+            } else if (tok.is(tok::semi) && parens == 0 && isExtern && isIdentifier(prev)) {
+                add(prev, LibrarySymbol::Variable);
+            }
+            if (isIdentifier(prevPrev, "class") || isIdentifier(prevPrev, "struct")) {
+                className.startToken();
+            }
+            if ((isIdentifier(prev, "class") || isIdentifier(prev, "struct")) && isIdentifier(tok)) {
+                className = tok;
+            }
+            if (isIdentifier(tok, "extern")) {
+                isExtern = true;
+            }
+        }
+
+        if (tok.is(tok::l_paren)) {
+            parens++;
+        } else if (tok.is(tok::r_paren) && parens > 0) {
+            parens--;
+        } else if (tok.is(tok::l_brace)) {
+            bool scope = !(depth == 0 && (isIdentifier(prev, "namespace") || isIdentifier(prevPrev, "namespace") ||
+                    (prev.is(tok::string_literal) && isIdentifier(prevPrev, "extern"))));
+            braces.push_back(scope);
+            if (scope) {
+                depth++;
+            }
+        } else if (tok.is(tok::r_brace) && !braces.empty()) {
+            if (braces.back()) {
+                depth--;
+            }
+            braces.pop_back();
+        }
+        if (depth == 0 && tok.isOneOf(tok::semi, tok::l_brace, tok::r_brace)) {
+            isExtern = false;
+            className.startToken();
+        }
+
+        prevPrev = prev;
+        prev = tok;
+        lexer.LexFromRawLexer(tok);
+    }
+}
+
+// Returns the index of sourceDirs: one "L\tfolder" line per library, one
+// "H\theader\tfolder" line per header and one
+// "S\tname\tkind\tline\tfile\tfolder" line per symbol, sorted by name.
+static string buildIndex(const vector<string> &sourceDirs) {
+    string index;
+    StringMap<bool> seen;
+    vector<IndexedSymbol> symbols;
+    for (const string &dir : sourceDirs) {
+        index += "L\t" + dir + "\n";
+        error_code ec;
+        for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec)) {
+            StringRef ext = sys::path::extension(it->path());
+            if (ext != ".h" && ext != ".hpp") {
+                continue;
+            }
+            StringRef header = sys::path::filename(it->path());
+            if (seen.insert(make_pair(header, true)).second) {
+                index += "H\t" + header.str() + "\t" + dir + "\n";
+            }
+            scanHeader(it->path(), dir, symbols);
+        }
+    }
+    std::stable_sort(symbols.begin(), symbols.end(), [](const IndexedSymbol &a, const IndexedSymbol &b) {
+        return a.name < b.name;
+    });
+    for (const IndexedSymbol &s : symbols) {
+        index += "S\t" + s.name + "\t" + s.kind + "\t" + to_string(s.line) + "\t" + s.file + "\t" + s.library + "\n";
+    }
+    return index;
+}
+
+static string md5Hex(StringRef data) {
+    MD5 hash;
+    hash.update(data);
+    MD5::MD5Result result;
+    hash.final(result);
+    SmallString<32> hex;
+    MD5::stringifyResult(result, hex);
+    return hex.str().str();
+}
+
+// Returns a digest of the names, sizes and modification times of the headers
+// in sourceDirs: it changes whenever a header is edited, added or removed,
+// even if the mtime of its folder doesn't.
+static string headersDigest(const vector<string> &sourceDirs) {
+    string stamps;
+    for (const string &dir : sourceDirs) {
+        stamps += "L\t" + dir + "\n";
+        vector<string> lines;
+        error_code ec;
+        for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec; it.increment(ec)) {
+            StringRef ext = sys::path::extension(it->path());
+            sys::fs::file_status status;
+            if ((ext != ".h" && ext != ".hpp") || sys::fs::status(it->path(), status)) {
+                continue;
+            }
+            lines.push_back("H\t" + it->path() + "\t" + to_string(status.getSize()) + "\t" +
+                    to_string(status.getLastModificationTime().time_since_epoch().count()) + "\n");
+        }
+        // The order of the directory entries is not defined
+        std::sort(lines.begin(), lines.end());
+        for (const string &line : lines) {
+            stamps += line;
+        }
+    }
+    return md5Hex(stamps);
+}
+
+bool LibraryIndex::load(const vector<string> &dirs, string &error) {
+    headers.clear();
+    sourceDirs.clear();
+    symbols.clear();
+    buffer.reset();
+
+    string key = string(VERSION) + " " + indexFormat;
+    for (const string &dir : dirs) {
+        key += "\n" + dir;
+    }
+    SmallString<128> path;
+    sys::path::system_temp_directory(true, path);
+    sys::path::append(path, "arduino-preprocessor-libraries-" + md5Hex(key) + ".idx");
+
+    // The index starts with the digest of the headers it was built from
+    vector<string> folders = listSourceDirs(dirs);
+    string digest = "D\t" + headersDigest(folders) + "\n";
+    ErrorOr<unique_ptr<MemoryBuffer>> saved = MemoryBuffer::getFile(path, -1, false);
+    if (saved && (*saved)->getBuffer().startswith(digest)) {
+        buffer = std::move(*saved);
+    } else {
+        string index = digest + buildIndex(folders);
+        // Written to a temporary file first, a concurrent run never maps a
+        // partial index
+        SmallString<128> tmpPath;
+        int fd;
+        bool written = false;
+        if (!sys::fs::createUniqueFile(path + "-%%%%%%", fd, tmpPath)) {
+            raw_fd_ostream out(fd, true);
+            out << index;
+            out.close();
+            written = !out.has_error() && !sys::fs::rename(tmpPath, path);
+        }
+        if (!written) {
+            // No usable temporary folder, the index lasts for this run only
+            sys::fs::remove(tmpPath);
+            buffer = MemoryBuffer::getMemBufferCopy(index, path);
+        }
+    }
+    if (!buffer) {
+        ErrorOr<unique_ptr<MemoryBuffer>> mapped = MemoryBuffer::getFile(path, -1, false);
+        if (!mapped) {
+            error = "can't read " + path.str().str() + ": " + mapped.getError().message();
+            return false;
+        }
+        buffer = std::move(*mapped);
+    }
+
+    // The keys, the folders and the symbols point into the mapped index
+    StringRef rest = buffer->getBuffer();
+    while (!rest.empty()) {
+        StringRef line;
+        std::tie(line, rest) = rest.split('\n');
+        SmallVector<StringRef, 6> fields;
+        line.split(fields, '\t');
+        if (fields[0] == "L" && fields.size() == 2) {
+            sourceDirs[fields[1]] = true;
+        } else if (fields[0] == "H" && fields.size() == 3) {
+            headers.insert(make_pair(fields[1], fields[2]));
+        } else if (fields[0] == "S" && fields.size() == 6 && fields[2].size() == 1) {
+            LibrarySymbol symbol;
+            symbol.name = fields[1];
+            symbol.kind = static_cast<LibrarySymbol::Kind>(fields[2][0]);
+            symbol.file = fields[4];
+            symbol.library = fields[5];
+            if (!fields[3].getAsInteger(10, symbol.line)) {
+                symbols.push_back(symbol);
+            }
+        }
+    }
+    return true;
+}
+
+StringRef LibraryIndex::find(StringRef header) const {
+    return headers.lookup(header);
+}
+
+bool LibraryIndex::isLibrary(StringRef dir) const {
+    return sourceDirs.count(dir) != 0;
+}
+
+ArrayRef<LibrarySymbol> LibraryIndex::findSymbols(StringRef prefix) const {
+    auto first = std::lower_bound(symbols.begin(), symbols.end(), prefix, [](const LibrarySymbol &s, StringRef p) {
+        return s.name < p;
+    });
+    auto last = first;
+    while (last != symbols.end() && last->name.startswith(prefix)) {
+        ++last;
+    }
+    return ArrayRef<LibrarySymbol>(symbols).slice(first - symbols.begin(), last - first);
+}
+
+StringRef LibraryIndex::findLibraryOf(StringRef name) const {
+    ArrayRef<LibrarySymbol> found = findSymbols(name);
+    for (const LibrarySymbol &s : found) {
+        if (s.name == name) {
+            return s.library;
+        }
+    }
+    return StringRef();
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#pragma once
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace llvm;
+using namespace std;
+
+// A function, class, macro or extern variable declared at file or namespace
+// scope in a library header. The strings point into the mapped index.
+struct LibrarySymbol {
+    enum Kind : char {
+        Function = 'f',
+        Class = 'c',
+        Macro = 'm',
+        Variable = 'v'
+    };
+
+    StringRef name;
+    Kind kind;
+    StringRef file;
+    unsigned line;
+    // Source folder of the library
+    StringRef library;
+
+    // Returns the type of the symbol as reported by the code completions
+    const char *getKindName() const;
+};
+
+// Index of the installed libraries: the name of every header in the source
+// folder of a library (<library>/src or the library folder itself) maps to
+// that folder, and the symbols declared by the headers map to their
+// location. The index is built once in the system temporary folder and
+// memory-mapped by the following runs, it is rebuilt when a libraries folder
+// or the source folder of a library changes.
+class LibraryIndex {
+public:
+    // Loads the index of the libraries in dirs, the first library providing a
+    // header wins. Returns false and sets error if the index can't be built.
+    bool load(const vector<string> &dirs, string &error);
+
+    // Returns the source folder of the library providing header, empty if no
+    // library does.
+    StringRef find(StringRef header) const;
+
+    // Returns true if dir is the source folder of a library of the index.
+    bool isLibrary(StringRef dir) const;
+
+    // Returns the symbols whose name starts with prefix, sorted by name.
+    ArrayRef<LibrarySymbol> findSymbols(StringRef prefix) const;
+
+    // Returns the source folder of the library declaring name, empty if no
+    // library does.
+    StringRef findLibraryOf(StringRef name) const;
+
+private:
+    unique_ptr<MemoryBuffer> buffer;
+    StringMap<StringRef> headers;
+    StringMap<bool> sourceDirs;
+    // Sorted by name, as written in the index
+    vector<LibrarySymbol> symbols;
+};
@@ -0,0 +1,465 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#include <clang/AST/AST.h>
+#include <clang/AST/ASTConsumer.h>
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/ASTMatchers/ASTMatchFinder.h>
+#include <clang/ASTMatchers/ASTMatchers.h>
+#include <clang/Driver/Options.h>
+#include <clang/Frontend/ASTConsumers.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Lex/PPCallbacks.h>
+#include <clang/Lex/Preprocessor.h>
+#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/Support/Timer.h>
+
+#include <algorithm>
+#include <iostream>
+#include <sstream>
+#include <list>
+
+#include "CommandLine.hpp"
+#include "IdentifiersList.hpp"
+#include "Preprocessor.hpp"
+#include "Trace.hpp"
+#include "utils.hpp"
+
+using namespace clang;
+using namespace clang::ast_matchers;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+void PreprocessorStats::add(const PreprocessorStats &other) {
+    match += other.match;
+    rewrite += other.rewrite;
+    callback += other.callback;
+    functionMatches += other.functionMatches;
+    variableMatches += other.variableMatches;
+}
+
+class INOPreprocessorMatcherCallback : public MatchFinder::MatchCallback {
+    PreprocessorContext &context;
+    bool insertionPointFound = false;
+    bool firstLineInserted = false;
+    FullSourceLoc insertionPoint;
+    PresumedLoc presumedInsertionPoint;
+
+    DeclarationMatcher funcMatcher = functionDecl(isDefinition()).bind("function_decl");
+    DeclarationMatcher varMatcher = varDecl().bind("var_decl");
+    //StatementMatcher funcCallMatcher = callExpr().bind("function_call");
+public:
+
+    INOPreprocessorMatcherCallback(PreprocessorContext &context) : context(context) {
+    }
+
+    void attachTo(MatchFinder &finder) {
+        finder.addMatcher(funcMatcher, this);
+        finder.addMatcher(varMatcher, this);
+        //finder.addMatcher(funcCallMatcher, &funcDeclaredCB);
+    }
+
+    StringRef getID() const override {
+        return "INOPreprocessorMatcherCallback";
+    }
+
+    void run(const MatchFinder::MatchResult &match) override {
+        TraceScope trace("INOPreprocessorMatcherCallback");
+        ASTContext *ctx = match.Context;
+        SourceManager &sm = ctx->getSourceManager();
+
+        const FunctionDecl *f = match.Nodes.getNodeAs<FunctionDecl>("function_decl");
+        if (f) {
+            context.stats.functionMatches++;
+            FullSourceLoc loc = ctx->getFullLoc(f->getLocStart());
+            SourceRange r = f->getSourceRange();
+            FullSourceLoc begin = ctx->getFullLoc(r.getBegin());
+            FullSourceLoc end = ctx->getFullLoc(r.getEnd());
+
+            if (debugOutput) {
+                outs() << "Function " << f->getName() << " declared at ";
+                outs() << loc.getSpellingLineNumber() << ":" << loc.getSpellingColumnNumber();
+                outs() << " (range " << begin.getSpellingLineNumber() << ":" << begin.getSpellingColumnNumber();
+                outs() << " to " << end.getSpellingLineNumber() << ":" << end.getSpellingColumnNumber() << ")\n";
+            }
+
+            if (dyn_cast<CXXMethodDecl>(f)) {
+                if (debugOutput) {
+                    outs() << "  Ignored CXX method declaration.\n";
+                }
+                return;
+            }
+
+            if (dyn_cast<CXXConstructorDecl>(f)) {
+                if (debugOutput) {
+                    outs() << "  Ignored CXX constructor declaration.\n";
+                }
+                return;
+            }
+
+            if (f->getParentFunctionOrMethod()) {
+                if (debugOutput) {
+                    outs() << "  Function is not top level, ignoring.\n";
+                }
+                return;
+            }
+
+            //f->dump();
+
+            detectInsertionPoint(sm, begin, end);
+            if (!insertionPointFound) {
+                return;
+            }
+
+            if (outputOnlyNeededPrototypes) {
+                // Check if this function is called and needs a forward declaration
+                IdentifierLocation *und = context.undeclaredIdentifiers.findFirst(f->getName());
+                if (!und) {
+                    if (debugOutput) {
+                        outs() << "  This function is not forward-called and do not need a prototype.\n";
+                    }
+                    return;
+                }
+            }
+
+            // Extract line pragma for prototype insertion
+            writeLineInfo(sm.getPresumedLoc(loc, true));
+
+            // Extract prototype from function using the pretty printer
+            // and stopping at the first open curly brace "{"
+            if (f->isExternC()) {
+                context.rewriter.InsertTextAfter(insertionPoint, "extern \"C\" ");
+            }
+            string proto;
+            raw_string_ostream o(proto);
+            f->print(o);
+            o.flush();
+            proto = proto.substr(0, proto.find_first_of('{') - 1) + ";\n";
+            context.rewriter.InsertTextAfter(insertionPoint, proto);
+            firstLineInserted = true;
+            if (debugOutput) {
+                outs() << "  Generated prototype: " << proto;
+            }
+        }
+
+        const VarDecl *v = match.Nodes.getNodeAs<VarDecl>("var_decl");
+        if (v) {
+            context.stats.variableMatches++;
+            if (v->getParentFunctionOrMethod()) {
+                //if (debugOutput) {
+                //    outs() << "  Variable is not top level, ignoring.\n";
+                //}
+                return;
+            }
+
+            FullSourceLoc loc = ctx->getFullLoc(v->getLocStart());
+            SourceRange r = v->getSourceRange();
+            FullSourceLoc begin = ctx->getFullLoc(r.getBegin());
+            FullSourceLoc end = ctx->getFullLoc(r.getEnd());
+
+            if (debugOutput) {
+                outs() << "Variable " << v->getName() << " declared at ";
+                outs() << loc.getSpellingLineNumber() << ":" << loc.getSpellingColumnNumber();
+                outs() << " (range " << begin.getSpellingLineNumber() << ":" << begin.getSpellingColumnNumber();
+                outs() << " to " << end.getSpellingLineNumber() << ":" << end.getSpellingColumnNumber() << ")\n";
+            }
+
+            detectInsertionPoint(sm, begin, end);
+        }
+    }
+
+    void detectInsertionPoint(SourceManager &sm, FullSourceLoc &begin, FullSourceLoc &end) {
+        if (insertionPointFound) {
+            return;
+        }
+
+        if (context.undeclaredIdentifiers.empty()) {
+            //insertionPoint = begin;
+            //insertionPointFound = true;
+            //if (debugOutput) {
+            //    outs() << "  !! Insertion point found (using the first available position)\n";
+            //}
+            return;
+        }
+
+        FullSourceLoc first = context.undeclaredIdentifiers.earliest()->location;
+        if (first.isBeforeInTranslationUnitThan(begin)) {
+            markInsertionPointAsFound();
+            return;
+        }
+
+        if (end.isInvalid()) {
+            return;
+        }
+
+        insertionPoint = begin;
+        presumedInsertionPoint = sm.getPresumedLoc(begin, true);
+        if (debugOutput) {
+            outs() << "  Insertion point pushed to ";
+            outs() << begin.getSpellingLineNumber() << ":" << begin.getSpellingColumnNumber() << "\n";
+        }
+
+        if (first.isBeforeInTranslationUnitThan(end)) {
+            markInsertionPointAsFound();
+        }
+    }
+
+    void markInsertionPointAsFound() {
+        if (debugOutput) {
+            outs() << "  !! Insertion point found at ";
+            outs() << insertionPoint.getSpellingLineNumber() << ":" << insertionPoint.getSpellingColumnNumber() << "\n";
+        }
+        insertionPointFound = true;
+
+        if (insertionPoint.getSpellingColumnNumber() != 1) {
+            if (debugOutput) {
+                outs() << "     Insertion point is not at the line beginning -> adding a newline\n";
+            }
+            context.rewriter.InsertTextAfter(insertionPoint, "\n");
+        }
+    }
+
+    void onEndOfTranslationUnit() override {
+        if (firstLineInserted) {
+            writeLineInfo(presumedInsertionPoint);
+        }
+    }
+
+    // Returns where the prototypes are inserted, invalid if nothing is inserted
+    FullSourceLoc getInsertionPoint() {
+        return insertionPoint;
+    }
+
+    void writeLineInfo(const PresumedLoc &presumed) {
+        ostringstream lineInfo;
+        lineInfo << "#line " << presumed.getLine();
+        lineInfo << " \"" << presumed.getFilename() << "\"\n";
+        std::string lineInfoAsStr = lineInfo.str();
+        lineInfoAsStr = quoteCppString(lineInfoAsStr);
+        context.rewriter.InsertTextAfter(insertionPoint, lineInfoAsStr);
+    }
+};
+
+// Finds the libraries of the sketch while it's parsed: an include missing
+// from the include paths is looked up in the library index and the source
+// folder of the library providing it becomes an include path for the rest of
+// the run. The libraries included by the libraries are found the same way,
+// with a single parse and no compiler run per library.
+class LibraryResolver : public PPCallbacks {
+    PreprocessorContext &context;
+
+public:
+
+    LibraryResolver(PreprocessorContext &context) : context(context) {
+    }
+
+    bool FileNotFound(StringRef fileName, SmallVectorImpl<char> &recoveryPath) override {
+        StringRef dir = context.libraryIndex->find(fileName);
+        if (dir.empty()) {
+            return false;
+        }
+        if (debugOutput) {
+            outs() << "Found " << fileName << " in library " << dir << "\n";
+        }
+        recoveryPath.assign(dir.begin(), dir.end());
+        return true;
+    }
+
+    // Records the libraries in the order of their first include, including
+    // the ones already in the include paths given on the command line
+    void InclusionDirective(SourceLocation hashLoc, const Token &includeTok, StringRef fileName,
+            bool isAngled, CharSourceRange filenameRange, const FileEntry *file, StringRef searchPath,
+            StringRef relativePath, const clang::Module *imported) override {
+        vector<string> &used = context.usedLibraries;
+        if (file && context.libraryIndex->isLibrary(searchPath) &&
+                std::find(used.begin(), used.end(), searchPath) == used.end()) {
+            used.push_back(searchPath.str());
+        }
+    }
+};
+
+static MatchFinder::MatchFinderOptions matchFinderOptions(PreprocessorContext &context) {
+    MatchFinder::MatchFinderOptions options;
+    if (!statsFile.empty()) {
+        options.CheckProfiling.emplace(context.matcherProfile);
+    }
+    return options;
+}
+
+// Measures the time spent in the AST matching by the wrapped consumer
+class TimedASTConsumer : public ASTConsumer {
+    unique_ptr<ASTConsumer> consumer;
+    PreprocessorStats &stats;
+
+public:
+
+    TimedASTConsumer(unique_ptr<ASTConsumer> consumer, PreprocessorStats &stats) : consumer(std::move(consumer)),
+    stats(stats) {
+    }
+
+    void HandleTranslationUnit(ASTContext &ctx) override {
+        TraceScope trace("MatchFinder::matchAST");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        consumer->HandleTranslationUnit(ctx);
+        stats.match += secondsSince(start);
+    }
+};
+
+class INOPreprocessAction : public ASTFrontendAction {
+    PreprocessorContext &context;
+    MatchFinder finder;
+    INOPreprocessorMatcherCallback funcDeclaredCB;
+
+public:
+
+    INOPreprocessAction(PreprocessorContext &context) : context(context), finder(matchFinderOptions(context)),
+    funcDeclaredCB(context) {
+        funcDeclaredCB.attachTo(finder);
+    }
+
+    bool BeginSourceFileAction(CompilerInstance &compiler, StringRef filename) override {
+        if (context.libraryIndex) {
+            compiler.getPreprocessor().addPPCallbacks(llvm::make_unique<LibraryResolver>(context));
+        }
+        return true;
+    }
+
+    unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &compiler, StringRef inFile) override {
+        context.rewriter.setSourceMgr(compiler.getSourceManager(), compiler.getLangOpts());
+        return unique_ptr<ASTConsumer>(new TimedASTConsumer(finder.newASTConsumer(), context.stats));
+    }
+
+    virtual void EndSourceFileAction() override {
+        TraceScope trace("Rewrite");
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        if (debugOutput) {
+            ostringstream out;
+            context.undeclaredIdentifiers.dump(out);
+            out.flush();
+            outs() << out.str();
+        }
+
+        const FileID mainFileID = context.rewriter.getSourceMgr().getMainFileID();
+        const RewriteBuffer *buf = context.rewriter.getRewriteBufferFor(mainFileID);
+        if (buf == nullptr) {
+            // No changes needed, output the source file as-is
+            auto buff = context.rewriter.getSourceMgr().getBuffer(mainFileID);
+            context.preprocessedSketch = buff->getBuffer().str();
+        } else {
+            context.preprocessedSketch = string(buf->begin(), buf->end());
+        }
+
+        recordTopLevelDecls();
+        context.stats.rewrite += secondsSince(start);
+        context.stats.callback = context.matcherProfile.lookup(funcDeclaredCB.getID()).getWallTime();
+    }
+
+    // Records where the top level declarations start in the preprocessed
+    // sketch: code completion can split the sketch at these points and
+    // precompile the part above the cursor.
+    void recordTopLevelDecls() {
+        CompilerInstance &ci = getCompilerInstance();
+        if (!ci.hasASTContext()) {
+            return;
+        }
+        SourceManager &sm = ci.getSourceManager();
+        const FileID mainFileID = sm.getMainFileID();
+
+        // All the prototypes are inserted at the same point, the declarations
+        // that follow are shifted by the length of the inserted text.
+        unsigned inserted = context.preprocessedSketch.size() - sm.getBuffer(mainFileID)->getBufferSize();
+        unsigned insertionOffset = 0;
+        if (inserted) {
+            insertionOffset = sm.getFileOffset(funcDeclaredCB.getInsertionPoint());
+        }
+
+        // The declarations of a precompiled preamble are not in the main
+        // file, there is no need to load them
+        vector<unsigned> &offsets = context.topLevelDeclOffsets;
+        for (Decl *d : ci.getASTContext().getTranslationUnitDecl()->noload_decls()) {
+            SourceLocation loc = sm.getExpansionLoc(d->getLocStart());
+            if (loc.isInvalid() || sm.getFileID(loc) != mainFileID) {
+                continue;
+            }
+            unsigned offset = sm.getFileOffset(loc);
+            if (inserted && offset >= insertionOffset) {
+                offset += inserted;
+            }
+            offsets.push_back(offset);
+        }
+        sort(offsets.begin(), offsets.end());
+        offsets.erase(unique(offsets.begin(), offsets.end()), offsets.end());
+    }
+};
+
+// Precompiles the preamble of a sketch, the block of directives at its top,
+// so that the following runs parse only the code after it. The includes are
+// resolved with the libraries of the index like in the preprocess action.
+class PreambleAction : public GeneratePCHAction {
+    PreprocessorContext &context;
+    string pchPath;
+
+public:
+
+    PreambleAction(PreprocessorContext &context, const string &pchPath) : context(context), pchPath(pchPath) {
+    }
+
+    unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &compiler, StringRef inFile) override {
+        if (context.libraryIndex) {
+            compiler.getPreprocessor().addPPCallbacks(llvm::make_unique<LibraryResolver>(context));
+        }
+        compiler.getFrontendOpts().OutputFile = pchPath;
+        return GeneratePCHAction::CreateASTConsumer(compiler, inFile);
+    }
+};
+
+class INOPreprocessActionFactory : public FrontendActionFactory {
+    PreprocessorContext &context;
+
+public:
+
+    INOPreprocessActionFactory(PreprocessorContext &context) : context(context) {
+    }
+
+    FrontendAction *create() override {
+        return new INOPreprocessAction(context);
+    }
+};
+
+unique_ptr<FrontendActionFactory> NewPreprocessActionFactory(PreprocessorContext &context) {
+    return unique_ptr<FrontendActionFactory>(new INOPreprocessActionFactory(context));
+}
+
+FrontendAction *NewPreambleAction(PreprocessorContext &context, const string &pchPath) {
+    return new PreambleAction(context, pchPath);
+}
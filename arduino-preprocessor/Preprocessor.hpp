@@ -0,0 +1,94 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#pragma once
+
+#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Timer.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "IdentifiersList.hpp"
+#include "Libraries.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace std;
+
+// Counters of the preprocess action. The times are wall-clock seconds spent
+// in matching the AST, in rendering the rewritten sketch and in the matcher
+// callback (only measured with -stats).
+struct PreprocessorStats {
+    double match = 0;
+    double rewrite = 0;
+    double callback = 0;
+    unsigned functionMatches = 0;
+    unsigned variableMatches = 0;
+
+    // Sums the counters of another run, for the stats of a batch
+    void add(const PreprocessorStats &other);
+};
+
+// The state of the preprocessing of one sketch: what the run collects and
+// what it produces. Every sketch gets its own context, so that many sketches
+// can be preprocessed by the same process, also in parallel.
+struct PreprocessorContext {
+    // Undeclared identifiers collected by the diagnostic consumer during the
+    // run, they drive the placement of the prototypes.
+    IdentifiersList undeclaredIdentifiers;
+    Rewriter rewriter;
+    // Resolves the includes not found in the include paths with the
+    // libraries of the index, null disables the library lookup.
+    const LibraryIndex *libraryIndex = nullptr;
+
+    // The processed sketch
+    string preprocessedSketch;
+    // The offsets in the processed sketch where the top level declarations
+    // start, in increasing order.
+    vector<unsigned> topLevelDeclOffsets;
+    // The source folders of the libraries included, in the order they were
+    // first included.
+    vector<string> usedLibraries;
+    PreprocessorStats stats;
+    // Time spent in each matcher callback, filled by the MatchFinder when
+    // -stats is used
+    StringMap<TimeRecord> matcherProfile;
+};
+
+// Returns a factory for the frontend action that adds the missing prototypes
+// to the sketch. The runs of the actions fill context, that must outlive them.
+unique_ptr<FrontendActionFactory> NewPreprocessActionFactory(PreprocessorContext &context);
+
+// Returns a new action that precompiles its input in pchPath. The used
+// libraries found while parsing it are added to context.
+FrontendAction *NewPreambleAction(PreprocessorContext &context, const string &pchPath);
@@ -0,0 +1,901 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#include <clang/Basic/Diagnostic.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/FileSystemOptions.h>
+#include <clang/Lex/Lexer.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
+#include <clang/Tooling/Tooling.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/Support/Chrono.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+
+#include <algorithm>
+#include <ctime>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "ArduinoDiagnosticConsumer.hpp"
+#include "CodeCompletion.hpp"
+#include "CommandLine.hpp"
+#include "JsonImpl.hpp"
+#include "Libraries.hpp"
+#include "Preprocessor.hpp"
+#include "Server.hpp"
+#include "Sketch.hpp"
+#include "Trace.hpp"
+#include "utils.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace llvm;
+using namespace std;
+
+// JSON-RPC error codes
+static const int parseError = -32700;
+static const int invalidRequest = -32600;
+static const int methodNotFound = -32601;
+static const int invalidParams = -32602;
+
+// The block of directives at the top of a sketch, precompiled in pchPath.
+// Its diagnostics and libraries are added to the ones of each run that
+// uses it.
+struct Preamble {
+    // The code it was built from
+    string code;
+    // False if the code has errors, the whole sketch is parsed then
+    bool valid = false;
+    string pchPath;
+    vector<string> diagnostics;
+    vector<string> libraries;
+};
+
+// A file read from disk by a run, with the size and the modification time
+// it had then.
+struct Input {
+    string path;
+    off_t size;
+    time_t modificationTime;
+};
+
+// Result of the last run of the preprocessor on a sketch, it's reused by
+// the following requests as long as neither the sketch content nor the
+// headers it read change.
+struct SketchState {
+    bool valid = false;
+    string code;
+    string preprocessed;
+    vector<unsigned> declOffsets;
+    vector<string> libraries;
+    // Diagnostics as json objects
+    vector<string> diagnostics;
+    // The diagnostics last sent, the base of the next delta
+    vector<string> sentDiagnostics;
+    Preamble preamble;
+    // The compile command, code completion parses the sketch with it
+    CommandLineArguments args;
+    vector<Input> inputs;
+};
+
+// Forwards the diagnostics, noting the fatal errors without a location: they
+// are raised when the precompiled preamble can't be loaded, for example
+// because one of its headers changed on disk.
+class PreambleCheck : public ForwardingDiagnosticConsumer {
+public:
+    bool preambleFailed = false;
+
+    PreambleCheck(DiagnosticConsumer &target) : ForwardingDiagnosticConsumer(target) {
+    }
+
+    void HandleDiagnostic(DiagnosticsEngine::Level level, const Diagnostic &info) override {
+        if (level == DiagnosticsEngine::Fatal && info.getLocation().isInvalid() &&
+                info.getID() != diag::fatal_too_many_errors) {
+            preambleFailed = true;
+        }
+        ForwardingDiagnosticConsumer::HandleDiagnostic(level, info);
+    }
+};
+
+// Checks the syntax of a JSON text before it's parsed: the json library is
+// built without exceptions and aborts on malformed input.
+class JsonValidator {
+    // Deeper nesting is rejected, it would exhaust the stack of the parser
+    static const unsigned maxDepth = 256;
+    StringRef text;
+    size_t pos = 0;
+    unsigned depth = 0;
+
+public:
+
+    JsonValidator(StringRef text) : text(text) {
+    }
+
+    bool validate() {
+        skipSpaces();
+        if (!value()) {
+            return false;
+        }
+        skipSpaces();
+        return pos == text.size();
+    }
+
+private:
+
+    void skipSpaces() {
+        while (pos < text.size() && (text[pos] == ' ' || text[pos] == '\t' || text[pos] == '\r' || text[pos] == '\n')) {
+            pos++;
+        }
+    }
+
+    bool consume(char c) {
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    bool consumeDigits() {
+        size_t start = pos;
+        while (pos < text.size() && isdigit(static_cast<unsigned char>(text[pos]))) {
+            pos++;
+        }
+        return pos > start;
+    }
+
+    bool literal(StringRef word) {
+        if (!text.substr(pos).startswith(word)) {
+            return false;
+        }
+        pos += word.size();
+        return true;
+    }
+
+    bool value() {
+        if (pos >= text.size()) {
+            return false;
+        }
+        switch (text[pos]) {
+        case '{':
+            return container('}');
+        case '[':
+            return container(']');
+        case '"':
+            return str();
+        case 't':
+            return literal("true");
+        case 'f':
+            return literal("false");
+        case 'n':
+            return literal("null");
+        default:
+            return number();
+        }
+    }
+
+    // An object or an array, the opening brace is at pos
+    bool container(char close) {
+        if (++depth > maxDepth) {
+            return false;
+        }
+        pos++;
+        skipSpaces();
+        if (!consume(close)) {
+            do {
+                skipSpaces();
+                if (close == '}') {
+                    if (!str()) {
+                        return false;
+                    }
+                    skipSpaces();
+                    if (!consume(':')) {
+                        return false;
+                    }
+                    skipSpaces();
+                }
+                if (!value()) {
+                    return false;
+                }
+                skipSpaces();
+            } while (consume(','));
+            if (!consume(close)) {
+                return false;
+            }
+        }
+        depth--;
+        return true;
+    }
+
+    bool hex4(unsigned &codePoint) {
+        if (pos + 4 > text.size() ||
+                !all_of(text.begin() + pos, text.begin() + pos + 4,
+                        [](char c) { return isxdigit(static_cast<unsigned char>(c)) != 0; }) ||
+                text.substr(pos, 4).getAsInteger(16, codePoint)) {
+            return false;
+        }
+        pos += 4;
+        return true;
+    }
+
+    bool str() {
+        if (!consume('"')) {
+            return false;
+        }
+        while (pos < text.size()) {
+            unsigned char c = text[pos++];
+            if (c == '"') {
+                return true;
+            }
+            if (c < 0x20) {
+                return false;
+            }
+            if (c != '\\') {
+                continue;
+            }
+            if (pos >= text.size()) {
+                return false;
+            }
+            char escape = text[pos++];
+            if (escape != 'u') {
+                if (StringRef("\"\\/bfnrt").find(escape) == StringRef::npos) {
+                    return false;
+                }
+                continue;
+            }
+            // The surrogates must come in pairs
+            unsigned codePoint, low;
+            if (!hex4(codePoint)) {
+                return false;
+            }
+            if (codePoint >= 0xD800 && codePoint <= 0xDBFF) {
+                if (!literal("\\u") || !hex4(low) || low < 0xDC00 || low > 0xDFFF) {
+                    return false;
+                }
+            } else if (codePoint >= 0xDC00 && codePoint <= 0xDFFF) {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    bool number() {
+        consume('-');
+        if (!consume('0') && !consumeDigits()) {
+            return false;
+        }
+        if (consume('.') && !consumeDigits()) {
+            return false;
+        }
+        if (consume('e') || consume('E')) {
+            if (!consume('+')) {
+                consume('-');
+            }
+            if (!consumeDigits()) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+class Server {
+    const CompilationDatabase &compilations;
+    map<string, SketchState> sketches;
+    // Loaded once for the whole session
+    LibraryIndex libraries;
+    bool exitRequested = false;
+
+public:
+
+    Server(const CompilationDatabase &compilations) : compilations(compilations) {
+        if (libraryDirs.empty()) {
+            return;
+        }
+        string error;
+        if (!libraries.load(libraryDirs, error)) {
+            cerr << error << "\n";
+        }
+    }
+
+    ~Server() {
+        for (auto &it : sketches) {
+            if (!it.second.preamble.pchPath.empty()) {
+                sys::fs::remove(it.second.preamble.pchPath);
+            }
+        }
+    }
+
+    bool exiting() {
+        return exitRequested;
+    }
+
+    void handle(const string &line) {
+        if (!JsonValidator(line).validate()) {
+            replyError(json(), parseError, "parse error");
+            return;
+        }
+        json request = json::parse(line);
+        if (!request.is_object()) {
+            replyError(json(), invalidRequest, "request must be a json object");
+            return;
+        }
+
+        json id;
+        auto idIt = request.find("id");
+        if (idIt != request.end()) {
+            id = *idIt;
+        }
+
+        string method;
+        if (!getString(request, "method", method)) {
+            replyError(id, invalidRequest, "missing method");
+            return;
+        }
+
+        json params = json::object();
+        auto paramsIt = request.find("params");
+        if (paramsIt != request.end() && paramsIt->is_object()) {
+            params = *paramsIt;
+        }
+
+        if (method == "exit") {
+            exitRequested = true;
+            reply(id, "null");
+            return;
+        }
+        if (method == "library") {
+            // Answered by the library index, no sketch is needed
+            string symbol;
+            if (!getString(params, "symbol", symbol)) {
+                replyError(id, invalidParams, "missing 'symbol' parameter");
+                return;
+            }
+            StringRef dir = libraries.findLibraryOf(symbol);
+            reply(id, dir.empty() ? "null" : json(dir.str()).dump());
+            return;
+        }
+        if (method != "preprocess" && method != "diagnostics" && method != "completion") {
+            replyError(id, methodNotFound, "unknown method: " + method);
+            return;
+        }
+
+        string error;
+        string filename;
+        SketchState *sketch = update(params, filename, error);
+        if (!sketch) {
+            replyError(id, invalidParams, error);
+            return;
+        }
+
+        if (method == "preprocess") {
+            reply(id, json{{"code", sketch->preprocessed}, {"libraries", sketch->libraries}}.dump());
+        } else if (method == "diagnostics") {
+            bool delta = false;
+            getBool(params, "delta", delta);
+            reply(id, delta ? diagnosticsDelta(sketch->sentDiagnostics, sketch->diagnostics) :
+                    jsonArray(sketch->diagnostics));
+            sketch->sentDiagnostics = sketch->diagnostics;
+        } else {
+            complete(id, params, filename, *sketch);
+        }
+    }
+
+private:
+
+    // Brings the state of the sketch named in the request up to date, running
+    // the preprocessor only if the content or one of the headers it read
+    // changed since the last request.
+    SketchState *update(const json &params, string &filename, string &error) {
+        if (!getString(params, "file", filename)) {
+            error = "missing 'file' parameter";
+            return nullptr;
+        }
+        filename = getAbsolutePath(filename);
+
+        string code;
+        if (IsSketchDirectory(filename)) {
+            // The .ino files are read again on each request, the sketch is
+            // reprocessed only if one of them changed
+            Sketch sketch;
+            if (!LoadSketch(filename, sketch, error)) {
+                return nullptr;
+            }
+            filename = sketch.mainFile;
+            code = std::move(sketch.code);
+        } else if (!getString(params, "code", code)) {
+            // No unsaved content from the editor, use the file on disk
+            ErrorOr<unique_ptr<MemoryBuffer>> buff = MemoryBuffer::getFile(filename);
+            if (!buff) {
+                error = "can't read " + filename + ": " + buff.getError().message();
+                return nullptr;
+            }
+            code = (*buff)->getBuffer().str();
+        }
+
+        SketchState &sketch = sketches[filename];
+        if (sketch.valid && sketch.code == code && !inputsChanged(sketch.inputs)) {
+            return &sketch;
+        }
+
+        vector<CompileCommand> commands = compilations.getCompileCommands(filename);
+        if (commands.empty()) {
+            error = "no compile command for " + filename;
+            return nullptr;
+        }
+        CommandLineArguments args = commands[0].CommandLine;
+        args = getClangSyntaxOnlyAdjuster()(args, filename);
+        args = getClangStripOutputAdjuster()(args, filename);
+
+        // The block of directives at the top of the sketch is precompiled
+        // and reused while it doesn't change: the runs that follow an edit
+        // parse only the code after it.
+        pair<unsigned, bool> preambleBounds = Lexer::ComputePreamble(code, preambleLangOpts());
+        // The FileManager never checks again a file it has looked up, a new
+        // one for each request sees the headers edited in the meantime.
+        IntrusiveRefCntPtr<FileManager> files(new FileManager(FileSystemOptions()));
+        bool usePreamble = preambleBounds.first > 0 && preambleBounds.second &&
+                updatePreamble(filename, code.substr(0, preambleBounds.first), args, *files, sketch.preamble);
+        if (!usePreamble || !run(filename, code, args, *files, &sketch.preamble, sketch)) {
+            if (usePreamble) {
+                // Its headers changed on disk, it's built again on the next
+                // request
+                sketch.preamble.code.clear();
+            }
+            run(filename, code, args, *files, nullptr, sketch);
+        }
+        if (sketch.valid) {
+            shiftDiagnostics(filename, sketch.code, code, sketch.sentDiagnostics);
+        }
+        sketch.code = std::move(code);
+        sketch.args = std::move(args);
+        sketch.inputs = inputsOf(*files, filename);
+        sketch.valid = true;
+        return &sketch;
+    }
+
+    // The files the runs looked up on the FileManager: the headers, the
+    // precompiled preamble and its inputs. The sketch and the preamble
+    // header are mapped to the code of the request and left out.
+    static vector<Input> inputsOf(const FileManager &files, const string &filename) {
+        SmallVector<const FileEntry *, 64> entries;
+        files.GetUniqueIDMapping(entries);
+        vector<Input> inputs;
+        for (const FileEntry *entry : entries) {
+            if (!entry) {
+                continue;
+            }
+            string path = entry->getName();
+            if (path == filename || path == filename + ".preamble.hpp") {
+                continue;
+            }
+            inputs.push_back({path, entry->getSize(), entry->getModificationTime()});
+        }
+        return inputs;
+    }
+
+    static bool inputsChanged(const vector<Input> &inputs) {
+        for (const Input &input : inputs) {
+            sys::fs::file_status status;
+            if (sys::fs::status(input.path, status) || status.getSize() != static_cast<uint64_t>(input.size) ||
+                    sys::toTimeT(status.getLastModificationTime()) != input.modificationTime) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static LangOptions preambleLangOpts() {
+        LangOptions langOpts;
+        langOpts.CPlusPlus = true;
+        return langOpts;
+    }
+
+    // Precompiles the preamble of the sketch, unless the one built for the
+    // previous request has the same code. Returns false if it has errors:
+    // they are reported by a run on the whole sketch.
+    bool updatePreamble(const string &filename, const string &code, CommandLineArguments args, FileManager &files,
+            Preamble &preamble) {
+        if (preamble.code == code) {
+            return preamble.valid;
+        }
+        preamble.code = code;
+        preamble.valid = false;
+        // Each build is written to a new file: a FileManager that looked up
+        // the previous one would read the new content with the old size
+        SmallString<128> pchPath;
+        if (sys::fs::createTemporaryFile("arduino-preprocessor-preamble", "pch", pchPath)) {
+            return false;
+        }
+        if (!preamble.pchPath.empty()) {
+            sys::fs::remove(preamble.pchPath);
+        }
+        preamble.pchPath = pchPath.str().str();
+
+        // The preamble is parsed as a header with the options of the sketch
+        string header = filename + ".preamble.hpp";
+        auto input = std::find(args.begin(), args.end(), filename);
+        if (input == args.end()) {
+            return false;
+        }
+        *input = header;
+
+        PreprocessorContext context;
+        if (!libraryDirs.empty()) {
+            context.libraryIndex = &libraries;
+        }
+        string diagnostics;
+        raw_string_ostream diagnosticsOut(diagnostics);
+        ArduinoDiagnosticConsumer dc;
+        dc.outputJsonDiagnosticsTo(diagnosticsOut);
+
+        TraceScope trace("Preamble", filename);
+        ToolInvocation invocation(std::move(args), NewPreambleAction(context, preamble.pchPath), &files);
+        invocation.mapVirtualFile(header, preambleHeader(filename, code));
+        invocation.setDiagnosticConsumer(&dc);
+        // Fails if errors occurred
+        bool ok = invocation.run();
+        dc.finish();
+        diagnosticsOut.flush();
+        if (!ok) {
+            return false;
+        }
+
+        preamble.diagnostics.clear();
+        appendJsonLines(diagnostics, preamble.diagnostics);
+        preamble.libraries = std::move(context.usedLibraries);
+        preamble.valid = true;
+        return true;
+    }
+
+    // The content of the header precompiled for the preamble, its
+    // diagnostics are reported in the sketch
+    static string preambleHeader(const string &filename, const string &code) {
+        string name = filename;
+        return "#line 1 \"" + quoteCppString(name) + "\"\n" + code;
+    }
+
+    // Runs the preprocessor on the sketch and stores the result in its
+    // state. With a preamble only the code after it is parsed, a #line
+    // directive keeps the locations of the diagnostics unchanged. Returns
+    // false if the preamble can't be used.
+    bool run(const string &filename, const string &code, CommandLineArguments args, FileManager &files,
+            const Preamble *preamble, SketchState &sketch) {
+        PreprocessorContext context;
+        if (!libraryDirs.empty()) {
+            context.libraryIndex = &libraries;
+        }
+
+        string diagnostics;
+        raw_string_ostream diagnosticsOut(diagnostics);
+        ArduinoDiagnosticConsumer dc;
+        dc.collectUndeclaredIdentifiersIn(context.undeclaredIdentifiers);
+        dc.outputJsonDiagnosticsTo(diagnosticsOut);
+        PreambleCheck check(dc);
+
+        string mainCode = code;
+        string lineDirective;
+        if (preamble) {
+            lineDirective = LineDirectiveAt(code, preamble->code.size());
+            mainCode = lineDirective + code.substr(preamble->code.size());
+            args.push_back("-include-pch");
+            args.push_back(preamble->pchPath);
+        }
+
+        // The content is always mapped, even when it comes from disk, so that
+        // the FileManager never serves a stale copy of the sketch.
+        unique_ptr<FrontendActionFactory> factory = NewPreprocessActionFactory(context);
+        ToolInvocation invocation(std::move(args), factory->create(), &files);
+        invocation.mapVirtualFile(filename, mainCode);
+        if (preamble) {
+            // The precompiled header checks that its input is unchanged
+            invocation.mapVirtualFile(filename + ".preamble.hpp", preambleHeader(filename, preamble->code));
+        }
+        invocation.setDiagnosticConsumer(&check);
+        invocation.run();
+        dc.finish();
+        diagnosticsOut.flush();
+
+        if (!preamble) {
+            sketch.diagnostics.clear();
+            appendJsonLines(diagnostics, sketch.diagnostics);
+            sketch.preprocessed = std::move(context.preprocessedSketch);
+            sketch.declOffsets = std::move(context.topLevelDeclOffsets);
+            sketch.libraries = std::move(context.usedLibraries);
+            return true;
+        }
+
+        // The prototypes are never inserted before the #line directive, it's
+        // replaced with the preamble in the processed sketch
+        if (check.preambleFailed || !startsWith(context.preprocessedSketch, lineDirective)) {
+            return false;
+        }
+        sketch.diagnostics = preamble->diagnostics;
+        appendJsonLines(diagnostics, sketch.diagnostics);
+        sketch.preprocessed = preamble->code + context.preprocessedSketch.substr(lineDirective.size());
+        sketch.declOffsets.clear();
+        for (unsigned offset : context.topLevelDeclOffsets) {
+            sketch.declOffsets.push_back(offset - lineDirective.size() + preamble->code.size());
+        }
+        sketch.libraries = preamble->libraries;
+        for (const string &dir : context.usedLibraries) {
+            if (std::find(sketch.libraries.begin(), sketch.libraries.end(), dir) == sketch.libraries.end()) {
+                sketch.libraries.push_back(dir);
+            }
+        }
+        return true;
+    }
+
+    // A line of a sketch, with the file and the line it's reported at as
+    // set by the #line directives that precede it
+    struct PresumedLine {
+        string file;
+        unsigned line;
+        StringRef text;
+    };
+
+    static vector<PresumedLine> presumedLines(const string &filename, const string &code) {
+        vector<PresumedLine> lines;
+        string name = filename;
+        string file = quoteCppString(name);
+        unsigned line = 1;
+        StringRef rest = code;
+        while (!rest.empty()) {
+            StringRef text;
+            std::tie(text, rest) = rest.split('\n');
+            if (text.startswith("# ") || text.startswith("#line ")) {
+                SmallVector<StringRef, 3> fields;
+                text.split(fields, ' ', 2);
+                unsigned marker;
+                if (fields.size() > 1 && !fields[1].getAsInteger(10, marker)) {
+                    line = marker;
+                    size_t quote = text.find('"');
+                    size_t endQuote = text.rfind('"');
+                    if (quote != StringRef::npos && endQuote > quote) {
+                        file = text.slice(quote + 1, endQuote).str();
+                    }
+                    continue;
+                }
+            }
+            lines.push_back(PresumedLine{file, line++, text});
+        }
+        return lines;
+    }
+
+    // Moves the "pos" of the locations in a diagnostic to the new line of
+    // their file in moved, returns true if any of them changed.
+    static bool moveLocations(json &node, const map<string, map<unsigned, unsigned>> &moved) {
+        if (!node.is_structured()) {
+            return false;
+        }
+        if (node.is_object() && node.count("file") && node.count("pos")) {
+            json &file = node["file"];
+            json &pos = node["pos"];
+            if (!file.is_string() || !pos.is_string()) {
+                return false;
+            }
+            auto lines = moved.find(file.get<string>());
+            string position = pos.get<string>();
+            size_t colon = position.find(':');
+            unsigned line;
+            if (lines == moved.end() || colon == string::npos ||
+                    StringRef(position).substr(0, colon).getAsInteger(10, line)) {
+                return false;
+            }
+            auto to = lines->second.find(line);
+            if (to == lines->second.end()) {
+                return false;
+            }
+            pos = to_string(to->second) + position.substr(colon);
+            return true;
+        }
+        bool changed = false;
+        for (json &child : node) {
+            changed |= moveLocations(child, moved);
+        }
+        return changed;
+    }
+
+    // Moves the diagnostics sent for the old code of a sketch to the lines
+    // where the same code is in the new one, so that the next delta doesn't
+    // report the diagnostics that an edit only shifted. The lines before and
+    // after the edited region are matched, the diagnostics inside it are
+    // left where they are.
+    static void shiftDiagnostics(const string &filename, const string &oldCode, const string &newCode,
+            vector<string> &diagnostics) {
+        if (diagnostics.empty()) {
+            return;
+        }
+        vector<PresumedLine> before = presumedLines(filename, oldCode);
+        vector<PresumedLine> after = presumedLines(filename, newCode);
+        auto same = [](const PresumedLine &a, const PresumedLine &b) {
+            return a.file == b.file && a.text == b.text;
+        };
+        size_t prefix = 0;
+        while (prefix < before.size() && prefix < after.size() && same(before[prefix], after[prefix])) {
+            prefix++;
+        }
+        size_t suffix = 0;
+        while (suffix < before.size() - prefix && suffix < after.size() - prefix &&
+                same(before[before.size() - 1 - suffix], after[after.size() - 1 - suffix])) {
+            suffix++;
+        }
+
+        map<string, map<unsigned, unsigned>> moved;
+        auto match = [&](const PresumedLine &from, const PresumedLine &to) {
+            if (from.line != to.line) {
+                moved[from.file][from.line] = to.line;
+            }
+        };
+        for (size_t i = 0; i < prefix; i++) {
+            match(before[i], after[i]);
+        }
+        for (size_t i = 0; i < suffix; i++) {
+            match(before[before.size() - 1 - i], after[after.size() - 1 - i]);
+        }
+        if (moved.empty()) {
+            return;
+        }
+
+        for (string &d : diagnostics) {
+            json diagnostic = json::parse(d);
+            if (moveLocations(diagnostic, moved)) {
+                d = diagnostic.dump();
+            }
+        }
+    }
+
+    // Returns the diagnostics added and removed since the last ones sent for
+    // the sketch, each diagnostic is compared as a whole. The ones sent were
+    // moved along with the edits made since, see shiftDiagnostics.
+    static string diagnosticsDelta(const vector<string> &sent, const vector<string> &current) {
+        StringMap<unsigned> remaining;
+        for (const string &d : sent) {
+            remaining[d]++;
+        }
+        vector<string> added;
+        for (const string &d : current) {
+            unsigned &count = remaining[d];
+            if (count > 0) {
+                count--;
+            } else {
+                added.push_back(d);
+            }
+        }
+        vector<string> removed;
+        for (const string &d : sent) {
+            unsigned &count = remaining[d];
+            if (count > 0) {
+                count--;
+                removed.push_back(d);
+            }
+        }
+        return "{\"added\":" + jsonArray(added) + ",\"removed\":" + jsonArray(removed) + "}";
+    }
+
+    // The consumer outputs one json object per line
+    static void appendJsonLines(const string &lines, vector<string> &out) {
+        for (const string &d : split(lines, '\n')) {
+            if (!d.empty()) {
+                out.push_back(d);
+            }
+        }
+    }
+
+    static string jsonArray(const vector<string> &items) {
+        string res = "[";
+        for (const string &item : items) {
+            if (res.size() > 1) {
+                res += ",";
+            }
+            res += item;
+        }
+        return res + "]";
+    }
+
+    void complete(const json &id, const json &params, const string &filename, SketchState &sketch) {
+        int line, col;
+        if (!getInt(params, "line", line) || !getInt(params, "col", col)) {
+            replyError(id, invalidParams, "missing 'line' or 'col' parameter");
+            return;
+        }
+        // The file where the cursor is, as reported in the #line directives
+        // of the sketch. Defaults to the processed file.
+        string completionFile = filename;
+        getString(params, "completionFile", completionFile);
+
+        int realLine = FindRealLineForCodeCompletion(sketch.preprocessed, completionFile, line);
+        if (realLine == -1) {
+            reply(id, "[]");
+            return;
+        }
+        string completions;
+        raw_string_ostream out(completions);
+        DoCodeCompletion(filename, sketch.args, sketch.preprocessed, realLine, col, out, sketch.declOffsets,
+                libraryDirs.empty() ? nullptr : &libraries);
+        out.flush();
+        reply(id, completions);
+    }
+
+    void reply(const json &id, const string &result) {
+        outs() << "{\"id\":" << id.dump() << ",\"jsonrpc\":\"2.0\",\"result\":" << result << "}\n";
+        outs().flush();
+    }
+
+    void replyError(const json &id, int code, const string &message) {
+        json error = json{
+            {"code", code},
+            {"message", message}};
+        outs() << "{\"error\":" << error.dump() << ",\"id\":" << id.dump() << ",\"jsonrpc\":\"2.0\"}\n";
+        outs().flush();
+    }
+
+    static bool getString(const json &obj, const char *key, string &out) {
+        auto it = obj.find(key);
+        if (it == obj.end() || !it->is_string()) {
+            return false;
+        }
+        out = it->get<string>();
+        return true;
+    }
+
+    static bool getBool(const json &obj, const char *key, bool &out) {
+        auto it = obj.find(key);
+        if (it == obj.end() || !it->is_boolean()) {
+            return false;
+        }
+        out = it->get<bool>();
+        return true;
+    }
+
+    static bool getInt(const json &obj, const char *key, int &out) {
+        auto it = obj.find(key);
+        if (it == obj.end() || !it->is_number_integer()) {
+            return false;
+        }
+        out = it->get<int>();
+        return true;
+    }
+};
+
+int RunServer(const CompilationDatabase &compilations) {
+    Server server(compilations);
+    string line;
+    while (!server.exiting() && getline(cin, line)) {
+        if (line.find_first_not_of(" \t\r") == string::npos) {
+            continue;
+        }
+        server.handle(line);
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "Sketch.hpp"
+#include "utils.hpp"
+
+using namespace llvm;
+
+bool IsSketchDirectory(const string &path) {
+    return sys::fs::is_directory(path);
+}
+
+bool LoadSketch(const string &dir, Sketch &sketch, string &error) {
+    SmallString<256> root(dir);
+    sys::fs::make_absolute(root);
+    // "Blink/" is named Blink
+    while (root.size() > 1 && sys::path::is_separator(root.back())) {
+        root.pop_back();
+    }
+
+    vector<string> files;
+    error_code ec;
+    for (sys::fs::directory_iterator it(root, ec), end; it != end && !ec; it.increment(ec)) {
+        if (sys::path::extension(it->path()) == ".ino") {
+            files.push_back(it->path());
+        }
+    }
+    if (ec) {
+        error = "can't read " + root.str().str() + ": " + ec.message();
+        return false;
+    }
+    if (files.empty()) {
+        error = "no .ino file in " + root.str().str();
+        return false;
+    }
+
+    SmallString<256> mainPath(root);
+    sys::path::append(mainPath, sys::path::filename(root) + ".ino");
+    string mainIno = mainPath.str().str();
+    std::sort(files.begin(), files.end(), [&](const string &a, const string &b) {
+        if ((a == mainIno) != (b == mainIno)) {
+            return a == mainIno;
+        }
+        return a < b;
+    });
+
+    sketch.mainFile = mainIno + ".cpp";
+    sketch.code = "#include <Arduino.h>\n";
+    for (const string &file : files) {
+        ErrorOr<unique_ptr<MemoryBuffer>> buff = MemoryBuffer::getFile(file);
+        if (!buff) {
+            error = "can't read " + file + ": " + buff.getError().message();
+            return false;
+        }
+        string lineInfo = "#line 1 \"" + file + "\"\n";
+        sketch.code += quoteCppString(lineInfo);
+        sketch.code += (*buff)->getBuffer().str();
+        if (sketch.code.back() != '\n') {
+            sketch.code += '\n';
+        }
+    }
+    return true;
+}
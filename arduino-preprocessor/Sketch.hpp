@@ -0,0 +1,53 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+// A sketch made of the .ino files of a directory, combined in memory into the
+// .ino.cpp source the preprocessor works on.
+struct Sketch {
+    // Path of the combined source, <dir>/<dir name>.ino.cpp. It only exists in
+    // the virtual file system of the compiler, nothing is written to disk.
+    string mainFile;
+    string code;
+};
+
+// Returns true if path names a sketch directory instead of a source file.
+bool IsSketchDirectory(const string &path);
+
+// Combines the .ino files of the sketch directory dir, the one named after
+// the directory first and then the others in alphabetical order, as the
+// Arduino IDE does. Each file starts with a #line directive, so diagnostics
+// and prototypes are attributed to the .ino they come from. Returns false and
+// sets error if the directory can't be read or has no .ino file.
+bool LoadSketch(const string &dir, Sketch &sketch, string &error);
@@ -0,0 +1,107 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#include <atomic>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include "JsonImpl.hpp"
+#include "Trace.hpp"
+
+struct TraceEvent {
+    const char *name;
+    string detail;
+    chrono::steady_clock::time_point start;
+    chrono::steady_clock::time_point end;
+    unsigned thread;
+};
+
+static bool tracing = false;
+static chrono::steady_clock::time_point traceStart;
+static vector<TraceEvent> traceEvents;
+// The sketches of a batch are preprocessed in parallel
+static mutex traceMutex;
+static atomic<unsigned> traceThreads{0};
+
+// Returns the number of the calling thread in the timeline, in the order the
+// threads record their first event
+static unsigned currentThread() {
+    static thread_local unsigned thread = traceThreads++;
+    return thread;
+}
+
+void EnableTracing() {
+    tracing = true;
+    traceStart = chrono::steady_clock::now();
+}
+
+TraceScope::TraceScope(const char *name, StringRef detail) : name(name), active(tracing) {
+    if (active) {
+        this->detail = detail.str();
+        start = chrono::steady_clock::now();
+    }
+}
+
+TraceScope::~TraceScope() {
+    if (active) {
+        chrono::steady_clock::time_point end = chrono::steady_clock::now();
+        lock_guard<mutex> lock(traceMutex);
+        traceEvents.push_back(TraceEvent{name, std::move(detail), start, end, currentThread()});
+    }
+}
+
+static long long microseconds(chrono::steady_clock::duration d) {
+    return chrono::duration_cast<chrono::microseconds>(d).count();
+}
+
+bool WriteTrace(const string &filename) {
+    json events = json::array();
+    for (const TraceEvent &e : traceEvents) {
+        json event = json{
+            {"name", e.name},
+            {"cat", "arduino-preprocessor"},
+            {"ph", "X"},
+            {"pid", 1},
+            {"tid", e.thread},
+            {"ts", microseconds(e.start - traceStart)},
+            {"dur", microseconds(e.end - e.start)}};
+        if (!e.detail.empty()) {
+            event["args"] = json{{"detail", e.detail}};
+        }
+        events.push_back(event);
+    }
+
+    ofstream out(filename);
+    if (!out) {
+        return false;
+    }
+    out << json{{"traceEvents", events}}.dump() << "\n";
+    return out.good();
+}
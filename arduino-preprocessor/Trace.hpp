@@ -0,0 +1,59 @@
+/*
+ * This file is part of arduino-preprocessor.
+ *
+ * Copyright 2017 BCMI LABS SA
+ *
+ * arduino-preprocessor is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * As a special exception, you may use this file as part of a free software
+ * library without restriction.  Specifically, if other files instantiate
+ * templates or use macros or inline functions from this file, or you compile
+ * this file and link it with other files to produce an executable, this
+ * file does not by itself cause the resulting executable to be covered by
+ * the GNU General Public License.  This exception does not however
+ * invalidate any other reasons why the executable file might be covered by
+ * the GNU General Public License.
+ */
+
+#pragma once
+
+#include <llvm/ADT/StringRef.h>
+
+#include <chrono>
+#include <string>
+
+using namespace llvm;
+using namespace std;
+
+// Starts recording the timeline written by WriteTrace. Until then the
+// TraceScopes record nothing and cost a flag check.
+void EnableTracing();
+
+// Writes the recorded timeline to filename in the Chrome trace event format,
+// that can be loaded in chrome://tracing. Returns false on I/O errors.
+bool WriteTrace(const string &filename);
+
+// Records an event of the timeline that lasts as long as the scope.
+class TraceScope {
+public:
+    TraceScope(const char *name, StringRef detail = StringRef());
+    ~TraceScope();
+
+private:
+    const char *name;
+    string detail;
+    bool active;
+    chrono::steady_clock::time_point start;
+};
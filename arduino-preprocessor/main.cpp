@@ -27,287 +27,287 @@
  * the GNU General Public License.
  */
 
-#include <clang/AST/AST.h>
-#include <clang/AST/ASTConsumer.h>
-#include <clang/AST/ASTContext.h>
-#include <clang/AST/RecursiveASTVisitor.h>
-#include <clang/ASTMatchers/ASTMatchFinder.h>
-#include <clang/ASTMatchers/ASTMatchers.h>
-#include <clang/Driver/Options.h>
-#include <clang/Frontend/ASTConsumers.h>
-#include <clang/Frontend/CompilerInstance.h>
-#include <clang/Frontend/FrontendActions.h>
-#include <clang/Rewrite/Core/Rewriter.h>
+#include <clang/Basic/FileManager.h>
+#include <clang/Basic/FileSystemOptions.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
 #include <clang/Tooling/CommonOptionsParser.h>
 #include <clang/Tooling/Tooling.h>
 
-#include <iostream>
-#include <sstream>
-#include <list>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/ThreadPool.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 #include "ArduinoDiagnosticConsumer.hpp"
 #include "CommandLine.hpp"
-#include "Config.hpp"
 #include "CodeCompletion.hpp"
-#include "IdentifiersList.hpp"
+#include "JsonImpl.hpp"
+#include "Libraries.hpp"
+#include "Preprocessor.hpp"
+#include "Server.hpp"
+#include "Sketch.hpp"
+#include "Trace.hpp"
 #include "utils.hpp"
 
 using namespace clang;
-using namespace clang::ast_matchers;
 using namespace clang::tooling;
 using namespace llvm;
 using namespace std;
 
-IdentifiersList undeclaredIdentifiers;
-
-Rewriter rewriter;
-
-class INOPreprocessorMatcherCallback : public MatchFinder::MatchCallback {
-    bool insertionPointFound = false;
-    bool firstLineInserted = false;
-    FullSourceLoc insertionPoint;
-    PresumedLoc presumedInsertionPoint;
-
-    DeclarationMatcher funcMatcher = functionDecl(isDefinition()).bind("function_decl");
-    DeclarationMatcher varMatcher = varDecl().bind("var_decl");
-    //StatementMatcher funcCallMatcher = callExpr().bind("function_call");
-public:
-
-    void attachTo(MatchFinder &finder) {
-        finder.addMatcher(funcMatcher, this);
-        finder.addMatcher(varMatcher, this);
-        //finder.addMatcher(funcCallMatcher, &funcDeclaredCB);
+// Returns the peak resident set size of the process in kilobytes, or 0 where
+// it is not available.
+static long getPeakRSSKilobytes() {
+#ifndef _WIN32
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;
+#else
+        return usage.ru_maxrss;
+#endif
     }
+#endif
+    return 0;
+}
 
-    void run(const MatchFinder::MatchResult &match) override {
-        ASTContext *ctx = match.Context;
-        SourceManager &sm = ctx->getSourceManager();
-
-        const FunctionDecl *f = match.Nodes.getNodeAs<FunctionDecl>("function_decl");
-        if (f) {
-            FullSourceLoc loc = ctx->getFullLoc(f->getLocStart());
-            SourceRange r = f->getSourceRange();
-            FullSourceLoc begin = ctx->getFullLoc(r.getBegin());
-            FullSourceLoc end = ctx->getFullLoc(r.getEnd());
-
-            if (debugOutput) {
-                outs() << "Function " << f->getName() << " declared at ";
-                outs() << loc.getSpellingLineNumber() << ":" << loc.getSpellingColumnNumber();
-                outs() << " (range " << begin.getSpellingLineNumber() << ":" << begin.getSpellingColumnNumber();
-                outs() << " to " << end.getSpellingLineNumber() << ":" << end.getSpellingColumnNumber() << ")\n";
-            }
-
-            if (dyn_cast<CXXMethodDecl>(f)) {
-                if (debugOutput) {
-                    outs() << "  Ignored CXX method declaration.\n";
-                }
-                return;
-            }
-
-            if (dyn_cast<CXXConstructorDecl>(f)) {
-                if (debugOutput) {
-                    outs() << "  Ignored CXX constructor declaration.\n";
-                }
-                return;
-            }
-
-            if (f->getParentFunctionOrMethod()) {
-                if (debugOutput) {
-                    outs() << "  Function is not top level, ignoring.\n";
-                }
-                return;
-            }
-
-            //f->dump();
-
-            detectInsertionPoint(sm, begin, end);
-            if (!insertionPointFound) {
-                return;
-            }
-
-            if (outputOnlyNeededPrototypes) {
-                // Check if this function is called and needs a forward declaration
-                IdentifierLocation *und = undeclaredIdentifiers.findFirst(f->getName());
-                if (!und) {
-                    if (debugOutput) {
-                        outs() << "  This function is not forward-called and do not need a prototype.\n";
-                    }
-                    return;
-                }
-            }
-
-            // Extract line pragma for prototype insertion
-            writeLineInfo(sm.getPresumedLoc(loc, true));
-
-            // Extract prototype from function using the pretty printer
-            // and stopping at the first open curly brace "{"
-            if (f->isExternC()) {
-                rewriter.InsertTextAfter(insertionPoint, "extern \"C\" ");
-            }
-            string proto;
-            raw_string_ostream o(proto);
-            f->print(o);
-            o.flush();
-            proto = proto.substr(0, proto.find_first_of('{') - 1) + ";\n";
-            rewriter.InsertTextAfter(insertionPoint, proto);
-            firstLineInserted = true;
-            if (debugOutput) {
-                outs() << "  Generated prototype: " << proto;
-            }
-        }
-
-        const VarDecl *v = match.Nodes.getNodeAs<VarDecl>("var_decl");
-        if (v) {
-            if (v->getParentFunctionOrMethod()) {
-                //if (debugOutput) {
-                //    outs() << "  Variable is not top level, ignoring.\n";
-                //}
-                return;
-            }
-
-            FullSourceLoc loc = ctx->getFullLoc(v->getLocStart());
-            SourceRange r = v->getSourceRange();
-            FullSourceLoc begin = ctx->getFullLoc(r.getBegin());
-            FullSourceLoc end = ctx->getFullLoc(r.getEnd());
-
-            if (debugOutput) {
-                outs() << "Variable " << v->getName() << " declared at ";
-                outs() << loc.getSpellingLineNumber() << ":" << loc.getSpellingColumnNumber();
-                outs() << " (range " << begin.getSpellingLineNumber() << ":" << begin.getSpellingColumnNumber();
-                outs() << " to " << end.getSpellingLineNumber() << ":" << end.getSpellingColumnNumber() << ")\n";
-            }
-
-            detectInsertionPoint(sm, begin, end);
-        }
+static void writeStats(const string &filename, size_t sketches, double wall, double total, double emit,
+        double completion, const PreprocessorStats &pstats) {
+    json stats = json{
+        {"tool", "arduino-preprocessor"},
+        {"file", filename},
+        {"sketches", sketches},
+        {"wall_seconds", wall},
+        {"sketches_per_second", wall > 0 ? sketches / wall : 0},
+        {"peak_rss_kb", getPeakRSSKilobytes()},
+        {"phases", json{
+            {"parse", total - pstats.match - pstats.rewrite},
+            {"match", pstats.match},
+            {"rewrite", pstats.rewrite},
+            {"emit", emit},
+            {"completion", completion}}},
+        {"callbacks", json{
+            {"INOPreprocessorMatcherCallback", json{
+                {"function_matches", pstats.functionMatches},
+                {"variable_matches", pstats.variableMatches},
+                {"seconds", pstats.callback}}}}}};
+
+    ofstream out(statsFile);
+    if (!out) {
+        cerr << "can't write " << statsFile << "\n";
+        return;
     }
+    out << stats.dump(2) << "\n";
+}
 
-    void detectInsertionPoint(SourceManager &sm, FullSourceLoc &begin, FullSourceLoc &end) {
-        if (insertionPointFound) {
-            return;
-        }
-
-        if (undeclaredIdentifiers.empty()) {
-            //insertionPoint = begin;
-            //insertionPointFound = true;
-            //if (debugOutput) {
-            //    outs() << "  !! Insertion point found (using the first available position)\n";
-            //}
-            return;
-        }
-
-        FullSourceLoc first = undeclaredIdentifiers.back()->location;
-        if (first.isBeforeInTranslationUnitThan(begin)) {
-            markInsertionPointAsFound();
-            return;
-        }
-
-        if (end.isInvalid()) {
-            return;
-        }
-
-        insertionPoint = begin;
-        presumedInsertionPoint = sm.getPresumedLoc(begin, true);
-        if (debugOutput) {
-            outs() << "  Insertion point pushed to ";
-            outs() << begin.getSpellingLineNumber() << ":" << begin.getSpellingColumnNumber() << "\n";
-        }
+// Time spent on each phase of a sketch, summed over the batch
+struct SketchTimes {
+    double preprocess = 0;
+    double emit = 0;
+};
 
-        if (first.isBeforeInTranslationUnitThan(end)) {
-            markInsertionPointAsFound();
+// Preprocesses a sketch (a source file or a sketch directory) and writes
+// the requested output to out. The source actually parsed is stored in
+// source, for the code completion.
+static int runSketch(const CompilationDatabase &compilations, const string &path, const LibraryIndex *libraries,
+        raw_ostream &out, PreprocessorContext &context, SketchTimes &times, string &source) {
+    // A sketch directory is combined in memory, without the concatenated
+    // .ino.cpp and the gcc -E pass of the IDE
+    Sketch sketch;
+    source = path;
+    if (IsSketchDirectory(path)) {
+        string error;
+        if (!LoadSketch(path, sketch, error)) {
+            cerr << error + "\n";
+            return 1;
         }
+        source = sketch.mainFile;
     }
 
-    void markInsertionPointAsFound() {
-        if (debugOutput) {
-            outs() << "  !! Insertion point found at ";
-            outs() << insertionPoint.getSpellingLineNumber() << ":" << insertionPoint.getSpellingColumnNumber() << "\n";
-        }
-        insertionPointFound = true;
-
-        if (insertionPoint.getSpellingColumnNumber() != 1) {
-            if (debugOutput) {
-                outs() << "     Insertion point is not at the line beginning -> adding a newline\n";
-            }
-            rewriter.InsertTextAfter(insertionPoint, "\n");
-        }
+    vector<CompileCommand> commands = compilations.getCompileCommands(source);
+    if (commands.empty()) {
+        cerr << "no compile command for " << source << "\n";
+        return 1;
     }
-
-    void onEndOfTranslationUnit() override {
-        if (firstLineInserted) {
-            writeLineInfo(presumedInsertionPoint);
-        }
+    CommandLineArguments args = commands[0].CommandLine;
+    args = getClangSyntaxOnlyAdjuster()(args, source);
+    args = getClangStripOutputAdjuster()(args, source);
+    // The builtin headers are looked up next to the tool, as ClangTool does
+    static int mainExecutableSymbol;
+    args[0] = sys::fs::getMainExecutable("arduino-preprocessor", &mainExecutableSymbol);
+
+    // ClangTool changes the working directory of the process to the one of
+    // the compile command, the sketches run by -jobs would race on it. The
+    // FileManager of each sketch resolves the relative paths instead.
+    FileSystemOptions fileSystemOptions;
+    fileSystemOptions.WorkingDir = commands[0].Directory;
+    IntrusiveRefCntPtr<FileManager> files(new FileManager(fileSystemOptions));
+    unique_ptr<FrontendActionFactory> factory = NewPreprocessActionFactory(context);
+    ToolInvocation invocation(std::move(args), factory->create(), files.get());
+    if (!sketch.mainFile.empty()) {
+        invocation.mapVirtualFile(sketch.mainFile, sketch.code);
     }
 
-    void writeLineInfo(const PresumedLoc &presumed) {
-        ostringstream lineInfo;
-        lineInfo << "#line " << presumed.getLine();
-        lineInfo << " \"" << presumed.getFilename() << "\"\n";
-        std::string lineInfoAsStr = lineInfo.str();
-        lineInfoAsStr = quoteCppString(lineInfoAsStr);
-        rewriter.InsertTextAfter(insertionPoint, lineInfoAsStr);
+    context.libraryIndex = libraries;
+    ArduinoDiagnosticConsumer dc;
+    dc.collectUndeclaredIdentifiersIn(context.undeclaredIdentifiers);
+    if (outputDiagnostics) {
+        dc.outputJsonDiagnosticsTo(out);
     }
-};
-
-static string preprocessedSketch;
-
-class INOPreprocessAction : public ASTFrontendAction {
-    MatchFinder finder;
-    INOPreprocessorMatcherCallback funcDeclaredCB;
+    invocation.setDiagnosticConsumer(&dc);
 
-public:
-
-    INOPreprocessAction() {
-        funcDeclaredCB.attachTo(finder);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    int res;
+    {
+        TraceScope trace("Preprocess", path);
+        res = invocation.run() ? 0 : 1;
     }
+    times.preprocess += secondsSince(start);
 
-    unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &compiler, StringRef inFile) override {
-        rewriter.setSourceMgr(compiler.getSourceManager(), compiler.getLangOpts());
-        return finder.newASTConsumer();
+    start = chrono::steady_clock::now();
+    if (outputPreprocessedSketch) {
+        TraceScope trace("Emit", path);
+        out << context.preprocessedSketch;
     }
-
-    virtual void EndSourceFileAction() override {
-        if (debugOutput) {
-            ostringstream out;
-            undeclaredIdentifiers.dump(out);
-            out.flush();
-            outs() << out.str();
+    if (outputLibraries) {
+        for (const string &dir : context.usedLibraries) {
+            out << dir << "\n";
         }
+    }
+    out.flush();
+    times.emit += secondsSince(start);
+    return res;
+}
 
-        const FileID mainFileID = rewriter.getSourceMgr().getMainFileID();
-        const RewriteBuffer *buf = rewriter.getRewriteBufferFor(mainFileID);
-        if (buf == nullptr) {
-            // No changes needed, output the source file as-is
-            auto buff = rewriter.getSourceMgr().getBuffer(mainFileID);
-            preprocessedSketch = buff->getBuffer().str();
-        } else {
-            preprocessedSketch = string(buf->begin(), buf->end());
+// Returns the name of the output file of each sketch in outputDir: the name
+// of the sketch with ".out", the ones already taken get a "-2", "-3", ...
+// suffix in the order of the command line.
+static vector<string> outputFilenames(const vector<string> &paths) {
+    vector<string> filenames;
+    StringSet<> taken;
+    for (const string &path : paths) {
+        StringRef name = sys::path::stem(StringRef(path).rtrim("/\\"));
+        string unique = name.str();
+        for (int n = 2; !taken.insert(unique).second; n++) {
+            unique = name.str() + "-" + to_string(n);
         }
+        SmallString<256> filename(outputDir);
+        sys::path::append(filename, unique + ".out");
+        filenames.push_back(filename.str().str());
     }
-};
+    return filenames;
+}
 
 int main(int argc, const char **argv) {
     CommonOptionsParser optParser = doCommandLineParsing(argc, argv);
-    ClangTool tool(optParser.getCompilations(), optParser.getSourcePathList());
+    if (serverMode) {
+        return RunServer(optParser.getCompilations());
+    }
 
-    ArduinoDiagnosticConsumer dc;
-    dc.collectUndeclaredIdentifiersIn(undeclaredIdentifiers);
-    if (outputDiagnostics) {
-        dc.outputJsonDiagnosticsTo(outs());
+    if (!traceFile.empty()) {
+        EnableTracing();
     }
-    tool.setDiagnosticConsumer(&dc);
 
-    int res = tool.run(newFrontendActionFactory<INOPreprocessAction>().get());
+    LibraryIndex libraries;
+    if (!libraryDirs.empty()) {
+        TraceScope trace("LibraryIndex");
+        string error;
+        if (!libraries.load(libraryDirs, error)) {
+            cerr << error << "\n";
+            return 1;
+        }
+    }
+    const LibraryIndex *index = libraryDirs.empty() ? nullptr : &libraries;
+
+    const vector<string> &paths = optParser.getSourcePathList();
+    vector<string> filenames;
+    if (!outputDir.empty()) {
+        if (error_code ec = sys::fs::create_directories(outputDir)) {
+            cerr << "can't create " << outputDir << ": " << ec.message() << "\n";
+            return 1;
+        }
+        filenames = outputFilenames(paths);
+    }
 
-    if (outputPreprocessedSketch) {
-        outs() << preprocessedSketch;
+    // Each sketch has its own context, they are summed up for the stats at
+    // the end
+    vector<PreprocessorContext> contexts(paths.size());
+    vector<SketchTimes> times(paths.size());
+    vector<int> results(paths.size());
+    vector<string> sources(paths.size());
+    auto run = [&](size_t i) {
+        if (filenames.empty()) {
+            results[i] = runSketch(optParser.getCompilations(), paths[i], index, outs(), contexts[i], times[i],
+                    sources[i]);
+            return;
+        }
+        error_code ec;
+        raw_fd_ostream out(filenames[i], ec, sys::fs::F_Text);
+        if (ec) {
+            cerr << "can't write " + filenames[i] + ": " + ec.message() + "\n";
+            results[i] = 1;
+            return;
+        }
+        results[i] = runSketch(optParser.getCompilations(), paths[i], index, out, contexts[i], times[i],
+                sources[i]);
+    };
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    unsigned threads = jobs ? jobs : std::max(std::thread::hardware_concurrency(), 1u);
+    if (paths.size() == 1 || threads == 1) {
+        for (size_t i = 0; i < paths.size(); i++) {
+            run(i);
+        }
+    } else {
+        ThreadPool pool(std::min<size_t>(threads, paths.size()));
+        for (size_t i = 0; i < paths.size(); i++) {
+            pool.async(run, i);
+        }
+        pool.wait();
     }
+    double wall = secondsSince(start);
 
+    start = chrono::steady_clock::now();
     if (outputCodeCompletions) {
-        int line = FindRealLineForCodeCompletion(preprocessedSketch, codeCompleteFilename, codeCompleteLine);
-        if (line != -1) {
-            DoCodeCompletion(optParser.getSourcePathList()[0], preprocessedSketch, line, codeCompleteCol);
+        TraceScope trace("Completion");
+        const PreprocessorContext &context = contexts[0];
+        int line = FindRealLineForCodeCompletion(context.preprocessedSketch, codeCompleteFilename, codeCompleteLine);
+        vector<CompileCommand> commands = optParser.getCompilations().getCompileCommands(sources[0]);
+        if (line != -1 && !commands.empty()) {
+            DoCodeCompletion(sources[0], commands[0].CommandLine, context.preprocessedSketch, line, codeCompleteCol,
+                    outs(), context.topLevelDeclOffsets, index);
+        }
+    }
+    double completion = secondsSince(start);
+
+    if (!statsFile.empty()) {
+        PreprocessorStats pstats;
+        SketchTimes total;
+        for (size_t i = 0; i < paths.size(); i++) {
+            pstats.add(contexts[i].stats);
+            total.preprocess += times[i].preprocess;
+            total.emit += times[i].emit;
         }
+        writeStats(paths.size() == 1 ? paths[0] : outputDir, paths.size(), wall + completion, total.preprocess,
+                total.emit, completion, pstats);
+    }
+    if (!traceFile.empty() && !WriteTrace(traceFile)) {
+        cerr << "can't write " << traceFile << "\n";
     }
 
-    return res;
+    for (int res : results) {
+        if (res != 0) {
+            return res;
+        }
+    }
+    return 0;
 }
@@ -122,7 +122,7 @@ CXXFLAGS="`clang/bin/llvm-config --cxxflags` $CXXFLAGS"
 LDFLAGS="`clang/bin/llvm-config --ldflags` -static-libstdc++"
 LLVMLIBS=`clang/bin/llvm-config --libs --system-libs`
 CLANGLIBS=`ls clang/lib/libclang*.a | sed s/.*libclang/-lclang/ | sed s/.a$//`
-SOURCES="main.cpp ArduinoDiagnosticConsumer.cpp CommandLine.cpp IdentifiersList.cpp CodeCompletion.cpp"
+SOURCES="main.cpp Preprocessor.cpp Server.cpp Sketch.cpp Trace.cpp ArduinoDiagnosticConsumer.cpp CommandLine.cpp IdentifiersList.cpp Libraries.cpp CodeCompletion.cpp"
 $CXX $SOURCES -o objdir/arduino-preprocessor $CXXFLAGS $LDFLAGS $START_GROUP $LLVMLIBS $CLANGLIBS $END_GROUP
 strip objdir/*
 
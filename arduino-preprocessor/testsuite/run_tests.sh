@@ -36,22 +36,24 @@ test_preprocessor() {
 	mkdir tmp
 
 	TEST=$1
+	# The compiler flags that follow the test name
+	shift
 	say "@cyan[[Testing preprocessor on @b$TEST]]"
-	../arduino-preprocessor/arduino-preprocessor $TEST -- -std=gnu++11 > tmp/preproc.cpp
+	../arduino-preprocessor/arduino-preprocessor $TEST -- -std=gnu++11 "$@" > tmp/preproc.cpp
 	if [ $? -ne 0 ]; then
 		fail "Error running arduino-preprocessor"
 		return 1
 	fi
 
 	say "@cyan[[Running compiler...]]"
-	g++ -std=gnu++11 -c tmp/preproc.cpp -o tmp/preproc.o
+	g++ -std=gnu++11 "$@" -c tmp/preproc.cpp -o tmp/preproc.o
 	if [ $? -ne 0 ]; then
 		# if the test fails output the preprocessed source code
 		echo ""
 		say "@cyan[[Preprocessor output with debugging enabled:]]"
 		echo ""
 
-		../arduino-preprocessor/arduino-preprocessor -debug $TEST -- -std=gnu++11
+		../arduino-preprocessor/arduino-preprocessor -debug $TEST -- -std=gnu++11 "$@"
 
 		fail $TEST
 		return 1
@@ -71,6 +73,15 @@ for TEST in `find testdata -name "test_*.cpp"`; do
 	hr
 done
 
+# Sketch directories are combined by the preprocessor, they include the
+# Arduino.h stub in testdata/include
+for TEST in `find testdata -mindepth 1 -maxdepth 1 -type d -name "sketch_*"`; do
+	test_preprocessor $TEST -Itestdata/include
+	FAILS=$(($FAILS+$?))
+	TOTAL=$(($TOTAL+1))
+	hr
+done
+
 echo $TOTAL tests run
 echo $FAILS tests failed
 
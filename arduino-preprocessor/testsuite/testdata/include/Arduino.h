@@ -0,0 +1,13 @@
+// Minimal stand-in for the Arduino core, enough to compile the sketch
+// directories of the testsuite
+
+#ifndef Arduino_h
+#define Arduino_h
+
+#define HIGH 1
+#define LOW 0
+#define LED_BUILTIN 13
+
+void digitalWrite(int pin, int value);
+
+#endif
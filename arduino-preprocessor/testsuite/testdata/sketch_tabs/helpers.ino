@@ -0,0 +1,9 @@
+int nextValue(int v) {
+  return v + 1;
+}
+
+void blink(int times) {
+  for (int i = 0; i < times; i++) {
+    digitalWrite(LED_BUILTIN, HIGH);
+  }
+}
@@ -0,0 +1,12 @@
+// A sketch made of more .ino files: the functions of the second tab are used
+// before their definition and need prototypes
+
+int counter;
+
+void setup() {
+  counter = nextValue(0);
+}
+
+void loop() {
+  blink(counter);
+}
@@ -29,6 +29,7 @@
 
 #pragma once
 
+#include <chrono>
 #include <vector>
 #include <sstream>
 #include <iostream>
@@ -64,6 +65,10 @@ inline bool startsWith(const string &in, const string &prefix) {
     return in.find(prefix.c_str(), 0, l) == 0;
 }
 
+inline double secondsSince(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
 inline bool cStrEndsWith(const char *str, const char *suffix) {
   if (str == NULL || suffix == NULL)
     return false;
@@ -77,6 +82,42 @@ inline bool cStrEndsWith(const char *str, const char *suffix) {
   return strncmp(str + strLen - suffixLen, suffix, suffixLen) == 0;
 }
 
+// Returns a #line directive that restores, at the given offset, the presumed
+// location set by the line markers that precede it.
+inline string LineDirectiveAt(const string &code, size_t offset) {
+    int presumed = 1;
+    string file;
+    size_t pos = 0;
+    while (pos < offset) {
+        size_t eol = code.find('\n', pos);
+        if (eol == string::npos) {
+            break;
+        }
+        presumed++;
+        if (code.compare(pos, 2, "# ") == 0 || code.compare(pos, 6, "#line ") == 0) {
+            vector<string> fields = split(code.substr(pos, eol - pos), ' ');
+            int marker;
+            if (fields.size() > 1 && stringToInt(fields[1], &marker)) {
+                presumed = marker;
+                size_t quote = code.find('"', pos);
+                size_t endQuote = code.rfind('"', eol);
+                if (quote < eol && endQuote > quote) {
+                    file = code.substr(quote, endQuote - quote + 1);
+                }
+            }
+        }
+        pos = eol + 1;
+    }
+
+    ostringstream lineInfo;
+    lineInfo << "#line " << presumed;
+    if (!file.empty()) {
+        lineInfo << " " << file;
+    }
+    lineInfo << "\n";
+    return lineInfo.str();
+}
+
 #ifdef WIN32
 
 std::string ReplaceAll(std::string str, const std::string& from, const std::string& to) {
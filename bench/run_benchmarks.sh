@@ -0,0 +1,142 @@
+#!/bin/bash
+#
+# End-to-end throughput benchmark for micropy-convert and arduino-preprocessor.
+#
+# Runs both tools over a fixed corpus (the arduino-preprocessor testdata plus
+# generated sketches of growing size) and prints one JSON object per run on
+# stdout, built from the -stats output of the tools. Compare the output of two
+# builds to spot regressions.
+#
+# Usage: run_benchmarks.sh [micropy-convert] [arduino-preprocessor]
+#
+# The tools default to $MICROPY_CONVERT and $ARDUINO_PREPROCESSOR, a tool that
+# is not found is skipped. SIZES lists the number of functions of the
+# generated sketches. A run that fails is reported on stderr and makes the
+# script exit with an error.
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+MICROPY_CONVERT=${1:-${MICROPY_CONVERT:-micropy-convert}}
+ARDUINO_PREPROCESSOR=${2:-${ARDUINO_PREPROCESSOR:-$ROOT/arduino-preprocessor/objdir/arduino-preprocessor}}
+SIZES=${SIZES:-"10 100 1000 5000"}
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# Minimal Arduino API, so the generated sketches parse without a core
+cat > "$WORK/bench_arduino.h" <<'END'
+#define INPUT 0x0
+#define OUTPUT 0x1
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int val);
+int digitalRead(int pin);
+void delay(unsigned long ms);
+unsigned long millis();
+END
+
+# gen_sketch <functions> <file> [prototypes]: every function calls the next
+# one, which is defined later, so each of them needs a prototype. They are
+# written only if the third argument is given: arduino-preprocessor adds them,
+# micropy-convert parses the sketch as plain C++.
+gen_sketch() {
+	{
+		echo '#include "bench_arduino.h"'
+		echo 'int counter = 0;'
+		if [ -n "$3" ]; then
+			for ((i = 0; i <= $1; i++)); do
+				echo "int f$i(int x);"
+			done
+		fi
+		for ((i = 0; i < $1; i++)); do
+			echo "int f$i(int x) {"
+			echo "  if (x > $i) {"
+			echo "    digitalWrite(13, digitalRead(2));"
+			echo "  }"
+			echo "  for (int i = 0; i < 4; i++) {"
+			echo "    counter += x;"
+			echo "  }"
+			echo "  return f$(($i + 1))(x - 1);"
+			echo "}"
+		done
+		echo "int f$1(int x) { return x; }"
+		echo 'void setup() {'
+		echo '  pinMode(13, OUTPUT);'
+		echo '}'
+		echo 'void loop() {'
+		echo '  f0(millis());'
+		echo '  delay(100);'
+		echo '}'
+	} > "$2"
+}
+
+CORPUS=()
+MICROPY_CORPUS=()
+for SIZE in $SIZES; do
+	gen_sketch $SIZE "$WORK/sketch_$SIZE.cpp"
+	CORPUS+=("$WORK/sketch_$SIZE.cpp")
+	gen_sketch $SIZE "$WORK/py_sketch_$SIZE.cpp" prototypes
+	MICROPY_CORPUS+=("$WORK/py_sketch_$SIZE.cpp")
+done
+
+FAILED=0
+
+# run_stats <tool> <args...>: runs the tool with -stats and prints its report.
+# The report is removed first, so a failed run can't print the previous one.
+run_stats() {
+	TOOL=$1
+	shift
+	rm -f "$WORK/stats.json"
+	if "$TOOL" -stats="$WORK/stats.json" "$@" > "$WORK/run.log" 2>&1 && [ -s "$WORK/stats.json" ]; then
+		cat "$WORK/stats.json"
+	else
+		echo "failed: $TOOL $*" >&2
+		tail -n 20 "$WORK/run.log" >&2
+		FAILED=1
+	fi
+}
+
+# arduino-preprocessor works on the output of gcc -E, like the Arduino builder
+# gives it
+PREPROCESSED=()
+for TEST in "$ROOT"/arduino-preprocessor/testsuite/testdata/test_*.cpp "${CORPUS[@]}"; do
+	OUT="$WORK/pp_$(basename "$TEST")"
+	g++ -E -std=gnu++11 -I"$WORK" "$TEST" -o "$OUT" && PREPROCESSED+=("$OUT")
+done
+
+# The testdata sketches need their prototypes for micropy-convert too, it gets
+# them from arduino-preprocessor
+if [ -x "$ARDUINO_PREPROCESSOR" ]; then
+	for TEST in "$ROOT"/arduino-preprocessor/testsuite/testdata/test_*.cpp; do
+		OUT="$WORK/ino_$(basename "$TEST")"
+		if "$ARDUINO_PREPROCESSOR" "$TEST" -- -std=gnu++11 > "$OUT" 2> "$WORK/run.log"; then
+			MICROPY_CORPUS+=("$OUT")
+		else
+			echo "failed: $ARDUINO_PREPROCESSOR $TEST" >&2
+			tail -n 20 "$WORK/run.log" >&2
+			FAILED=1
+		fi
+	done
+else
+	echo "arduino-preprocessor not found, micropy-convert runs without the testdata" >&2
+fi
+
+if command -v "$MICROPY_CONVERT" > /dev/null; then
+	# Each sketch alone, then the whole corpus as a parallel batch
+	for SKETCH in "${MICROPY_CORPUS[@]}"; do
+		run_stats "$MICROPY_CONVERT" -output-dir="$WORK/py" "$SKETCH" -- -I"$WORK"
+	done
+	run_stats "$MICROPY_CONVERT" -jobs=0 -output-dir="$WORK/py" "${MICROPY_CORPUS[@]}" -- -I"$WORK"
+else
+	echo "micropy-convert not found, skipping it" >&2
+fi
+
+if [ -x "$ARDUINO_PREPROCESSOR" ]; then
+	# Each sketch alone, then the whole corpus as a parallel batch
+	for SKETCH in "${PREPROCESSED[@]}"; do
+		run_stats "$ARDUINO_PREPROCESSOR" "$SKETCH" -- -std=gnu++11
+	done
+	run_stats "$ARDUINO_PREPROCESSOR" -jobs=0 -output-dir="$WORK/pp" "${PREPROCESSED[@]}" -- -std=gnu++11
+else
+	echo "arduino-preprocessor not found, skipping it" >&2
+fi
+
+exit $FAILED
@@ -2,883 +2,4118 @@
 // Micropython-Convert Demonstrates:
 //
 // * How to convert Arduino Sketches to Micropython
-// * How to use AST matchers to find interesting AST nodes.
-// * How to use the Rewriter API to rewrite the source code.
+// * How to lower the Clang AST into a small Python IR and print it.
+// * How to drive the renaming from a YAML rules file (micropy-rules.yaml).
 //
 // Ashutosh Pandey (ashutoshpandey123456@gmail.com)
 // This code is in the public domain
 //------------------------------------------------------------------------------
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
 #include <string>
+#include <vector>
 
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
-#include "clang/ASTMatchers/ASTMatchFinder.h"
-#include "clang/ASTMatchers/ASTMatchers.h"
+#include "clang/Basic/CharInfo.h"
+#include "clang/Basic/Version.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendActions.h"
-#include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/Preprocessor.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/MapVector.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Config/llvm-config.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/TimeProfiler.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/YAMLTraits.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
 #include "clang/AST/Expr.h"
 
+#ifdef LLVM_ON_UNIX
+#include <sys/resource.h>
+#endif
+
 using namespace std;
 using namespace clang;
-using namespace clang::ast_matchers;
 using namespace clang::driver;
 using namespace clang::tooling;
 
 static llvm::cl::OptionCategory MatcherSampleCategory("Matcher Sample");
 
-//IfStatementHandler Class: All Rewriting For IF statements done here.
-
-class IfStmtHandler : public MatchFinder::MatchCallback {
-public:
-  IfStmtHandler(Rewriter &Rewrite) : Rewrite(Rewrite) {}
+// Python IR. PyLowering below turns the AST of a sketch into these nodes in a
+// single walk and PyEmitter prints them in another one, so the conversion time
+// and the size of the output are proportional to the AST. Every node is
+// created once and never edited afterwards, so two conversions of a construct
+// cannot step on each other as the Rewriter edits did.
+
+// Python operator precedence, from the loosest to the tightest binding.
+enum PyPrecedence : uint8_t {
+  PrecNamedExpr,
+  PrecConditional,
+  PrecOr,
+  PrecAnd,
+  PrecNot,
+  PrecCompare,
+  PrecBitOr,
+  PrecBitXor,
+  PrecBitAnd,
+  PrecShift,
+  PrecAdd,
+  PrecMul,
+  PrecUnary,
+  PrecPostfix,
+  PrecAtom
+};
 
-  virtual void run(const MatchFinder::MatchResult &Result) {
-    // The matched 'if' statement was bound to 'ifStmt'.
-    if (const IfStmt *IfS = Result.Nodes.getNodeAs<clang::IfStmt>("ifStmt")) {
-      const Stmt *Then = IfS->getThen();
-      Rewrite.InsertText(Then->getBeginLoc(), "#if part\n", true, true);
+enum class PyExprKind {
+  // A name or a literal, Text is printed as is.
+  Atom,
+  // Text immediately followed by Operands[0], for the prefixes of the rules.
+  Prefixed,
+  // Text is the operator.
+  Unary,
+  Binary,
+  // Operands[0](Operands[1], ...)
+  Call,
+  // Operands[0].Text
+  Attribute,
+  // Operands[0][Operands[1]]
+  Subscript,
+  // Operands[1] if Operands[0] else Operands[2]
+  Conditional,
+  // Text := Operands[0]
+  NamedExpr,
+  // Text=Operands[0], in parameter lists and calls.
+  Keyword,
+  // [Operands[0], ...]
+  List,
+  // [Operands[0] for Text in Operands[1]]
+  Comprehension,
+  // Operands[0]:Operands[1] in a subscript, an empty atom for a missing bound.
+  Slice,
+  // Operands[0] Text Operands[1] Text Operands[2], a chained comparison.
+  Chain
+};
 
-      if (const Stmt *Else = IfS->getElse()) {
-        Rewrite.InsertText(Else->getBeginLoc(), "#else part\n", true, true);
-      }
-    }
-  }
+struct PyExpr {
+  PyExprKind Kind;
+  PyPrecedence Precedence;
+  StringRef Text;
+  ArrayRef<const PyExpr *> Operands;
+};
 
-private:
-  Rewriter &Rewrite;
+enum class PyStmtKind {
+  // Operands[0]
+  Expr,
+  // Operands[0] = ... = Operands[N - 1], Text is the assignment operator.
+  Assign,
+  // if Operands[0]: Body else: Orelse, printed as elif when Orelse is a
+  // single if.
+  If,
+  // while Operands[0]: Body
+  While,
+  // for Text in Operands[0]: Body
+  For,
+  // def Text(Operands...): Body
+  Def,
+  // return [Operands[0]]
+  Return,
+  Break,
+  Continue,
+  // global Operands...
+  Global,
+  // One comment line for every line of Text.
+  Comment
 };
 
-//ForLoopHandler Class: All Rewriting For For Loop statements done here.
+struct PyStmt {
+  PyStmtKind Kind;
+  StringRef Text;
+  ArrayRef<const PyExpr *> Operands;
+  ArrayRef<const PyStmt *> Body;
+  ArrayRef<const PyStmt *> Orelse;
+  // Printed as a comment at the end of the first line.
+  StringRef Note;
+  // For Def, the decorator without the @ and the return annotation.
+  StringRef Decorator;
+  StringRef Returns;
+};
 
-class IncrementForLoopHandler : public MatchFinder::MatchCallback {
+// A converted file. The nodes, the arrays of children and the strings built
+// while lowering live in the arena of the module and are released together.
+class PyModule {
 public:
-  IncrementForLoopHandler(Rewriter &Rewrite) : Rewrite(Rewrite) {}
+  PyModule() : Strings(Arena) {}
+
+  StringRef save(const llvm::Twine &Text) { return Strings.save(Text); }
 
-  virtual void run(const MatchFinder::MatchResult &Result) {
-    const VarDecl *IncVar = Result.Nodes.getNodeAs<VarDecl>("incVarName");
-    Rewrite.InsertText(IncVar->getBeginLoc(), "/* increment */", true, true);
-    Rewrite.ReplaceText(IncVar->getBeginLoc(), "print");
+  template <typename T> ArrayRef<T> copy(ArrayRef<T> Items) {
+    if (Items.empty())
+      return {};
+    T *Copy = Arena.Allocate<T>(Items.size());
+    std::uninitialized_copy(Items.begin(), Items.end(), Copy);
+    return ArrayRef<T>(Copy, Items.size());
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *expr(PyExprKind Kind, PyPrecedence Precedence, StringRef Text,
+                     ArrayRef<const PyExpr *> Operands = {}) {
+    return new (Arena.Allocate<PyExpr>())
+        PyExpr{Kind, Precedence, Text, copy(Operands)};
+  }
 
-//PinMode Class: All Rewriting For PinMode statements done here.
+  const PyExpr *atom(StringRef Text) {
+    return expr(PyExprKind::Atom, PrecAtom, Text);
+  }
 
-class pinModeVariableHandler : public MatchFinder::MatchCallback {
-public:
-   pinModeVariableHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  const PyExpr *unary(StringRef Op, const PyExpr *Operand) {
+    return expr(PyExprKind::Unary, Op == "not" ? PrecNot : PrecUnary, Op,
+                {Operand});
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* pm = Results.Nodes.getNodeAs<clang::CallExpr>("pinMode");
-    Rewrite.ReplaceText(pm->getBeginLoc(), "Pin.mode");
+  const PyExpr *binary(StringRef Op, const PyExpr *LHS, const PyExpr *RHS) {
+    PyPrecedence Precedence = llvm::StringSwitch<PyPrecedence>(Op)
+                                  .Case("or", PrecOr)
+                                  .Case("and", PrecAnd)
+                                  .Cases("<", "<=", ">", ">=", PrecCompare)
+                                  .Cases("==", "!=", "in", PrecCompare)
+                                  .Case("|", PrecBitOr)
+                                  .Case("^", PrecBitXor)
+                                  .Case("&", PrecBitAnd)
+                                  .Cases("<<", ">>", PrecShift)
+                                  .Cases("+", "-", PrecAdd)
+                                  .Default(PrecMul);
+    return expr(PyExprKind::Binary, Precedence, Op, {LHS, RHS});
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *call(const PyExpr *Callee, ArrayRef<const PyExpr *> Args) {
+    SmallVector<const PyExpr *, 8> Operands{Callee};
+    Operands.append(Args.begin(), Args.end());
+    return expr(PyExprKind::Call, PrecPostfix, "", Operands);
+  }
 
-//Handler for Void Loop() Class: All Rewriting For void loop statements done here. Void loop() is rewritten as While True:
+  const PyExpr *call(StringRef Callee, ArrayRef<const PyExpr *> Args) {
+    return call(atom(Callee), Args);
+  }
 
-class loopExprHandler : public MatchFinder::MatchCallback {
-public:
-   loopExprHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  const PyExpr *subscript(const PyExpr *Value, const PyExpr *Index) {
+    return expr(PyExprKind::Subscript, PrecPostfix, "", {Value, Index});
+  }
+
+  const PyExpr *slice(const PyExpr *Lower, const PyExpr *Upper) {
+    return expr(PyExprKind::Slice, PrecConditional, "",
+                {Lower ? Lower : atom(""), Upper ? Upper : atom("")});
+  }
+
+  // Lower <= Value <= Upper, Value is evaluated once.
+  const PyExpr *between(const PyExpr *Lower, const PyExpr *Value,
+                        const PyExpr *Upper) {
+    return expr(PyExprKind::Chain, PrecCompare, "<=", {Lower, Value, Upper});
+  }
+
+  PyStmt *stmt(PyStmtKind Kind, ArrayRef<const PyExpr *> Operands = {},
+               ArrayRef<const PyStmt *> Body = {},
+               ArrayRef<const PyStmt *> Orelse = {}) {
+    return new (Arena.Allocate<PyStmt>())
+        PyStmt{Kind, "", copy(Operands), copy(Body), copy(Orelse), "", "", ""};
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::FunctionDecl* loop = Results.Nodes.getNodeAs<clang::FunctionDecl>("loopexpr");
-    Rewrite.RemoveText(loop->getLocation()); 
-    Rewrite.ReplaceText(loop->getBeginLoc(), "While True:");
-    Rewrite.ReplaceText(loop->getLocation(), " ");
+  PyStmt *assign(const PyExpr *Target, const PyExpr *Value,
+                 StringRef Op = "=") {
+    PyStmt *S = stmt(PyStmtKind::Assign, {Target, Value});
+    S->Text = Op;
+    return S;
   }
 
+  // The import statements of the module, sorted.
+  std::set<StringRef> Imports;
+  ArrayRef<const PyStmt *> Body;
+
 private:
-  Rewriter &Rewrite;
+  llvm::BumpPtrAllocator Arena;
+  llvm::StringSaver Strings;
 };
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
-
-class delayHandler : public MatchFinder::MatchCallback {
+// Prints a PyModule. Every node is visited once and parentheses are only
+// added where the Python precedence differs from the tree.
+class PyEmitter {
 public:
-   delayHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
-
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* delayfinder = Results.Nodes.getNodeAs<clang::CallExpr>("delay");
-    Rewrite.ReplaceText(delayfinder->getBeginLoc(), "utime.sleep_ms");
+  explicit PyEmitter(raw_ostream &OS) : OS(OS) {}
+
+  void emitModule(const PyModule &Module) {
+    for (StringRef Import : Module.Imports)
+      OS << Import << "\n";
+    bool AfterDef = !Module.Imports.empty();
+    for (const PyStmt *S : Module.Body) {
+      bool IsDef = S->Kind == PyStmtKind::Def;
+      if (IsDef || AfterDef)
+        OS << "\n";
+      emitStmt(*S, 0);
+      AfterDef = IsDef;
+    }
   }
 
 private:
-  Rewriter &Rewrite;
-};
+  void emitBlock(ArrayRef<const PyStmt *> Body, unsigned Depth) {
+    if (Body.empty()) {
+      OS.indent(Depth * 4) << "pass\n";
+      return;
+    }
+    for (const PyStmt *S : Body)
+      emitStmt(*S, Depth);
+  }
 
-//Handler for Void Setup() Class: Void Setup is Deleted as It does not occur in Micropython Statements
+  void emitStmt(const PyStmt &S, unsigned Depth) {
+    if (S.Kind == PyStmtKind::Comment) {
+      StringRef Line, Rest = S.Text;
+      while (!Rest.empty()) {
+        std::tie(Line, Rest) = Rest.split('\n');
+        Line = Line.rtrim();
+        OS.indent(Depth * 4) << (Line.empty() ? "#" : "# ") << Line << "\n";
+      }
+      return;
+    }
 
-class setupHandler : public MatchFinder::MatchCallback {
-public:
-   setupHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+    OS.indent(Depth * 4);
+    switch (S.Kind) {
+    case PyStmtKind::Expr:
+      emitExpr(*S.Operands[0], PrecConditional);
+      break;
+    case PyStmtKind::Assign:
+      for (size_t I = 0; I + 1 < S.Operands.size(); ++I) {
+        emitExpr(*S.Operands[I], PrecConditional);
+        OS << " " << S.Text << " ";
+      }
+      emitExpr(*S.Operands.back(), PrecConditional);
+      break;
+    case PyStmtKind::If:
+      emitIf(S, Depth);
+      return;
+    case PyStmtKind::While:
+      OS << "while ";
+      emitExpr(*S.Operands[0], PrecConditional);
+      OS << ":";
+      endLine(S);
+      emitBlock(S.Body, Depth + 1);
+      return;
+    case PyStmtKind::For:
+      OS << "for " << S.Text << " in ";
+      emitExpr(*S.Operands[0], PrecConditional);
+      OS << ":";
+      endLine(S);
+      emitBlock(S.Body, Depth + 1);
+      return;
+    case PyStmtKind::Def:
+      if (!S.Decorator.empty()) {
+        OS << "@" << S.Decorator << "\n";
+        OS.indent(Depth * 4);
+      }
+      OS << "def " << S.Text << "(";
+      emitList(S.Operands);
+      OS << ")";
+      if (!S.Returns.empty())
+        OS << " -> " << S.Returns;
+      OS << ":";
+      endLine(S);
+      emitBlock(S.Body, Depth + 1);
+      return;
+    case PyStmtKind::Return:
+      OS << "return";
+      if (!S.Operands.empty()) {
+        OS << " ";
+        emitExpr(*S.Operands[0], PrecConditional);
+      }
+      break;
+    case PyStmtKind::Break:
+      OS << "break";
+      break;
+    case PyStmtKind::Continue:
+      OS << "continue";
+      break;
+    case PyStmtKind::Global:
+      OS << "global ";
+      emitList(S.Operands);
+      break;
+    case PyStmtKind::Comment:
+      llvm_unreachable("comments are printed above");
+    }
+    endLine(S);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::FunctionDecl* setupfinder = Results.Nodes.getNodeAs<clang::FunctionDecl>("setupfunc"); 
-    Rewrite.RemoveText(setupfinder->getLocation());
-    Rewrite.RemoveText(setupfinder->getBeginLoc());
-    Rewrite.ReplaceText(setupfinder->getBeginLoc(), " ");
+  void emitIf(const PyStmt &S, unsigned Depth) {
+    const PyStmt *If = &S;
+    OS << "if ";
+    while (true) {
+      emitExpr(*If->Operands[0], PrecConditional);
+      OS << ":";
+      endLine(*If);
+      emitBlock(If->Body, Depth + 1);
+      if (If->Orelse.empty())
+        return;
+      if (If->Orelse.size() == 1 && If->Orelse[0]->Kind == PyStmtKind::If) {
+        If = If->Orelse[0];
+        OS.indent(Depth * 4) << "elif ";
+        continue;
+      }
+      OS.indent(Depth * 4) << "else:\n";
+      emitBlock(If->Orelse, Depth + 1);
+      return;
+    }
   }
 
-private:
-  Rewriter &Rewrite;
+  void endLine(const PyStmt &S) {
+    if (!S.Note.empty())
+      OS << "  # " << S.Note;
+    OS << "\n";
+  }
+
+  void emitList(ArrayRef<const PyExpr *> Items) {
+    for (size_t I = 0; I < Items.size(); ++I) {
+      if (I)
+        OS << ", ";
+      emitExpr(*Items[I], PrecConditional);
+    }
+  }
+
+  // Prints E, in parentheses if it binds less tightly than MinPrecedence.
+  void emitExpr(const PyExpr &E, unsigned MinPrecedence) {
+    bool Parens = E.Precedence < MinPrecedence;
+    if (Parens)
+      OS << "(";
+    switch (E.Kind) {
+    case PyExprKind::Atom:
+      OS << E.Text;
+      break;
+    case PyExprKind::Prefixed:
+      OS << E.Text;
+      emitExpr(*E.Operands[0], E.Precedence);
+      break;
+    case PyExprKind::Unary:
+      OS << E.Text;
+      if (llvm::isAlpha(E.Text.back()))
+        OS << " ";
+      emitExpr(*E.Operands[0], E.Precedence);
+      break;
+    case PyExprKind::Binary:
+      // Comparisons do not chain in C, a < b < c is (a < b) < c.
+      emitExpr(*E.Operands[0],
+               E.Precedence + (E.Precedence == PrecCompare ? 1 : 0));
+      OS << " " << E.Text << " ";
+      emitExpr(*E.Operands[1], E.Precedence + 1);
+      break;
+    case PyExprKind::Call:
+      emitExpr(*E.Operands[0], PrecPostfix);
+      OS << "(";
+      emitList(E.Operands.drop_front());
+      OS << ")";
+      break;
+    case PyExprKind::Attribute:
+      emitExpr(*E.Operands[0], PrecPostfix);
+      OS << "." << E.Text;
+      break;
+    case PyExprKind::Subscript:
+      emitExpr(*E.Operands[0], PrecPostfix);
+      OS << "[";
+      emitExpr(*E.Operands[1], PrecConditional);
+      OS << "]";
+      break;
+    case PyExprKind::Conditional:
+      emitExpr(*E.Operands[1], PrecOr);
+      OS << " if ";
+      emitExpr(*E.Operands[0], PrecOr);
+      OS << " else ";
+      emitExpr(*E.Operands[2], PrecConditional);
+      break;
+    case PyExprKind::NamedExpr:
+      OS << E.Text << " := ";
+      emitExpr(*E.Operands[0], PrecConditional);
+      break;
+    case PyExprKind::Keyword:
+      OS << E.Text << "=";
+      emitExpr(*E.Operands[0], PrecConditional);
+      break;
+    case PyExprKind::List:
+      OS << "[";
+      emitList(E.Operands);
+      OS << "]";
+      break;
+    case PyExprKind::Comprehension:
+      OS << "[";
+      emitExpr(*E.Operands[0], PrecConditional);
+      OS << " for " << E.Text << " in ";
+      emitExpr(*E.Operands[1], PrecOr);
+      OS << "]";
+      break;
+    case PyExprKind::Slice:
+      emitExpr(*E.Operands[0], PrecConditional);
+      OS << ":";
+      emitExpr(*E.Operands[1], PrecConditional);
+      break;
+    case PyExprKind::Chain:
+      for (size_t I = 0; I < E.Operands.size(); ++I) {
+        if (I)
+          OS << " " << E.Text << " ";
+        emitExpr(*E.Operands[I], E.Precedence + 1);
+      }
+      break;
+    }
+    if (Parens)
+      OS << ")";
+  }
+
+  raw_ostream &OS;
 };
 
+// Where a rewrite rule applies.
+enum class RuleKind {
+  // Calls to the function named QualifiedName.
+  Call,
+  // References to the variable named QualifiedName.
+  Variable,
+  // References to the function named QualifiedName reached through a using
+  // declaration.
+  UsingRef
+};
 
-//Handler for CompoundStatements: Curly Braces are not required in Micropython and Can be removed. Since  project with improper indentation might become hard to understand
-// it will insert a # (comment statement) before each {}
+// One Arduino to MicroPython mapping of the rules file. The format extends
+// the QualifiedName/NewName entries of samplecode/keysub.yaml.
+struct RewriteRule {
+  std::string QualifiedName;
+  RuleKind Kind = RuleKind::Call;
+  // Replaces the name.
+  std::string NewName;
+  // Inserted before the name.
+  std::string Prefix;
+  // Inserted before every variable referenced in the arguments of the call.
+  std::string ArgumentVarPrefix;
+  // Inserted before every expression of the arguments of the call that has an
+  // integer literal operand.
+  std::string ArgumentLiteralPrefix;
+};
 
-class compoundStmtHandler : public MatchFinder::MatchCallback {
-public:
-   compoundStmtHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+LLVM_YAML_IS_SEQUENCE_VECTOR(RewriteRule)
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* compoundstmtfinder = Results.Nodes.getNodeAs<clang::Stmt>("compoundstmt");
-    Rewrite.InsertText(compoundstmtfinder->getBeginLoc(), "#", true, true);
-    Rewrite.InsertText(compoundstmtfinder->getEndLoc(), "#", true, true);
+namespace llvm {
+namespace yaml {
+
+template <> struct ScalarEnumerationTraits<RuleKind> {
+  static void enumeration(IO &IO, RuleKind &Kind) {
+    IO.enumCase(Kind, "Call", RuleKind::Call);
+    IO.enumCase(Kind, "Variable", RuleKind::Variable);
+    IO.enumCase(Kind, "UsingRef", RuleKind::UsingRef);
   }
+};
 
-private:
-  Rewriter &Rewrite;
+template <> struct MappingTraits<RewriteRule> {
+  static void mapping(IO &IO, RewriteRule &Rule) {
+    IO.mapRequired("QualifiedName", Rule.QualifiedName);
+    IO.mapOptional("Kind", Rule.Kind, RuleKind::Call);
+    IO.mapOptional("NewName", Rule.NewName);
+    IO.mapOptional("Prefix", Rule.Prefix);
+    IO.mapOptional("ArgumentVarPrefix", Rule.ArgumentVarPrefix);
+    IO.mapOptional("ArgumentLiteralPrefix", Rule.ArgumentLiteralPrefix);
+  }
 };
 
-//Handler for power expression. converts pow to math.pow
+} // namespace yaml
+} // namespace llvm
 
-class powerHandler : public MatchFinder::MatchCallback {
+// The rewrite rules of a run, indexed by name. The index is built once at
+// startup and only read afterwards, so all the workers of a batch share it and
+// the cost of a lookup does not depend on the number of rules.
+class RuleIndex {
 public:
-   powerHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Loads the rules from the YAML file at Path, returns false and sets Error
+  // if the file cannot be read or parsed.
+  bool load(StringRef Path, std::string &Error) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
+        llvm::MemoryBuffer::getFile(Path);
+    if (!Buffer) {
+      Error = "cannot read " + Path.str() + ": " + Buffer.getError().message();
+      return false;
+    }
+    llvm::yaml::Input YAML((*Buffer)->getBuffer());
+    YAML >> Rules;
+    if (YAML.error()) {
+      Error = "cannot parse " + Path.str() + ": " + YAML.error().message();
+      return false;
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* powfinder = Results.Nodes.getNodeAs<clang::Stmt>("pow");
-    Rewrite.InsertText(powfinder->getBeginLoc(), "math.", true, true);
+    for (const RewriteRule &Rule : Rules) {
+      llvm::StringMap<const RewriteRule *> &Index =
+          Rule.Kind == RuleKind::Call
+              ? Calls
+              : Rule.Kind == RuleKind::Variable ? Variables : UsingRefs;
+      if (!Index.try_emplace(Rule.QualifiedName, &Rule).second) {
+        Error = "duplicate rule for " + Rule.QualifiedName + " in " + Path.str();
+        return false;
+      }
+    }
+    return true;
+  }
+
+  const RewriteRule *findCall(StringRef Name) const { return find(Calls, Name); }
+  const RewriteRule *findVariable(StringRef Name) const {
+    return find(Variables, Name);
+  }
+  const RewriteRule *findUsingRef(StringRef Name) const {
+    return find(UsingRefs, Name);
   }
 
 private:
-  Rewriter &Rewrite;
+  static const RewriteRule *find(const llvm::StringMap<const RewriteRule *> &Index,
+                                 StringRef Name) {
+    auto It = Index.find(Name);
+    return It == Index.end() ? nullptr : It->second;
+  }
+
+  std::vector<RewriteRule> Rules;
+  llvm::StringMap<const RewriteRule *> Calls;
+  llvm::StringMap<const RewriteRule *> Variables;
+  llvm::StringMap<const RewriteRule *> UsingRefs;
 };
 
-//Handler for square root expression. converts sqrt to math.sqrt
 
-class sqrtHandler : public MatchFinder::MatchCallback {
-public:
-   sqrtHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+// Wall-clock seconds spent in each phase of a conversion, reported by --stats.
+// Parse covers everything the frontend does before the AST is complete, lower
+// builds the Python IR, generate prints it and emit writes it out.
+struct PhaseTimes {
+  double Parse = 0;
+  double Lower = 0;
+  double Generate = 0;
+  double Emit = 0;
+};
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* sqrtfinder = Results.Nodes.getNodeAs<clang::Stmt>("sqrt");
-    Rewrite.InsertText(sqrtfinder->getBeginLoc(), "math.", true, true);
-  }
+using StatsClock = std::chrono::steady_clock;
 
-private:
-  Rewriter &Rewrite;
+static double secondsSince(StatsClock::time_point Start) {
+  return std::chrono::duration<double>(StatsClock::now() - Start).count();
+}
+
+// How many times a construct was lowered or a rule applied, and the time spent
+// in it, including the constructs nested in it.
+struct HandlerCounter {
+  uint64_t Hits = 0;
+  double Seconds = 0;
 };
 
-//Handler for sin expression. converts sin to math.sin
+// Counters of a conversion, by construct and by rule name.
+struct HandlerCounters {
+  llvm::StringMap<HandlerCounter> Constructs;
+  llvm::StringMap<HandlerCounter> Rules;
+};
 
-class sinHandler : public MatchFinder::MatchCallback {
-public:
-   sinHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+static unsigned countReferences(const VarDecl *Var, const Stmt *S) {
+  if (!S)
+    return 0;
+  unsigned Count = 0;
+  if (const auto *Ref = dyn_cast<DeclRefExpr>(S))
+    Count = Ref->getDecl() == Var;
+  for (const Stmt *Child : S->children())
+    Count += countReferences(Var, Child);
+  return Count;
+}
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* sinfinder = Results.Nodes.getNodeAs<clang::Stmt>("sin");
-    Rewrite.InsertText(sinfinder->getBeginLoc(), "math.", true, true);
+// A 'for' loop whose counter goes from Start to Bound by a constant Step.
+// For example:
+//
+//  for (int i = 0; i < N; ++i)
+//  for (int i = N - 1; i >= 0; i -= 2)
+struct CountedLoop {
+  const VarDecl *Counter;
+  const Expr *Start;
+  const Expr *Bound;
+  int64_t Step;
+  // The condition is <= or >=, the counter reaches the bound.
+  bool Inclusive;
+};
+
+static const VarDecl *getReferencedVar(const Expr *E) {
+  const auto *Ref = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+  return Ref ? dyn_cast<VarDecl>(Ref->getDecl()) : nullptr;
+}
+
+// Matches the loops that declare their counter, count by a constant step and
+// compare the counter to a bound, in the direction of the step.
+static bool matchCountedLoop(const ForStmt *For, const ASTContext &Context,
+                             CountedLoop &Loop) {
+  const auto *Init = dyn_cast_or_null<DeclStmt>(For->getInit());
+  if (!Init || !Init->isSingleDecl())
+    return false;
+  const auto *Counter = dyn_cast<VarDecl>(Init->getSingleDecl());
+  if (!Counter || !Counter->getType()->isIntegerType() || !Counter->getInit())
+    return false;
+
+  // ++i, i++, --i, i--, i += k, i -= k and i = i + k.
+  const Expr *Inc = For->getInc() ? For->getInc()->IgnoreParens() : nullptr;
+  const Expr *Target = nullptr, *Step = nullptr;
+  bool Down = false;
+  if (const auto *UO = dyn_cast_or_null<UnaryOperator>(Inc)) {
+    if (!UO->isIncrementDecrementOp())
+      return false;
+    Target = UO->getSubExpr();
+    Down = UO->isDecrementOp();
+  } else if (const auto *BO = dyn_cast_or_null<BinaryOperator>(Inc)) {
+    Target = BO->getLHS();
+    Step = BO->getRHS();
+    Down = BO->getOpcode() == BO_SubAssign;
+    if (BO->getOpcode() == BO_Assign) {
+      const auto *Sum = dyn_cast<BinaryOperator>(Step->IgnoreParenImpCasts());
+      if (!Sum || (Sum->getOpcode() != BO_Add && Sum->getOpcode() != BO_Sub) ||
+          getReferencedVar(Sum->getLHS()) != Counter)
+        return false;
+      Step = Sum->getRHS();
+      Down = Sum->getOpcode() == BO_Sub;
+    } else if (BO->getOpcode() != BO_AddAssign &&
+               BO->getOpcode() != BO_SubAssign) {
+      return false;
+    }
+  }
+  if (!Target || getReferencedVar(Target) != Counter)
+    return false;
+  Loop.Step = 1;
+  if (Step) {
+    Expr::EvalResult Result;
+    if (!Step->EvaluateAsInt(Result, Context) ||
+        Result.Val.getInt().getMinSignedBits() > 32)
+      return false;
+    Loop.Step = Result.Val.getInt().getExtValue();
+  }
+  if (Down)
+    Loop.Step = -Loop.Step;
+  if (Loop.Step == 0)
+    return false;
+
+  // i < N, or N > i.
+  const auto *Cond = dyn_cast_or_null<BinaryOperator>(For->getCond());
+  if (!Cond || !Cond->isRelationalOp())
+    return false;
+  BinaryOperatorKind Opcode = Cond->getOpcode();
+  Loop.Bound = Cond->getRHS();
+  if (getReferencedVar(Cond->getLHS()) != Counter) {
+    if (getReferencedVar(Cond->getRHS()) != Counter)
+      return false;
+    Loop.Bound = Cond->getLHS();
+    Opcode = BinaryOperator::reverseComparisonOp(Opcode);
   }
+  if (!Loop.Bound->getType()->isIntegerType())
+    return false;
+  bool Up = Opcode == BO_LT || Opcode == BO_LE;
+  if (Up != (Loop.Step > 0))
+    return false;
+  // An unsigned i >= 0 never ends.
+  if (Opcode == BO_GE && Counter->getType()->isUnsignedIntegerType())
+    return false;
+  Loop.Inclusive = Opcode == BO_LE || Opcode == BO_GE;
+  Loop.Counter = Counter;
+  Loop.Start = Counter->getInit();
+  return true;
+}
 
-private:
-  Rewriter &Rewrite;
-};
+// Returns the array the counter of a loop indexes if the counter is only
+// used as an index of that array and the body does not assign the indexed
+// element, or null.
+static const VarDecl *getIndexedArray(const VarDecl *Counter, const Stmt *S,
+                                      const VarDecl *Array = nullptr) {
+  if (!S)
+    return Array;
+  auto isIndexedByCounter = [&](const Expr *E) {
+    const auto *Subscript = dyn_cast<ArraySubscriptExpr>(E->IgnoreParens());
+    return Subscript && getReferencedVar(Subscript->getIdx()) == Counter;
+  };
+  if (const auto *BO = dyn_cast<BinaryOperator>(S)) {
+    if (BO->isAssignmentOp() && isIndexedByCounter(BO->getLHS()))
+      return nullptr;
+  } else if (const auto *UO = dyn_cast<UnaryOperator>(S)) {
+    if ((UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf) &&
+        isIndexedByCounter(UO->getSubExpr()))
+      return nullptr;
+  }
+  if (const auto *Subscript = dyn_cast<ArraySubscriptExpr>(S)) {
+    if (getReferencedVar(Subscript->getIdx()) == Counter) {
+      const VarDecl *Base = getReferencedVar(Subscript->getBase());
+      if (!Base || !Base->getType()->isConstantArrayType() ||
+          (Array && Array != Base))
+        return nullptr;
+      return Base;
+    }
+  }
+  if (const auto *Ref = dyn_cast<DeclRefExpr>(S))
+    return Ref->getDecl() == Counter ? nullptr : Array;
+  for (const Stmt *Child : S->children()) {
+    if (Child && countReferences(Counter, Child)) {
+      Array = getIndexedArray(Counter, Child, Array);
+      if (!Array)
+        return nullptr;
+    }
+  }
+  return Array;
+}
 
-//Handler for cos expression. converts cos to math.cos
+// Returns true if S assigns, increments or takes the address of Var, or
+// binds a non-const reference to it: a reference parameter of a call, a
+// reference variable or a lambda capture by reference.
+static bool isModifiedIn(const VarDecl *Var, const Stmt *S) {
+  if (!S)
+    return false;
+  auto refersToVar = [&](const Expr *E) {
+    const auto *Ref = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    return Ref && Ref->getDecl() == Var;
+  };
+  auto bindsReference = [&](QualType Type, const Expr *E) {
+    return Type->isReferenceType() &&
+           !Type.getNonReferenceType().isConstQualified() && refersToVar(E);
+  };
+  // The parameters of the callee, from its type if it is not a function.
+  auto bindsParameter = [&](const FunctionDecl *Callee,
+                            const FunctionProtoType *Proto,
+                            ArrayRef<const Expr *> Args) {
+    for (unsigned I = 0; I < Args.size(); ++I) {
+      QualType Type;
+      if (Callee && I < Callee->getNumParams())
+        Type = Callee->getParamDecl(I)->getType();
+      else if (!Callee && Proto && I < Proto->getNumParams())
+        Type = Proto->getParamType(I);
+      if (!Type.isNull() && bindsReference(Type, Args[I]))
+        return true;
+    }
+    return false;
+  };
+  if (const auto *BO = dyn_cast<BinaryOperator>(S)) {
+    if (BO->isAssignmentOp() && refersToVar(BO->getLHS()))
+      return true;
+  } else if (const auto *UO = dyn_cast<UnaryOperator>(S)) {
+    if ((UO->isIncrementDecrementOp() || UO->getOpcode() == UO_AddrOf) &&
+        refersToVar(UO->getSubExpr()))
+      return true;
+  } else if (const auto *Call = dyn_cast<CallExpr>(S)) {
+    const FunctionDecl *Callee = Call->getDirectCallee();
+    QualType Type = Call->getCallee()->getType();
+    if (const auto *Pointer = Type->getAs<PointerType>())
+      Type = Pointer->getPointeeType();
+    ArrayRef<const Expr *> Args(Call->getArgs(), Call->getNumArgs());
+    // The object of a member operator is its first argument.
+    if (isa<CXXOperatorCallExpr>(Call) &&
+        isa_and_nonnull<CXXMethodDecl>(Callee))
+      Args = Args.drop_front();
+    if (bindsParameter(Callee, Type->getAs<FunctionProtoType>(), Args))
+      return true;
+  } else if (const auto *Construct = dyn_cast<CXXConstructExpr>(S)) {
+    if (bindsParameter(Construct->getConstructor(), nullptr,
+                       ArrayRef<const Expr *>(Construct->getArgs(),
+                                              Construct->getNumArgs())))
+      return true;
+  } else if (const auto *Decls = dyn_cast<DeclStmt>(S)) {
+    for (const Decl *D : Decls->decls())
+      if (const auto *Ref = dyn_cast<VarDecl>(D))
+        if (Ref->getInit() && bindsReference(Ref->getType(), Ref->getInit()))
+          return true;
+  } else if (const auto *Lambda = dyn_cast<LambdaExpr>(S)) {
+    for (const LambdaCapture &Capture : Lambda->captures())
+      if (Capture.capturesVariable() &&
+          Capture.getCaptureKind() == LCK_ByRef &&
+          Capture.getCapturedVar() == Var)
+        return true;
+  }
+  for (const Stmt *Child : S->children())
+    if (isModifiedIn(Var, Child))
+      return true;
+  return false;
+}
 
-class cosHandler : public MatchFinder::MatchCallback {
-public:
-   cosHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+// Returns true if S contains a break that leaves the enclosing switch, that
+// is one that is not nested in a loop or in another switch.
+static bool containsSwitchBreak(const Stmt *S) {
+  if (!S || isa<ForStmt>(S) || isa<WhileStmt>(S) || isa<DoStmt>(S) ||
+      isa<SwitchStmt>(S))
+    return false;
+  if (isa<BreakStmt>(S))
+    return true;
+  for (const Stmt *Child : S->children())
+    if (containsSwitchBreak(Child))
+      return true;
+  return false;
+}
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* cosfinder = Results.Nodes.getNodeAs<clang::Stmt>("cos");
-    Rewrite.InsertText(cosfinder->getBeginLoc(), "math.", true, true);
+// Returns true if T is the Arduino String or the temporary its operator+
+// returns.
+static bool isArduinoString(QualType T) {
+  const CXXRecordDecl *Record = T.getNonReferenceType()->getAsCXXRecordDecl();
+  return Record && Record->getIdentifier() &&
+         (Record->getName() == "String" ||
+          Record->getName() == "StringSumHelper");
+}
+
+static const StringLiteral *findStringLiteral(const Stmt *S) {
+  if (!S)
+    return nullptr;
+  if (const auto *String = dyn_cast<StringLiteral>(S))
+    return String;
+  for (const Stmt *Child : S->children())
+    if (const StringLiteral *String = findStringLiteral(Child))
+      return String;
+  return nullptr;
+}
+
+// Returns true if S contains a label, a case or a loop exit (break or
+// continue) that lowering it without the statement around it would change.
+static bool containsJumpTarget(const Stmt *S) {
+  if (!S)
+    return false;
+  if (isa<LabelStmt>(S) || isa<SwitchCase>(S) || isa<BreakStmt>(S) ||
+      isa<ContinueStmt>(S))
+    return true;
+  for (const Stmt *Child : S->children())
+    if (containsJumpTarget(Child))
+      return true;
+  return false;
+}
+
+static bool hasIntegerLiteralChild(const Stmt *S) {
+  for (const Stmt *Child : S->children())
+    if (Child && isa<IntegerLiteral>(Child))
+      return true;
+  return false;
+}
+
+// Returns Text as a Python string literal, or a bytes literal with Bytes.
+static std::string quotePython(StringRef Text, bool Bytes = false) {
+  std::string Quoted = Bytes ? "b\"" : "\"";
+  for (unsigned char C : Text) {
+    switch (C) {
+    case '"':
+    case '\\':
+      Quoted += '\\';
+      Quoted += C;
+      break;
+    case '\n':
+      Quoted += "\\n";
+      break;
+    case '\r':
+      Quoted += "\\r";
+      break;
+    case '\t':
+      Quoted += "\\t";
+      break;
+    default:
+      if (C < 0x20 || C >= 0x7f) {
+        Quoted += "\\x";
+        Quoted += llvm::hexdigit(C >> 4, /*LowerCase=*/true);
+        Quoted += llvm::hexdigit(C & 0xf, /*LowerCase=*/true);
+      } else {
+        Quoted += C;
+      }
+    }
   }
+  return Quoted + "\"";
+}
 
-private:
-  Rewriter &Rewrite;
+// The bits of the table of the character classes that are made of several
+// ranges of the ASCII characters.
+enum CharacterClass : uint8_t {
+  ClassAlpha = 0x1,
+  ClassAlphaNumeric = 0x2,
+  ClassHexadecimalDigit = 0x4,
+  ClassPunct = 0x8,
+  ClassSpace = 0x10,
+  ClassWhitespace = 0x20,
+  ClassControl = 0x40
 };
 
-//Handler for tan expression. converts tan to math.tan
+// Returns the classes of C as <ctype.h> sees them in the "C" locale, none
+// beyond ASCII.
+static uint8_t getCharacterClasses(unsigned C) {
+  uint8_t Classes = 0;
+  if (C >= 128)
+    return Classes;
+  if (llvm::isAlpha(C))
+    Classes |= ClassAlpha;
+  if (llvm::isAlnum(C))
+    Classes |= ClassAlphaNumeric;
+  if (llvm::isHexDigit(C))
+    Classes |= ClassHexadecimalDigit;
+  if (C > ' ' && C < 127 && !llvm::isAlnum(C))
+    Classes |= ClassPunct;
+  if (C == ' ' || (C >= '\t' && C <= '\r'))
+    Classes |= ClassSpace;
+  if (C == ' ' || C == '\t')
+    Classes |= ClassWhitespace;
+  if (C < ' ' || C == 127)
+    Classes |= ClassControl;
+  return Classes;
+}
+
+enum class CodeEmitter { Bytecode, Native, Viper };
+
+static llvm::cl::opt<CodeEmitter> CodeEmitterForIntegers(
+    "code-emitter",
+    llvm::cl::desc("MicroPython code emitter of the functions that only use "
+                   "integers"),
+    llvm::cl::values(
+        clEnumValN(CodeEmitter::Bytecode, "bytecode", "Interpreted (default)"),
+        clEnumValN(CodeEmitter::Native, "native",
+                   "Machine code, @micropython.native"),
+        clEnumValN(CodeEmitter::Viper, "viper",
+                   "Machine code with machine word integers, "
+                   "@micropython.viper")),
+    llvm::cl::init(CodeEmitter::Bytecode),
+    llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<unsigned> SerialUart(
+    "serial-uart",
+    llvm::cl::desc("Id of the machine.UART that Serial is written to, Serial1 "
+                   "to Serial3 use UART 1 to 3"),
+    llvm::cl::init(0), llvm::cl::cat(MatcherSampleCategory));
+
+// The GPIO registers that set and clear the output pins written to at once,
+// one bit per pin.
+enum class GpioTarget { None, RP2, ESP32 };
+
+static llvm::cl::opt<GpioTarget> PortWrites(
+    "port-writes",
+    llvm::cl::desc("Board whose GPIO registers take the consecutive "
+                   "digitalWrite() calls of constant pins in a single write"),
+    llvm::cl::values(
+        clEnumValN(GpioTarget::None, "none", "Pin objects only (default)"),
+        clEnumValN(GpioTarget::RP2, "rp2", "RP2040 SIO, pins 0 to 29"),
+        clEnumValN(GpioTarget::ESP32, "esp32", "ESP32, pins 0 to 31")),
+    llvm::cl::init(GpioTarget::None), llvm::cl::cat(MatcherSampleCategory));
+
+static bool isIntegerType(QualType T) {
+  return T->isIntegerType() || T->isEnumeralType();
+}
 
-class tanHandler : public MatchFinder::MatchCallback {
+// Returns true if every value computed or declared in S is an integer, so
+// the native and viper emitters can compile it to machine code.
+static bool usesOnlyIntegers(const Stmt *S) {
+  if (!S)
+    return true;
+  if (const auto *E = dyn_cast<Expr>(S)) {
+    QualType T = E->getType().getCanonicalType();
+    // The references to the called functions are the only other values.
+    if (!isIntegerType(T) && !T->isVoidType() && !T->isFunctionType() &&
+        !T->isFunctionPointerType())
+      return false;
+  } else if (const auto *DS = dyn_cast<DeclStmt>(S)) {
+    for (const Decl *D : DS->decls()) {
+      const auto *Var = dyn_cast<VarDecl>(D);
+      if (!Var || !isIntegerType(Var->getType()))
+        return false;
+    }
+  }
+  for (const Stmt *Child : S->children())
+    if (!usesOnlyIntegers(Child))
+      return false;
+  return true;
+}
+
+// Lowers the main file of a translation unit into a PyModule. The global
+// variables, enums and functions keep their order. The bodies of setup() and
+// of loop() become a main() function, the latter in a while True: loop, so
+// their variables are fast locals instead of module globals. Calls and
+// references named in the rules file are renamed on the way. The constructs
+// that have no Python equivalent are kept as C++ and flagged with a comment,
+// so the output can still be fixed by hand.
+//
+// The lowering also takes care of what makes MicroPython slow: the integer
+// constants become const(), the module attributes the loop uses are looked
+// up once before it and, with --code-emitter, the functions that only use
+// integers are compiled to machine code. The Serial output is formatted in
+// place in buffers allocated once, the loop does not feed the garbage
+// collector with strings. The constant pins get a machine.Pin object each.
+class PyLowering {
 public:
-   tanHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  PyLowering(ASTContext &Context, Preprocessor &PP, const RuleIndex &Rules,
+             PyModule &Module, HandlerCounters *Counters)
+      : Context(Context), SM(Context.getSourceManager()),
+        LangOpts(Context.getLangOpts()), PP(PP), Rules(Rules), M(Module),
+        Counters(Counters) {}
+
+  void lowerTranslationUnit(const TranslationUnitDecl *TU) {
+    SmallVector<const PyStmt *, 32> Decls;
+    const FunctionDecl *SetupFunction = nullptr, *LoopFunction = nullptr;
+    for (const Decl *D : TU->decls()) {
+      if (!isInMainFile(D->getLocation()))
+        continue;
+      const auto *Function = dyn_cast<FunctionDecl>(D);
+      if (Function && Function->doesThisDeclarationHaveABody() &&
+          Function->getIdentifier() && Function->getNumParams() == 0) {
+        if (Function->getName() == "setup") {
+          SetupFunction = Function;
+          continue;
+        }
+        if (Function->getName() == "loop") {
+          LoopFunction = Function;
+          continue;
+        }
+      }
+      lowerDecl(D, Decls);
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* tanfinder = Results.Nodes.getNodeAs<clang::Stmt>("tan");
-    Rewrite.InsertText(tanfinder->getBeginLoc(), "math.", true, true);
+    // main() is lowered first, the macros it uses are defined above it.
+    if (SetupFunction || LoopFunction) {
+      const PyStmt *Main = lowerMain(SetupFunction, LoopFunction);
+      Decls.append(StaticLocals.begin(), StaticLocals.end());
+      StaticLocals.clear();
+      Decls.push_back(Main);
+      Decls.push_back(M.stmt(PyStmtKind::Expr, {M.call("main", {})}));
+    }
+    SmallVector<const PyStmt *, 64> Body(MacroDefinitions.begin(),
+                                         MacroDefinitions.end());
+    definePins(Body);
+    defineCharacterTable(Body);
+    defineTruncatingDivision(Body);
+    defineSerialOutput(Body);
+    Body.append(Decls.begin(), Decls.end());
+    M.Body = M.copy<const PyStmt *>(Body);
   }
 
 private:
-  Rewriter &Rewrite;
-};
+  using StmtList = SmallVectorImpl<const PyStmt *>;
+
+  // def main():
+  //     <setup body>
+  //     utime_sleep_ms = utime.sleep_ms
+  //     while True:
+  //         <loop body>
+  const PyStmt *lowerMain(const FunctionDecl *Setup, const FunctionDecl *Loop) {
+    llvm::SetVector<StringRef> Globals;
+    AssignedGlobals = &Globals;
+    SmallVector<const PyStmt *, 32> Body;
+    if (Setup) {
+      Scope = FunctionScope::Setup;
+      count("Setup", [&] { lowerStmt(Setup->getBody(), Body); });
+    }
+    if (Loop) {
+      Scope = FunctionScope::Loop;
+      SmallVector<const PyStmt *, 32> LoopBody;
+      count("Loop", [&] { lowerStmt(Loop->getBody(), LoopBody); });
+      for (const auto &Alias : LoopAliases)
+        Body.push_back(M.assign(M.atom(Alias.second), M.atom(Alias.first)));
+      Body.push_back(M.stmt(PyStmtKind::While, {M.atom("True")}, LoopBody));
+    }
+    Scope = FunctionScope::Other;
+    AssignedGlobals = nullptr;
+    insertGlobals(Globals, Body);
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+    PyStmt *Main = M.stmt(PyStmtKind::Def, {}, Body);
+    Main->Text = "main";
+    return Main;
+  }
 
-class delayMicrosecondsHandler : public MatchFinder::MatchCallback {
-public:
-   delayMicrosecondsHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Python needs to be told about the globals a function assigns.
+  void insertGlobals(const llvm::SetVector<StringRef> &Globals,
+                     SmallVectorImpl<const PyStmt *> &Body) {
+    if (Globals.empty())
+      return;
+    SmallVector<const PyExpr *, 4> Names;
+    for (StringRef Name : Globals)
+      Names.push_back(M.atom(Name));
+    Body.insert(Body.begin(), M.stmt(PyStmtKind::Global, Names));
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* delayMicrosecondsfinder = Results.Nodes.getNodeAs<clang::CallExpr>("delayMicroseconds");
-    Rewrite.ReplaceText(delayMicrosecondsfinder->getBeginLoc(), "utime.sleep_us");
+  void lowerDecl(const Decl *D, StmtList &Out) {
+    if (const auto *Var = dyn_cast<VarDecl>(D)) {
+      lowerVar(Var, Out);
+    } else if (const auto *Function = dyn_cast<FunctionDecl>(D)) {
+      if (!Function->doesThisDeclarationHaveABody())
+        return;
+      if (isa<CXXMethodDecl>(Function))
+        unsupported(D->getSourceRange(), Out);
+      else
+        count("Function", [&] { lowerFunction(Function, Out); });
+    } else if (const auto *Enum = dyn_cast<EnumDecl>(D)) {
+      for (const EnumConstantDecl *Enumerator : Enum->enumerators())
+        Out.push_back(M.assign(M.atom(getName(Enumerator)),
+                               constant(Enumerator->getInitVal())));
+    } else if (const auto *Record = dyn_cast<RecordDecl>(D)) {
+      if (Record->isThisDeclarationADefinition())
+        unsupported(D->getSourceRange(), Out);
+    } else if (isa<FunctionTemplateDecl>(D) || isa<ClassTemplateDecl>(D)) {
+      unsupported(D->getSourceRange(), Out);
+    }
+    // Prototypes, typedefs and using declarations have nothing to run.
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  void lowerFunction(const FunctionDecl *Function, StmtList &Out) {
+    CodeEmitter Emitter = CodeEmitterForIntegers;
+    if (Emitter != CodeEmitter::Bytecode && !isIntegerOnly(Function))
+      Emitter = CodeEmitter::Bytecode;
+    // The viper emitter only uses machine words for the annotated values.
+    bool Annotate = Emitter == CodeEmitter::Viper;
+
+    SmallVector<const PyExpr *, 4> Params;
+    for (const ParmVarDecl *Param : Function->parameters()) {
+      StringRef Name = Param->getIdentifier()
+                           ? getName(Param)
+                           : M.save("_" + llvm::utostr(Params.size()));
+      if (Annotate)
+        Name = M.save(Name + ": int");
+      if (Param->hasDefaultArg() && !Param->hasUnparsedDefaultArg() &&
+          !Param->hasUninstantiatedDefaultArg())
+        Params.push_back(M.expr(PyExprKind::Keyword, PrecAtom, Name,
+                                {lowerExpr(Param->getDefaultArg())}));
+      else
+        Params.push_back(M.atom(Name));
+    }
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+    llvm::SetVector<StringRef> Globals;
+    AssignedGlobals = &Globals;
+    SmallVector<const PyStmt *, 16> Body;
+    lowerStmt(Function->getBody(), Body);
+    AssignedGlobals = nullptr;
+    insertGlobals(Globals, Body);
+
+    PyStmt *Def = M.stmt(PyStmtKind::Def, Params, Body);
+    Def->Text = getName(Function);
+    if (Emitter != CodeEmitter::Bytecode) {
+      M.Imports.insert("import micropython");
+      Def->Decorator = Emitter == CodeEmitter::Native ? "micropython.native"
+                                                       : "micropython.viper";
+    }
+    if (Annotate && !Function->getReturnType()->isVoidType())
+      Def->Returns = "int";
+    Out.append(StaticLocals.begin(), StaticLocals.end());
+    StaticLocals.clear();
+    Out.push_back(Def);
+  }
 
-class millisHandler : public MatchFinder::MatchCallback {
-public:
-   millisHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  static bool isIntegerOnly(const FunctionDecl *Function) {
+    if (Function->isVariadic() ||
+        (!Function->getReturnType()->isVoidType() &&
+         !isIntegerType(Function->getReturnType())))
+      return false;
+    for (const ParmVarDecl *Param : Function->parameters())
+      if (!isIntegerType(Param->getType()))
+        return false;
+    return usesOnlyIntegers(Function->getBody());
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* millisfinder = Results.Nodes.getNodeAs<clang::CallExpr>("millis");
-    Rewrite.ReplaceText(millisfinder->getBeginLoc(), "utime.ticks_ms");
+  void lowerVar(const VarDecl *Var, StmtList &Out) {
+    // A static local keeps its value between the calls: it's assigned once
+    // at module level, before its function, which declares it global when
+    // it changes it. Only a constant initializer has the same effect there.
+    bool IsStaticLocal = Var->isStaticLocal();
+    if (IsStaticLocal && Var->getInit() &&
+        !Var->getInit()->isConstantInitializer(Context, /*ForRef=*/false)) {
+      unsupported(Var->getSourceRange(), Out);
+      return;
+    }
+    const PyExpr *Value;
+    Expr::EvalResult Constant;
+    // const int ledPin = 13; at file scope
+    if (Var->getType().isConstQualified() && Var->isFileVarDecl() &&
+        isConstantType(Var->getType()) && Var->getInit() &&
+        Var->getInit()->EvaluateAsInt(Constant, Context))
+      Value = constant(Constant.Val.getInt());
+    else if (!Var->hasInit())
+      Value = getDefaultValue(Var->getType());
+    else if (const auto *Init = dyn_cast<InitListExpr>(Var->getInit()))
+      Value = lowerInitList(Init);
+    else
+      Value = lowerExpr(Var->getInit());
+    if (IsStaticLocal) {
+      StaticLocals.push_back(withNote(M.assign(M.atom(getName(Var)), Value)));
+      return;
+    }
+    noteAssigned(Var);
+    Out.push_back(withNote(M.assign(M.atom(getName(Var)), Value)));
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Lowers S and appends the statements to Out. Compound statements are
+  // flattened, Python blocks are made by the indentation.
+  void lowerStmt(const Stmt *S, StmtList &Out) {
+    if (!S || isa<NullStmt>(S))
+      return;
+    if (const auto *Compound = dyn_cast<CompoundStmt>(S)) {
+      lowerCompound(Compound, Out);
+    } else if (const auto *DS = dyn_cast<DeclStmt>(S)) {
+      for (const Decl *D : DS->decls())
+        if (const auto *Var = dyn_cast<VarDecl>(D))
+          lowerVar(Var, Out);
+    } else if (const auto *If = dyn_cast<IfStmt>(S)) {
+      count("If", [&] { lowerIf(If, Out); });
+    } else if (const auto *While = dyn_cast<WhileStmt>(S)) {
+      count("While", [&] { lowerWhile(While, Out); });
+    } else if (const auto *Do = dyn_cast<DoStmt>(S)) {
+      count("While", [&] { lowerDo(Do, Out); });
+    } else if (const auto *For = dyn_cast<ForStmt>(S)) {
+      count("For", [&] { lowerFor(For, Out); });
+    } else if (const auto *Switch = dyn_cast<SwitchStmt>(S)) {
+      count("Switch", [&] { lowerSwitch(Switch, Out); });
+    } else if (const auto *Return = dyn_cast<ReturnStmt>(S)) {
+      lowerReturn(Return, Out);
+    } else if (isa<BreakStmt>(S)) {
+      Out.push_back(M.stmt(PyStmtKind::Break));
+    } else if (isa<ContinueStmt>(S)) {
+      if (LoopIncrement)
+        Out.append(LoopIncrement->begin(), LoopIncrement->end());
+      Out.push_back(M.stmt(PyStmtKind::Continue));
+    } else if (const auto *E = dyn_cast<Expr>(S)) {
+      lowerExprStmt(E, Out);
+    } else {
+      unsupported(S->getSourceRange(), Out);
+    }
+  }
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+  ArrayRef<const PyStmt *> lowerBlock(const Stmt *S) {
+    SmallVector<const PyStmt *, 16> Body;
+    lowerStmt(S, Body);
+    return M.copy<const PyStmt *>(Body);
+  }
 
-class microsHandler : public MatchFinder::MatchCallback {
-public:
-   microsHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Lowers the body of a loop, Increment is run again before every continue.
+  ArrayRef<const PyStmt *> lowerLoopBody(const Stmt *S,
+                                         const StmtList *Increment) {
+    const StmtList *SavedIncrement = LoopIncrement;
+    LoopIncrement = Increment;
+    ++LoopDepth;
+    SmallVector<const PyStmt *, 16> Body;
+    lowerStmt(S, Body);
+    if (Increment)
+      Body.append(Increment->begin(), Increment->end());
+    --LoopDepth;
+    LoopIncrement = SavedIncrement;
+    return M.copy<const PyStmt *>(Body);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* microsfinder = Results.Nodes.getNodeAs<clang::CallExpr>("micros");
-    Rewrite.ReplaceText(microsfinder->getBeginLoc(), "utime.ticks_us");
+  void lowerIf(const IfStmt *If, StmtList &Out) {
+    if (If->getInit())
+      lowerStmt(If->getInit(), Out);
+    // if (DEBUG) with DEBUG 0: only the branch that runs is kept, if any.
+    bool Taken;
+    if (!If->getConditionVariableDeclStmt() &&
+        If->getCond()->EvaluateAsBooleanCondition(Taken, Context) &&
+        !containsJumpTarget(Taken ? If->getElse() : If->getThen())) {
+      count("DeadBranch",
+            [&] { lowerStmt(Taken ? If->getThen() : If->getElse(), Out); });
+      return;
+    }
+    if (const DeclStmt *CondVar = If->getConditionVariableDeclStmt())
+      lowerStmt(CondVar, Out);
+    const PyExpr *Cond = lowerExpr(If->getCond());
+    StringRef Note = takeNote();
+    ArrayRef<const PyStmt *> Then = lowerBlock(If->getThen());
+    ArrayRef<const PyStmt *> Else = lowerBlock(If->getElse());
+    PyStmt *S = M.stmt(PyStmtKind::If, {Cond}, Then, Else);
+    S->Note = Note;
+    Out.push_back(S);
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  void lowerWhile(const WhileStmt *While, StmtList &Out) {
+    if (While->getConditionVariableDeclStmt()) {
+      unsupported(While->getSourceRange(), Out);
+      return;
+    }
+    bool Runs;
+    if (While->getCond()->EvaluateAsBooleanCondition(Runs, Context) && !Runs &&
+        !containsJumpTarget(While->getBody())) {
+      count("DeadBranch", [] {});
+      return;
+    }
+    const PyExpr *Cond = lowerCondition(While->getCond());
+    StringRef Note = takeNote();
+    PyStmt *S = M.stmt(PyStmtKind::While, {Cond},
+                       lowerLoopBody(While->getBody(), nullptr));
+    S->Note = Note;
+    Out.push_back(S);
+  }
 
-//Handler for delay() function: delay() is rewritten as time.sleep_ms
+  // do { Body } while (Cond) becomes while True: with a break at the end,
+  // the test is also run before every continue.
+  void lowerDo(const DoStmt *Do, StmtList &Out) {
+    // do { ... } while (0) of the macros runs its body once.
+    bool Again;
+    bool IsConstant = Do->getCond()->EvaluateAsBooleanCondition(Again, Context);
+    if (IsConstant && !Again && !containsJumpTarget(Do->getBody())) {
+      count("DeadBranch", [&] { lowerStmt(Do->getBody(), Out); });
+      return;
+    }
+    if (IsConstant && Again) {
+      Out.push_back(M.stmt(PyStmtKind::While, {M.atom("True")},
+                           lowerLoopBody(Do->getBody(), nullptr)));
+      return;
+    }
+    const PyExpr *Cond = lowerExpr(Do->getCond());
+    PyStmt *Exit = M.stmt(PyStmtKind::If, {M.unary("not", Cond)},
+                          {M.stmt(PyStmtKind::Break)});
+    Exit->Note = takeNote();
+    SmallVector<const PyStmt *, 1> Test{Exit};
+    Out.push_back(M.stmt(PyStmtKind::While, {M.atom("True")},
+                         lowerLoopBody(Do->getBody(), &Test)));
+  }
 
-class pulseInHandler : public MatchFinder::MatchCallback {
-public:
-   pulseInHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  void lowerFor(const ForStmt *For, StmtList &Out) {
+    // for (int i = 0; i < N; ++i) becomes for i in range(N): while neither
+    // the counter nor the bound change in the body. The range iterator
+    // counts without running any bytecode.
+    CountedLoop Loop;
+    if (matchCountedLoop(For, Context, Loop) &&
+        !isModifiedIn(Loop.Counter, For->getBody()) &&
+        isLoopInvariant(Loop.Bound, For->getBody())) {
+      const PyExpr *Sequence;
+      StringRef Target;
+      // The loops that only read a[i] iterate a directly.
+      if (const VarDecl *Array = getIteratedArray(Loop, For->getBody())) {
+        Sequence = M.atom(getName(Array));
+        Target = M.save(getName(Array) + "_" + getName(Loop.Counter));
+        IteratedArrays[Loop.Counter] = Target;
+      } else {
+        Sequence = lowerRange(Loop);
+        Target = getName(Loop.Counter);
+      }
+      StringRef Note = takeNote();
+      PyStmt *S = M.stmt(PyStmtKind::For, {Sequence},
+                         lowerLoopBody(For->getBody(), nullptr));
+      IteratedArrays.erase(Loop.Counter);
+      S->Text = Target;
+      S->Note = Note;
+      Out.push_back(S);
+      return;
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* pulseInfinder = Results.Nodes.getNodeAs<clang::CallExpr>("pulseIn");
-    Rewrite.ReplaceText(pulseInfinder->getBeginLoc(), "machine.time_pulse_us");
+    // Any other loop becomes a while loop, with the increment at the end of
+    // the body and before every continue.
+    lowerStmt(For->getInit(), Out);
+    if (For->getConditionVariableDeclStmt()) {
+      unsupported(For->getSourceRange(), Out);
+      return;
+    }
+    const PyExpr *Cond =
+        For->getCond() ? lowerCondition(For->getCond()) : M.atom("True");
+    StringRef Note = takeNote();
+    SmallVector<const PyStmt *, 2> Increment;
+    if (For->getInc())
+      lowerExprStmt(For->getInc(), Increment);
+    PyStmt *S = M.stmt(PyStmtKind::While, {Cond},
+                       lowerLoopBody(For->getBody(), &Increment));
+    S->Note = Note;
+    Out.push_back(S);
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // range(Start, Stop, Step), without the default arguments.
+  const PyExpr *lowerRange(const CountedLoop &Loop) {
+    const PyExpr *Stop = lowerExpr(Loop.Bound);
+    if (Loop.Inclusive) {
+      int64_t Next = Loop.Step > 0 ? 1 : -1;
+      const auto *Literal =
+          dyn_cast<IntegerLiteral>(Loop.Bound->IgnoreParenImpCasts());
+      if (Literal && Literal->getValue().getActiveBits() < 63)
+        Stop = M.atom(M.save(
+            llvm::itostr(Literal->getValue().getZExtValue() + Next)));
+      else
+        Stop = M.binary(Next > 0 ? "+" : "-", Stop, M.atom("1"));
+    }
+    Expr::EvalResult Start;
+    bool FromZero = Loop.Start->EvaluateAsInt(Start, Context) &&
+                    Start.Val.getInt() == 0;
+    if (Loop.Step == 1 && FromZero)
+      return M.call("range", {Stop});
+    SmallVector<const PyExpr *, 3> Args{lowerExpr(Loop.Start), Stop};
+    if (Loop.Step != 1)
+      Args.push_back(M.atom(M.save(llvm::itostr(Loop.Step))));
+    return M.call("range", Args);
+  }
 
-//Handler for PinMode Pin. converts pin number  to p<pinNumber>
+  // Returns the array to iterate instead of counting: the loop goes over all
+  // its elements, for (int i = 0; i < 8; ++i) over int a[8], and the body only
+  // uses the counter to read a[i].
+  const VarDecl *getIteratedArray(const CountedLoop &Loop, const Stmt *Body) {
+    Expr::EvalResult Start, Bound;
+    if (Loop.Step != 1 || Loop.Inclusive ||
+        !Loop.Start->EvaluateAsInt(Start, Context) ||
+        Start.Val.getInt() != 0 ||
+        !Loop.Bound->EvaluateAsInt(Bound, Context) ||
+        !countReferences(Loop.Counter, Body))
+      return nullptr;
+    const VarDecl *Array = getIndexedArray(Loop.Counter, Body);
+    const ConstantArrayType *Type =
+        Array ? Context.getAsConstantArrayType(Array->getType()) : nullptr;
+    if (!Type || llvm::APSInt::compareValues(
+                     llvm::APSInt(Type->getSize(), /*isUnsigned=*/true),
+                     Bound.Val.getInt()) != 0)
+      return nullptr;
+    return Array;
+  }
 
-class pinModePinHandler : public MatchFinder::MatchCallback {
-public:
-   pinModePinHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // The condition of a loop, while (1) becomes while True:.
+  const PyExpr *lowerCondition(const Expr *Cond) {
+    bool Value;
+    if (Cond->EvaluateAsBooleanCondition(Value, Context))
+      return M.atom(Value ? "True" : "False");
+    return lowerExpr(Cond);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* pinModePinfinder = Results.Nodes.getNodeAs<clang::Stmt>("pinModePin");
-    Rewrite.InsertText(pinModePinfinder->getBeginLoc(), "p", true, true);
+  // Returns true if E only reads constants and variables that Body does not
+  // change.
+  bool isLoopInvariant(const Expr *E, const Stmt *Body) {
+    E = E->IgnoreParenImpCasts();
+    if (E->isEvaluatable(Context))
+      return true;
+    const auto *Ref = dyn_cast<DeclRefExpr>(E);
+    const auto *Var = Ref ? dyn_cast<VarDecl>(Ref->getDecl()) : nullptr;
+    // Globals can be changed by the functions called from the body.
+    return Var && Var->hasLocalStorage() && !isModifiedIn(Var, Body);
   }
 
-private:
-  Rewriter &Rewrite;
-};
-//Handler for INPUT keyword converts to IN
+  // A switch becomes an if/elif chain when every case ends with a break, a
+  // return or a continue, any fall through is kept as C++.
+  void lowerSwitch(const SwitchStmt *Switch, StmtList &Out) {
+    struct Case {
+      SmallVector<const Expr *, 2> Labels;
+      bool IsDefault = false;
+      SmallVector<const Stmt *, 4> Body;
+    };
+    SmallVector<Case, 8> Cases;
+    const auto *Body = dyn_cast_or_null<CompoundStmt>(Switch->getBody());
+    if (!Body || Switch->getInit() || Switch->getConditionVariableDeclStmt()) {
+      unsupported(Switch->getSourceRange(), Out);
+      return;
+    }
+    for (const Stmt *S : Body->body()) {
+      if (isa<SwitchCase>(S) && (Cases.empty() || !Cases.back().Body.empty()))
+        Cases.emplace_back();
+      while (const auto *Label = dyn_cast<SwitchCase>(S)) {
+        if (const auto *CS = dyn_cast<CaseStmt>(Label)) {
+          if (CS->getRHS()) {
+            unsupported(Switch->getSourceRange(), Out);
+            return;
+          }
+          Cases.back().Labels.push_back(CS->getLHS());
+        } else {
+          Cases.back().IsDefault = true;
+        }
+        S = Label->getSubStmt();
+      }
+      // Statements before the first label are never run.
+      if (!Cases.empty())
+        Cases.back().Body.push_back(S);
+    }
 
-class inputHandler : public MatchFinder::MatchCallback {
-public:
-   inputHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+    for (size_t I = 0; I < Cases.size(); ++I) {
+      SmallVectorImpl<const Stmt *> &Stmts = Cases[I].Body;
+      bool EndsWithBreak = !Stmts.empty() && isa<BreakStmt>(Stmts.back());
+      if (EndsWithBreak)
+        Stmts.pop_back();
+      bool Exits = EndsWithBreak || (!Stmts.empty() &&
+                                     (isa<ReturnStmt>(Stmts.back()) ||
+                                      isa<ContinueStmt>(Stmts.back())));
+      bool FallsThrough = !Exits && I + 1 < Cases.size();
+      if (FallsThrough || llvm::any_of(Stmts, containsSwitchBreak)) {
+        unsupported(Switch->getSourceRange(), Out);
+        return;
+      }
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* inputfinder = Results.Nodes.getNodeAs<clang::Stmt>("INPUT");
-        Rewrite.ReplaceText(inputfinder->getBeginLoc(), "IN");
+    // The subject is evaluated once, as in C.
+    const Expr *Cond = Switch->getCond()->IgnoreParenImpCasts();
+    const PyExpr *Subject = lowerExpr(Cond);
+    if (Cond->HasSideEffects(Context)) {
+      const PyExpr *Temp =
+          M.atom(M.save("_switch" + llvm::utostr(SwitchTemps++)));
+      Out.push_back(withNote(M.assign(Temp, Subject)));
+      Subject = Temp;
+    }
+
+    // The default case is the else branch, whatever its place in C.
+    ArrayRef<const PyStmt *> Chain;
+    for (const Case &C : Cases)
+      if (C.IsDefault)
+        Chain = lowerCase(C.Body);
+    for (auto It = Cases.rbegin(), End = Cases.rend(); It != End; ++It) {
+      if (It->IsDefault)
+        continue;
+      const PyExpr *Test = nullptr;
+      for (const Expr *Label : It->Labels) {
+        const PyExpr *Equal = M.binary("==", Subject, lowerExpr(Label));
+        Test = Test ? M.binary("or", Test, Equal) : Equal;
+      }
+      StringRef Note = takeNote();
+      PyStmt *If = M.stmt(PyStmtKind::If, {Test}, lowerCase(It->Body), Chain);
+      If->Note = Note;
+      Chain = M.copy<const PyStmt *>({If});
+    }
+    Out.append(Chain.begin(), Chain.end());
   }
 
-private:
-  Rewriter &Rewrite;
-};
- //Handler for OUTPUT keyword converts to OUT
+  ArrayRef<const PyStmt *> lowerCase(ArrayRef<const Stmt *> Stmts) {
+    SmallVector<const PyStmt *, 8> Body;
+    for (const Stmt *S : Stmts)
+      lowerStmt(S, Body);
+    return M.copy<const PyStmt *>(Body);
+  }
 
-class outputHandler : public MatchFinder::MatchCallback {
-public:
-   outputHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  void lowerReturn(const ReturnStmt *Return, StmtList &Out) {
+    // The bodies of setup() and loop() are inlined in main(), returning from
+    // loop() starts the next iteration.
+    if (Scope == FunctionScope::Loop && LoopDepth == 0 &&
+        !Return->getRetValue()) {
+      Out.push_back(M.stmt(PyStmtKind::Continue));
+      return;
+    }
+    if (Scope != FunctionScope::Other) {
+      unsupported(Return->getSourceRange(), Out);
+      return;
+    }
+    PyStmt *S = M.stmt(PyStmtKind::Return);
+    if (const Expr *Value = Return->getRetValue())
+      S->Operands = M.copy<const PyExpr *>({lowerExpr(Value)});
+    Out.push_back(withNote(S));
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* outputfinder = Results.Nodes.getNodeAs<clang::Stmt>("OUTPUT");
-    Rewrite.ReplaceText(outputfinder->getBeginLoc(), "OUT");
+  // Assignments and increments are statements in Python, they are lowered
+  // here when their value is not used.
+  void lowerExprStmt(const Expr *E, StmtList &Out) {
+    if (lowerBitMacroStmt(E, Out))
+      return;
+    E = E->IgnoreImplicit()->IgnoreParens();
+    if (const auto *Cast = dyn_cast<CStyleCastExpr>(E))
+      if (Cast->getCastKind() == CK_ToVoid)
+        E = Cast->getSubExpr()->IgnoreImplicit()->IgnoreParens();
+
+    if (const auto *BO = dyn_cast<BinaryOperator>(E)) {
+      if (BO->getOpcode() == BO_Comma) {
+        lowerExprStmt(BO->getLHS(), Out);
+        lowerExprStmt(BO->getRHS(), Out);
+        return;
+      }
+      if (BO->getOpcode() == BO_Assign) {
+        // a = b = 0 is a chained assignment in Python too.
+        SmallVector<const PyExpr *, 2> Operands;
+        const Expr *Value = E;
+        while (const auto *Assign = dyn_cast<BinaryOperator>(
+                   Value->IgnoreParenImpCasts())) {
+          if (Assign->getOpcode() != BO_Assign)
+            break;
+          noteAssigned(Assign->getLHS());
+          Operands.push_back(lowerExpr(Assign->getLHS()));
+          Value = Assign->getRHS();
+        }
+        Operands.push_back(lowerExpr(Value));
+        PyStmt *S = M.stmt(PyStmtKind::Assign, Operands);
+        S->Text = "=";
+        Out.push_back(withNote(S));
+        return;
+      }
+      if (BO->isCompoundAssignmentOp()) {
+        std::string Op = BinaryOperator::getOpcodeStr(
+                             BinaryOperator::getOpForCompoundAssignment(
+                                 BO->getOpcode()))
+                             .str();
+        if ((Op == "/" || Op == "%") && BO->getType()->isIntegerType()) {
+          if (!isFloorDivisionExact(BO)) {
+            // a = _cdiv(a, b) evaluates the target twice.
+            if (BO->getLHS()->HasSideEffects(Context)) {
+              Out.push_back(
+                  withNote(M.stmt(PyStmtKind::Expr, {unsupported(BO)})));
+              return;
+            }
+            noteAssigned(BO->getLHS());
+            Out.push_back(withNote(M.assign(lowerExpr(BO->getLHS()),
+                                            lowerTruncatingDivision(BO))));
+            return;
+          }
+          if (Op == "/")
+            Op = "//";
+        }
+        noteAssigned(BO->getLHS());
+        Out.push_back(withNote(M.assign(lowerExpr(BO->getLHS()),
+                                        lowerExpr(BO->getRHS()),
+                                        M.save(Op + "="))));
+        return;
+      }
+    }
+    if (const auto *UO = dyn_cast<UnaryOperator>(E)) {
+      if (UO->isIncrementDecrementOp()) {
+        noteAssigned(UO->getSubExpr());
+        Out.push_back(withNote(M.assign(lowerExpr(UO->getSubExpr()),
+                                        M.atom("1"),
+                                        UO->isIncrementOp() ? "+=" : "-=")));
+        return;
+      }
+    }
+    if (const auto *Op = dyn_cast<CXXOperatorCallExpr>(E)) {
+      OverloadedOperatorKind Kind = Op->getOperator();
+      if (Kind == OO_Equal || Kind == OO_PlusEqual || Kind == OO_MinusEqual) {
+        noteAssigned(Op->getArg(0));
+        Out.push_back(withNote(M.assign(
+            lowerExpr(Op->getArg(0)), lowerExpr(Op->getArg(1)),
+            Kind == OO_Equal ? "=" : Kind == OO_PlusEqual ? "+=" : "-=")));
+        return;
+      }
+      if (Kind == OO_PlusPlus || Kind == OO_MinusMinus) {
+        noteAssigned(Op->getArg(0));
+        Out.push_back(withNote(M.assign(lowerExpr(Op->getArg(0)), M.atom("1"),
+                                        Kind == OO_PlusPlus ? "+=" : "-=")));
+        return;
+      }
+    }
+    Out.push_back(withNote(M.stmt(PyStmtKind::Expr, {lowerExpr(E)})));
+  }
 
+  // The text a Serial print chain or a String concatenation is made of.
+  struct OutputPiece {
+    enum PieceKind {
+      // Text, known when converting.
+      Bytes,
+      // The character E.
+      Char,
+      // E in base Format.
+      Integer,
+      // E with Format decimals.
+      Float,
+      // The String variable Var, formatted in its own buffer.
+      Buffer,
+      // E, a string of unknown length written as is.
+      Value
+    };
+    PieceKind Kind;
+    const Expr *E;
+    std::string Text;
+    unsigned Format;
+    const VarDecl *Var;
+  };
+  using PieceList = SmallVectorImpl<OutputPiece>;
+
+  // The preallocated buffer of a String variable, its memoryview and the
+  // longest text it can hold.
+  struct StringBuffer {
+    StringRef Name;
+    StringRef View;
+    unsigned Size;
+  };
+
+  // Lowers the statements of a block. A run of prints to the same Serial port
+  // becomes a single write, and the String variables that are only built to
+  // be printed are formatted in place.
+  void lowerCompound(const CompoundStmt *Compound, StmtList &Out) {
+    findStringBuffers(Compound);
+    ArrayRef<Stmt *> Body(Compound->body_begin(), Compound->body_end());
+    for (size_t I = 0; I < Body.size();) {
+      const VarDecl *Var;
+      const Expr *Value;
+      bool Append;
+      if (matchStringBuild(Body[I], Var, Value, Append) &&
+          StringBuffers.count(Var)) {
+        count("StringBuffer", [&] {
+          lowerStringBuild(Var, Value, Append, Out);
+        });
+        ++I;
+        continue;
+      }
+      uint32_t Set = 0, Clear = 0;
+      size_t End = I;
+      while (PortWrites != GpioTarget::None && End < Body.size() &&
+             collectPortWrite(Body[End], Set, Clear))
+        ++End;
+      if (End - I >= 2) {
+        count("PortWrite", [&] { lowerPortWrite(Set, Clear, Out); });
+        I = End;
+        continue;
+      }
+      SmallVector<OutputPiece, 8> Pieces;
+      StringRef Port;
+      End = I;
+      while (End < Body.size() && collectSerialOutput(Body[End], Port, Pieces))
+        ++End;
+      if (End == I) {
+        lowerStmt(Body[I++], Out);
+        continue;
+      }
+      count("SerialOutput", [&] { lowerSerialOutput(Port, Pieces, Out); });
+      I = End;
+    }
   }
 
-private:
-  Rewriter &Rewrite;
-};
-//Handler for INPUT_PULLUP keyword converts to PULL_UP
+  // Matches digitalWrite(pin, value) of a constant pin and value, sets the bit
+  // of the pin in Set or Clear. A pin written twice ends the run.
+  bool collectPortWrite(const Stmt *S, uint32_t &Set, uint32_t &Clear) {
+    const auto *Call = dyn_cast<CallExpr>(S);
+    if (!Call || !isCoreCall(Call, "digitalWrite") || Call->getNumArgs() != 2)
+      return false;
+    Expr::EvalResult Pin, Value;
+    if (!Call->getArg(0)->EvaluateAsInt(Pin, Context) ||
+        !Call->getArg(1)->EvaluateAsInt(Value, Context))
+      return false;
+    const llvm::APSInt &Number = Pin.Val.getInt();
+    unsigned Pins = PortWrites == GpioTarget::RP2 ? 30 : 32;
+    if (Number.isNegative() || Number.getZExtValue() >= Pins)
+      return false;
+    uint32_t Bit = 1u << Number.getZExtValue();
+    if ((Set | Clear) & Bit)
+      return false;
+    (Value.Val.getInt().getBoolValue() ? Set : Clear) |= Bit;
+    return true;
+  }
 
-class inputpullupHandler : public MatchFinder::MatchCallback {
-public:
-   inputpullupHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // machine.mem32[GPIO_OUT_CLR] = 0x8
+  // machine.mem32[GPIO_OUT_SET] = 0x2004
+  // The two stores can't change the pins at once. The pins cleared go low
+  // first, break before make: a pin handing a signal over to another is
+  // never high at the same time as it.
+  void lowerPortWrite(uint32_t Set, uint32_t Clear, StmtList &Out) {
+    uint64_t SetRegister = 0xd0000014, ClearRegister = 0xd0000018;
+    if (PortWrites == GpioTarget::ESP32) {
+      SetRegister = 0x3ff44008;
+      ClearRegister = 0x3ff4400c;
+    }
+    M.Imports.insert("import machine");
+    const PyExpr *Memory = M.atom(Scope == FunctionScope::Loop
+                                      ? getLoopAlias("machine.mem32")
+                                      : "machine.mem32");
+    auto write = [&](uint64_t Register, uint32_t Mask) {
+      if (!Mask)
+        return;
+      const PyExpr *Address = M.atom(M.save("0x" + llvm::utohexstr(Register)));
+      Out.push_back(M.assign(M.subscript(Memory, Address),
+                             M.atom(M.save("0x" + llvm::utohexstr(Mask)))));
+    };
+    write(ClearRegister, Clear);
+    write(SetRegister, Set);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::Stmt* inputpullupfinder = Results.Nodes.getNodeAs<clang::Stmt>("INPUT_PULLUP");
-    Rewrite.ReplaceText(inputpullupfinder->getBeginLoc(), "PULL_UP");
+  // Matches the statements that build a String variable: its declaration, an
+  // assignment, += and concat(). Value is null for String s;.
+  static bool matchStringBuild(const Stmt *S, const VarDecl *&Var,
+                               const Expr *&Value, bool &Append) {
+    Append = false;
+    if (const auto *DS = dyn_cast<DeclStmt>(S)) {
+      Var = DS->isSingleDecl() ? dyn_cast<VarDecl>(DS->getSingleDecl())
+                               : nullptr;
+      if (!Var || !Var->isLocalVarDecl() || Var->isStaticLocal() ||
+          !isArduinoString(Var->getType()))
+        return false;
+      Value = Var->getInit();
+      return true;
+    }
+    const auto *E = dyn_cast<Expr>(S);
+    if (!E)
+      return false;
+    E = E->IgnoreImplicit();
+    const Expr *Target;
+    if (const auto *Op = dyn_cast<CXXOperatorCallExpr>(E)) {
+      if (Op->getOperator() != OO_Equal && Op->getOperator() != OO_PlusEqual)
+        return false;
+      Target = Op->getArg(0);
+      Value = Op->getArg(1);
+      Append = Op->getOperator() == OO_PlusEqual;
+    } else if (const auto *Call = dyn_cast<CXXMemberCallExpr>(E)) {
+      const CXXMethodDecl *Method = Call->getMethodDecl();
+      if (!Method || !Method->getIdentifier() ||
+          Method->getName() != "concat" || Call->getNumArgs() != 1)
+        return false;
+      Target = Call->getImplicitObjectArgument();
+      Value = Call->getArg(0);
+      Append = true;
+    } else {
+      return false;
+    }
+    const auto *Ref = dyn_cast<DeclRefExpr>(Target->IgnoreParenImpCasts());
+    Var = Ref ? dyn_cast<VarDecl>(Ref->getDecl()) : nullptr;
+    return Var && isArduinoString(Var->getType());
   }
 
-private:
-  Rewriter &Rewrite;
- 
-};
+  // Finds the String variables of Compound that are only built by its
+  // statements and printed to a Serial port by them, for example:
+  //
+  //   String line = "t=" + String(t);
+  //   line += " ms";
+  //   Serial.println(line);
+  //
+  // Each one gets a buffer at module level, sized for the longest text it can
+  // hold, and the Python variable holds the length of the text.
+  void findStringBuffers(const CompoundStmt *Compound) {
+    for (auto First = Compound->body_begin(), End = Compound->body_end();
+         First != End; ++First) {
+      const VarDecl *Var;
+      const Expr *Value;
+      bool Append;
+      if (!isa<DeclStmt>(*First) ||
+          !matchStringBuild(*First, Var, Value, Append))
+        continue;
+      // Provisionally, so that the prints below see Var as a buffer.
+      StringBuffers[Var] = {"", "", 0};
+      unsigned Size = 0, MaxSize = 0, Uses = 0;
+      bool Valid = true;
+      for (auto S = First; S != End && Valid; ++S) {
+        const VarDecl *Built;
+        SmallVector<OutputPiece, 8> Pieces;
+        StringRef Port;
+        if (matchStringBuild(*S, Built, Value, Append) && Built == Var) {
+          Valid = !Value || collectPieces(Value, nullptr, Pieces);
+          Uses += !isa<DeclStmt>(*S);
+          Size = Append ? Size : 0;
+          for (const OutputPiece &Piece : Pieces) {
+            Valid = Valid && Piece.Kind != OutputPiece::Value;
+            Size += Valid ? getMaxSize(Piece) : 0;
+          }
+          MaxSize = std::max(MaxSize, Size);
+        } else if (collectSerialOutput(*S, Port, Pieces)) {
+          for (const OutputPiece &Piece : Pieces)
+            Uses += Piece.Kind == OutputPiece::Buffer && Piece.Var == Var;
+        }
+      }
+      if (!Valid || Uses != countReferences(Var, Compound)) {
+        StringBuffers.erase(Var);
+        continue;
+      }
+      std::string Name = ("_" + getName(Var)).str();
+      for (unsigned N = 2; !BufferNames.insert(Name).second; ++N)
+        Name = ("_" + getName(Var) + llvm::utostr(N)).str();
+      StringBuffers[Var] = {M.save(Name + "_buf"), M.save(Name + "_mv"),
+                            std::max(MaxSize, 1u)};
+    }
+  }
 
-//Handler for isAlpha function: rewritten as ure.match()
+  // line = "t=" + String(t) becomes:
+  //
+  //   line = _put_bytes(_line_buf, 0, b"t=")
+  //   line = _put_int(_line_buf, line, t, 10)
+  void lowerStringBuild(const VarDecl *Var, const Expr *Value, bool Append,
+                        StmtList &Out) {
+    SmallVector<OutputPiece, 8> Pieces;
+    if (Value)
+      collectPieces(Value, nullptr, Pieces);
+    StringRef Name = getName(Var);
+    formatPieces(StringBuffers[Var].Name, Name,
+                 M.atom(Append ? Name : StringRef("0")), Pieces, Out);
+  }
 
-class isAlphaHandler : public MatchFinder::MatchCallback {
-public:
-   isAlphaHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Returns the name of the machine.UART that stands for E if E is one of the
+  // Serial ports of the Arduino core, or an empty string.
+  StringRef getSerialPort(const Expr *E) {
+    const auto *Ref = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts());
+    const auto *Var = Ref ? dyn_cast<VarDecl>(Ref->getDecl()) : nullptr;
+    if (!Var || !Var->getIdentifier() || isInMainFile(Var->getLocation()))
+      return "";
+    StringRef Number = Var->getName();
+    unsigned Id;
+    if (!Number.consume_front("Serial") ||
+        (!Number.empty() && Number.getAsInteger(10, Id)))
+      return "";
+    return M.save("uart" + Number);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isAlphafinder = Results.Nodes.getNodeAs<clang::CallExpr>("isAlpha");
-    Rewrite.ReplaceText(isAlphafinder->getBeginLoc(), "ure.match");
+  // Appends the pieces printed by S to Pieces if S is a print(), println() or
+  // write() of Port, or of any Serial port if Port is empty.
+  bool collectSerialOutput(const Stmt *S, StringRef &Port, PieceList &Pieces) {
+    const auto *E = dyn_cast<Expr>(S);
+    const auto *Call =
+        E ? dyn_cast<CXXMemberCallExpr>(E->IgnoreImplicit()) : nullptr;
+    const CXXMethodDecl *Method = Call ? Call->getMethodDecl() : nullptr;
+    if (!Method || !Method->getIdentifier())
+      return false;
+    StringRef CallPort = getSerialPort(Call->getImplicitObjectArgument());
+    if (CallPort.empty() || (!Port.empty() && CallPort != Port))
+      return false;
+    SmallVector<const Expr *, 2> Args;
+    for (const Expr *Arg : Call->arguments()) {
+      if (isa<CXXDefaultArgExpr>(Arg))
+        break;
+      Args.push_back(Arg);
+    }
+
+    SmallVector<OutputPiece, 4> CallPieces;
+    StringRef Name = Method->getName();
+    if (Name == "print" || Name == "println") {
+      if (Args.size() > 2 || (Name == "print" && Args.empty()))
+        return false;
+      if (!Args.empty() &&
+          !collectPieces(Args[0], Args.size() == 2 ? Args[1] : nullptr,
+                         CallPieces))
+        return false;
+      if (Name == "println")
+        appendPiece(CallPieces, {OutputPiece::Bytes, nullptr, "\r\n", 0,
+                                 nullptr});
+    } else if (Name == "write" && Args.size() == 1) {
+      // write(uint8_t) sends a byte, write(const char *) a string.
+      if (Args[0]->getType()->isIntegerType())
+        collectCharacter(Args[0], CallPieces);
+      else if (!collectPieces(Args[0], nullptr, CallPieces))
+        return false;
+    } else {
+      return false;
+    }
+    Port = CallPort;
+    for (OutputPiece &Piece : CallPieces)
+      appendPiece(Pieces, std::move(Piece));
+    return true;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Appends the pieces of the text Arduino prints for E to Pieces, Format is
+  // the second argument of print() or of the String constructor. Returns
+  // false if the text cannot be formatted by the converted code.
+  bool collectPieces(const Expr *E, const Expr *Format, PieceList &Pieces) {
+    // The temporaries and the conversions of a String concatenation.
+    while (true) {
+      E = E->IgnoreParens();
+      if (const auto *Full = dyn_cast<FullExpr>(E))
+        E = Full->getSubExpr();
+      else if (const auto *Temp = dyn_cast<MaterializeTemporaryExpr>(E))
+        E = Temp->getSubExpr();
+      else if (const auto *Bind = dyn_cast<CXXBindTemporaryExpr>(E))
+        E = Bind->getSubExpr();
+      else if (isa<CastExpr>(E) && isArduinoString(E->getType()))
+        E = cast<CastExpr>(E)->getSubExpr();
+      else
+        break;
+    }
 
-//Handler for variable in isAlpha function: regex is inserted
+    if (isArduinoString(E->getType())) {
+      // String(t), String(x, HEX) and the conversions to String.
+      if (const auto *Construct = dyn_cast<CXXConstructExpr>(E)) {
+        SmallVector<const Expr *, 2> Args;
+        for (const Expr *Arg : Construct->arguments()) {
+          if (isa<CXXDefaultArgExpr>(Arg))
+            break;
+          Args.push_back(Arg);
+        }
+        if (Args.empty())
+          return true;
+        return Args.size() <= 2 &&
+               collectPieces(Args[0], Args.size() == 2 ? Args[1] : nullptr,
+                             Pieces);
+      }
+      const auto *Op = dyn_cast<CXXOperatorCallExpr>(E);
+      if (Op && Op->getOperator() == OO_Plus && Op->getNumArgs() == 2)
+        return collectPieces(Op->getArg(0), nullptr, Pieces) &&
+               collectPieces(Op->getArg(1), nullptr, Pieces);
+      const auto *Ref = dyn_cast<DeclRefExpr>(E);
+      const auto *Var = Ref ? dyn_cast<VarDecl>(Ref->getDecl()) : nullptr;
+      if (Var && StringBuffers.count(Var))
+        appendPiece(Pieces, {OutputPiece::Buffer, E, "", 0, Var});
+      else
+        appendPiece(Pieces, {OutputPiece::Value, E, "", 0, nullptr});
+      return true;
+    }
 
-class isAlphaVarHandler : public MatchFinder::MatchCallback {
-public:
-   isAlphaVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+    QualType T = E->getType().getCanonicalType();
+    // Literals, and F("text") that keeps them in flash memory.
+    const auto *String = dyn_cast<StringLiteral>(E->IgnoreParenImpCasts());
+    const CXXRecordDecl *Pointee =
+        T->isPointerType() ? T->getPointeeType()->getAsCXXRecordDecl()
+                           : nullptr;
+    if (!String && Pointee && Pointee->getIdentifier() &&
+        Pointee->getName() == "__FlashStringHelper")
+      String = findStringLiteral(E);
+    if (String) {
+      if (String->getCharByteWidth() != 1)
+        return false;
+      appendPiece(Pieces, {OutputPiece::Bytes, nullptr,
+                           String->getString().str(), 0, nullptr});
+      return true;
+    }
+    if (T->isCharType()) {
+      collectCharacter(E, Pieces);
+      return true;
+    }
+
+    Expr::EvalResult Result;
+    if (T->isIntegerType() || T->isEnumeralType()) {
+      unsigned Base = 10;
+      if (Format) {
+        if (!Format->EvaluateAsInt(Result, Context))
+          return false;
+        Base = Result.Val.getInt().getZExtValue();
+        // print(x, 0) writes x as a byte.
+        if (Base == 0) {
+          collectCharacter(E, Pieces);
+          return true;
+        }
+        if (Base != 2 && Base != 8 && Base != 10 && Base != 16)
+          return false;
+      }
+      if (E->EvaluateAsInt(Result, Context)) {
+        llvm::APSInt Value = Result.Val.getInt();
+        SmallString<24> Text;
+        if (Base == 10) {
+          Value.toString(Text, 10);
+        } else {
+          llvm::APInt Unsigned = Value.extOrTrunc(getUnsignedLongWidth());
+          Unsigned.toString(Text, Base, /*Signed=*/false);
+        }
+        appendPiece(Pieces, {OutputPiece::Bytes, nullptr, Text.str().str(), 0,
+                             nullptr});
+        return true;
+      }
+      appendPiece(Pieces, {OutputPiece::Integer, E, "", Base, nullptr});
+      return true;
+    }
+    if (T->isRealFloatingType()) {
+      unsigned Decimals = 2;
+      if (Format) {
+        if (!Format->EvaluateAsInt(Result, Context))
+          return false;
+        Decimals = Result.Val.getInt().getZExtValue();
+      }
+      appendPiece(Pieces, {OutputPiece::Float, E, "", Decimals, nullptr});
+      return true;
+    }
+    // The C strings the sketch builds itself.
+    if ((T->isPointerType() || T->isArrayType()) &&
+        T->getPointeeOrArrayElementType()->isCharType()) {
+      appendPiece(Pieces, {OutputPiece::Value, E, "", 0, nullptr});
+      return true;
+    }
+    return false;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isAlphaVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isAlphaVar");
-    Rewrite.InsertText(isAlphaVarfinder->getBeginLoc(), "'[A-Za-z]', ");
+  void collectCharacter(const Expr *E, PieceList &Pieces) {
+    Expr::EvalResult Result;
+    if (E->EvaluateAsInt(Result, Context)) {
+      char Byte = Result.Val.getInt().getExtValue();
+      appendPiece(Pieces, {OutputPiece::Bytes, nullptr, std::string(1, Byte),
+                           0, nullptr});
+    } else {
+      appendPiece(Pieces, {OutputPiece::Char, E, "", 0, nullptr});
+    }
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Appends Piece, the consecutive texts known when converting are merged.
+  static void appendPiece(PieceList &Pieces, OutputPiece Piece) {
+    if (Piece.Kind == OutputPiece::Bytes && Piece.Text.empty())
+      return;
+    if (Piece.Kind == OutputPiece::Bytes && !Pieces.empty() &&
+        Pieces.back().Kind == OutputPiece::Bytes)
+      Pieces.back().Text += Piece.Text;
+    else
+      Pieces.push_back(std::move(Piece));
+  }
 
-//Handler for isAlphaNumeric function: rewritten as ure.match()
+  unsigned getUnsignedLongWidth() const {
+    return Context.getTypeSize(Context.UnsignedLongTy);
+  }
 
-class isAlphaNumericHandler : public MatchFinder::MatchCallback {
-public:
-   isAlphaNumericHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Returns the length of the longest text Piece can print, Piece is not a
+  // Value.
+  unsigned getMaxSize(const OutputPiece &Piece) {
+    switch (Piece.Kind) {
+    case OutputPiece::Bytes:
+      return Piece.Text.size();
+    case OutputPiece::Char:
+      return 1;
+    case OutputPiece::Integer: {
+      QualType T = Piece.E->getType();
+      unsigned Bits = Context.getTypeSize(T);
+      if (Piece.Format != 10 && T->isSignedIntegerOrEnumerationType())
+        Bits = getUnsignedLongWidth();
+      unsigned Digits = Piece.Format == 2    ? Bits
+                        : Piece.Format == 8  ? (Bits + 2) / 3
+                        : Piece.Format == 16 ? (Bits + 3) / 4
+                                             : Bits * 30103 / 100000 + 1;
+      return Digits + 1;
+    }
+    case OutputPiece::Float:
+      // -4294967040.00, larger values print ovf.
+      return 1 + 10 + 1 + Piece.Format;
+    case OutputPiece::Buffer:
+      return StringBuffers[Piece.Var].Size;
+    case OutputPiece::Value:
+      break;
+    }
+    llvm_unreachable("the length of a Value is not known");
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isAlphaNumericfinder = Results.Nodes.getNodeAs<clang::CallExpr>("isAlphaNumeric");
-    Rewrite.ReplaceText(isAlphaNumericfinder->getBeginLoc(), "ure.match");
+  // Serial.print("t="); Serial.println(t); becomes:
+  //
+  //   _n = _put_bytes(_serial_buf, 0, b"t=")
+  //   _n = _put_int(_serial_buf, _n, t, 10)
+  //   _n = _put_bytes(_serial_buf, _n, b"\r\n")
+  //   uart.write(_serial_mv[:_n])
+  //
+  // The texts known when converting are written as they are, and the strings
+  // of unknown length are written on their own.
+  void lowerSerialOutput(StringRef Port, ArrayRef<OutputPiece> Pieces,
+                         StmtList &Out) {
+    SerialPorts.insert(Port);
+    StringRef Write = M.save(Port + ".write");
+    while (!Pieces.empty()) {
+      ArrayRef<OutputPiece> Run = Pieces.take_until([](const OutputPiece &P) {
+        return P.Kind == OutputPiece::Value;
+      });
+      Pieces = Pieces.drop_front(Run.size());
+      const PyExpr *Text = nullptr;
+      if (Run.empty()) {
+        Text = lowerExpr(Pieces.front().E);
+        Pieces = Pieces.drop_front();
+      } else if (Run.size() == 1 && Run[0].Kind == OutputPiece::Bytes) {
+        Text = M.atom(M.save(quotePython(Run[0].Text, /*Bytes=*/true)));
+      } else if (Run.size() == 1 && Run[0].Kind == OutputPiece::Buffer) {
+        Text = getBufferText(Run[0].Var);
+      } else {
+        unsigned Size = 0;
+        for (const OutputPiece &Piece : Run)
+          Size += getMaxSize(Piece);
+        SerialBufferSize = std::max(SerialBufferSize, Size);
+        formatPieces("_serial_buf", "_n", M.atom("0"), Run, Out);
+        Text = M.subscript(M.atom("_serial_mv"),
+                           M.slice(nullptr, M.atom("_n")));
+      }
+      Out.push_back(
+          withNote(M.stmt(PyStmtKind::Expr, {M.call(Write, {Text})})));
+    }
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Returns the text of a String formatted in its buffer, through the
+  // memoryview so that it is not copied.
+  const PyExpr *getBufferText(const VarDecl *Var) {
+    return M.subscript(M.atom(StringBuffers[Var].View),
+                       M.slice(nullptr, M.atom(getName(Var))));
+  }
 
-//Handler for variable in isAlphaNumeric function: regex is inserted
+  // Appends the statements that format Pieces into Buffer from Start and
+  // leave the end of the text in Pos.
+  void formatPieces(StringRef Buffer, StringRef Pos, const PyExpr *Start,
+                    ArrayRef<OutputPiece> Pieces, StmtList &Out) {
+    const PyExpr *BufferRef = M.atom(Buffer);
+    const PyExpr *PosRef = M.atom(Pos);
+    const PyExpr *End = Start;
+    bool AtPos = Start->Kind == PyExprKind::Atom && Start->Text == Pos;
+    for (const OutputPiece &Piece : Pieces) {
+      const PyExpr *Value = nullptr;
+      switch (Piece.Kind) {
+      case OutputPiece::Bytes:
+        OutputHelpers.insert("_put_bytes");
+        Value = M.call(
+            "_put_bytes",
+            {BufferRef, End,
+             M.atom(M.save(quotePython(Piece.Text, /*Bytes=*/true)))});
+        break;
+      case OutputPiece::Char:
+        Out.push_back(withNote(
+            M.assign(M.subscript(BufferRef, End), lowerExpr(Piece.E))));
+        if (AtPos)
+          Out.push_back(M.assign(PosRef, M.atom("1"), "+="));
+        else
+          Value = M.binary("+", End, M.atom("1"));
+        break;
+      case OutputPiece::Integer: {
+        OutputHelpers.insert("_put_int");
+        const PyExpr *Number = lowerExpr(Piece.E);
+        // Arduino prints the other bases of the negative numbers as unsigned
+        // long.
+        if (Piece.Format != 10 &&
+            Piece.E->getType()->isSignedIntegerOrEnumerationType()) {
+          uint64_t Mask = ~0ULL >> (64 - getUnsignedLongWidth());
+          Number = M.binary("&", Number,
+                            M.atom(M.save("0x" + llvm::utohexstr(Mask))));
+        }
+        Value = M.call("_put_int",
+                       {BufferRef, End, Number,
+                        M.atom(M.save(llvm::utostr(Piece.Format)))});
+        break;
+      }
+      case OutputPiece::Float:
+        OutputHelpers.insert("_put_float");
+        Value = M.call("_put_float",
+                       {BufferRef, End, lowerExpr(Piece.E),
+                        M.atom(M.save(llvm::utostr(Piece.Format)))});
+        break;
+      case OutputPiece::Buffer:
+        OutputHelpers.insert("_put_bytes");
+        Value =
+            M.call("_put_bytes", {BufferRef, End, getBufferText(Piece.Var)});
+        break;
+      case OutputPiece::Value:
+        llvm_unreachable("the length of a Value is not known");
+      }
+      if (Value)
+        Out.push_back(withNote(M.assign(PosRef, Value)));
+      End = PosRef;
+      AtPos = true;
+    }
+    if (!AtPos)
+      Out.push_back(M.assign(PosRef, Start));
+  }
 
-class isAlphaNumericVarHandler : public MatchFinder::MatchCallback {
-public:
-   isAlphaNumericVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Defines the UARTs, the buffers and the formatting functions used by the
+  // Serial output.
+  void defineSerialOutput(StmtList &Out) {
+    for (StringRef Port : SerialPorts) {
+      unsigned Id = SerialUart;
+      if (Port != "uart")
+        Port.drop_front(4).getAsInteger(10, Id);
+      M.Imports.insert("import machine");
+      Out.push_back(M.assign(
+          M.atom(Port),
+          M.call("machine.UART", {M.atom(M.save(llvm::utostr(Id)))})));
+    }
+    auto defineBuffer = [&](StringRef Name, StringRef View, unsigned Size) {
+      Out.push_back(M.assign(
+          M.atom(Name),
+          M.call("bytearray", {M.atom(M.save(llvm::utostr(Size)))})));
+      Out.push_back(
+          M.assign(M.atom(View), M.call("memoryview", {M.atom(Name)})));
+    };
+    if (SerialBufferSize)
+      defineBuffer("_serial_buf", "_serial_mv", SerialBufferSize);
+    for (const auto &Buffer : StringBuffers)
+      defineBuffer(Buffer.second.Name, Buffer.second.View, Buffer.second.Size);
+
+    if (OutputHelpers.count("_put_float"))
+      OutputHelpers.insert("_put_int");
+    if (OutputHelpers.count("_put_float") || OutputHelpers.count("_put_int"))
+      OutputHelpers.insert("_put_bytes");
+    for (StringRef Helper : {"_put_bytes", "_put_int", "_put_float"})
+      if (OutputHelpers.count(Helper))
+        Out.push_back(defineOutputHelper(Helper));
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isAlphaNumericVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isAlphaNumericVar");
-    Rewrite.InsertText(isAlphaNumericVarfinder->getBeginLoc(), "'[A-Za-z0-9]', ");
+  // The formatting functions write into buf from pos and return the end of
+  // the text. They follow Print.cpp of the Arduino core.
+  const PyStmt *defineOutputHelper(StringRef Name) {
+    auto A = [&](StringRef Text) { return M.atom(Text); };
+    auto Assign = [&](StringRef Target, const PyExpr *Value,
+                      StringRef Op = "=") {
+      return M.assign(A(Target), Value, Op);
+    };
+    auto Return = [&](const PyExpr *Value) {
+      return M.stmt(PyStmtKind::Return, {Value});
+    };
+    // buf[pos] = 45 (-); pos += 1
+    auto PutMinus = [&](StringRef Value) -> ArrayRef<const PyStmt *> {
+      return M.copy<const PyStmt *>(
+          {M.assign(M.subscript(A("buf"), A("pos")), A("45")),
+           Assign("pos", A("1"), "+="), Assign(Value, M.unary("-", A(Value)))});
+    };
+
+    SmallVector<const PyExpr *, 4> Params;
+    SmallVector<const PyStmt *, 16> Body;
+    if (Name == "_put_bytes") {
+      // buf[pos:end] = data
+      Params = {A("buf"), A("pos"), A("data")};
+      Body = {Assign("end",
+                     M.binary("+", A("pos"), M.call("len", {A("data")}))),
+              M.assign(M.subscript(A("buf"), M.slice(A("pos"), A("end"))),
+                       A("data")),
+              Return(A("end"))};
+    } else if (Name == "_put_int") {
+      // The digits are counted first and written from the last one.
+      Params = {A("buf"), A("pos"), A("n"), A("base")};
+      Body = {
+          M.stmt(PyStmtKind::If, {M.binary("<", A("n"), A("0"))},
+                 PutMinus("n")),
+          Assign("end", M.binary("+", A("pos"), A("1"))),
+          Assign("m", M.binary("//", A("n"), A("base"))),
+          M.stmt(PyStmtKind::While, {A("m")},
+                 {Assign("m", A("base"), "//="), Assign("end", A("1"), "+=")}),
+          Assign("i", A("end")),
+          M.stmt(PyStmtKind::While, {M.binary(">", A("i"), A("pos"))},
+                 {Assign("i", A("1"), "-="),
+                  M.assign(M.subscript(A("buf"), A("i")),
+                           M.subscript(A("b\"0123456789ABCDEF\""),
+                                       M.binary("%", A("n"), A("base")))),
+                  Assign("n", A("base"), "//=")}),
+          Return(A("end"))};
+    } else {
+      Params = {A("buf"), A("pos"), A("x"), A("digits")};
+      auto PutText = [&](StringRef Text) {
+        return M.copy<const PyStmt *>(
+            {Return(M.call("_put_bytes", {A("buf"), A("pos"), A(Text)}))});
+      };
+      Body = {
+          M.stmt(PyStmtKind::If, {M.binary("!=", A("x"), A("x"))},
+                 PutText("b\"nan\"")),
+          M.stmt(PyStmtKind::If,
+                 {M.binary("!=", M.binary("-", A("x"), A("x")), A("0"))},
+                 PutText("b\"inf\"")),
+          M.stmt(PyStmtKind::If,
+                 {M.binary("or",
+                           M.binary(">", A("x"), A("4294967040.0")),
+                           M.binary("<", A("x"), A("-4294967040.0")))},
+                 PutText("b\"ovf\"")),
+          M.stmt(PyStmtKind::If, {M.binary("<", A("x"), A("0"))},
+                 PutMinus("x")),
+          // Rounded to the last printed decimal.
+          Assign("x",
+                 M.binary("/", A("0.5"), M.binary("**", A("10"), A("digits"))),
+                 "+="),
+          Assign("n", M.call("int", {A("x")})),
+          Assign("pos", M.call("_put_int",
+                               {A("buf"), A("pos"), A("n"), A("10")})),
+          M.stmt(PyStmtKind::If, {A("digits")},
+                 {M.assign(M.subscript(A("buf"), A("pos")), A("46")),
+                  Assign("pos", A("1"), "+=")}),
+          M.stmt(PyStmtKind::While, {A("digits")},
+                 {Assign("x", M.binary("*", M.binary("-", A("x"), A("n")),
+                                       A("10"))),
+                  Assign("n", M.call("int", {A("x")})),
+                  M.assign(M.subscript(A("buf"), A("pos")),
+                           M.binary("+", A("48"), A("n"))),
+                  Assign("pos", A("1"), "+="), Assign("digits", A("1"), "-=")}),
+          Return(A("pos"))};
+    }
+    PyStmt *Def = M.stmt(PyStmtKind::Def, Params, Body);
+    Def->Text = Name;
+    return Def;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *lowerExpr(const Expr *E) {
+    if (const PyExpr *Macro = lowerMacro(E))
+      return Macro;
+    if (const PyExpr *Bits = lowerBitMacro(E))
+      return Bits;
+    const PyExpr *Result = lowerExprNode(E);
+    // The prefixes the rule of the enclosing call puts before its arguments.
+    if (ArgumentRule) {
+      if (!ArgumentRule->ArgumentLiteralPrefix.empty() &&
+          hasIntegerLiteralChild(E))
+        Result = prefix(ArgumentRule->ArgumentLiteralPrefix, Result);
+      const auto *Ref = dyn_cast<DeclRefExpr>(E);
+      if (!ArgumentRule->ArgumentVarPrefix.empty() && Ref &&
+          isa<VarDecl>(Ref->getDecl()))
+        Result = prefix(ArgumentRule->ArgumentVarPrefix, Result);
+    }
+    return Result;
+  }
+
+  const PyExpr *lowerExprNode(const Expr *E) {
+    if (const PyExpr *Constant = foldConstant(E))
+      return Constant;
+    if (const auto *Paren = dyn_cast<ParenExpr>(E))
+      return lowerExpr(Paren->getSubExpr());
+    if (const auto *Full = dyn_cast<FullExpr>(E))
+      return lowerExpr(Full->getSubExpr());
+    if (const auto *Temp = dyn_cast<MaterializeTemporaryExpr>(E))
+      return lowerExpr(Temp->getSubExpr());
+    if (const auto *Bind = dyn_cast<CXXBindTemporaryExpr>(E))
+      return lowerExpr(Bind->getSubExpr());
+    if (const auto *Default = dyn_cast<CXXDefaultArgExpr>(E))
+      return lowerExpr(Default->getExpr());
+    if (const auto *Cast = dyn_cast<CastExpr>(E)) {
+      const PyExpr *Operand = lowerExpr(Cast->getSubExpr());
+      switch (Cast->getCastKind()) {
+      case CK_FloatingToIntegral:
+        return M.call("int", {Operand});
+      case CK_IntegralToFloating:
+        return isa<ExplicitCastExpr>(Cast) ? M.call("float", {Operand})
+                                           : Operand;
+      default:
+        return Operand;
+      }
+    }
 
-//Handler for isAscii function: isAscii is rewritten as ure.match()
+    if (const auto *Int = dyn_cast<IntegerLiteral>(E))
+      return integer(Int->getValue(), /*Signed=*/false);
+    if (const auto *Char = dyn_cast<CharacterLiteral>(E))
+      return M.atom(M.save(llvm::utostr(Char->getValue())));
+    if (const auto *Float = dyn_cast<FloatingLiteral>(E)) {
+      SmallString<32> Text;
+      Float->getValue().toString(Text);
+      if (Text.find_first_of(".eEn") == StringRef::npos)
+        Text += ".0";
+      return M.atom(M.save(Text));
+    }
+    if (const auto *String = dyn_cast<StringLiteral>(E)) {
+      if (String->getCharByteWidth() != 1)
+        return unsupported(E);
+      return M.atom(M.save(quotePython(String->getString())));
+    }
+    if (const auto *Bool = dyn_cast<CXXBoolLiteralExpr>(E))
+      return M.atom(Bool->getValue() ? "True" : "False");
+    if (isa<CXXNullPtrLiteralExpr>(E) || isa<GNUNullExpr>(E))
+      return M.atom("None");
+
+    if (const auto *Ref = dyn_cast<DeclRefExpr>(E))
+      return lowerDeclRef(Ref);
+    if (const auto *UO = dyn_cast<UnaryOperator>(E))
+      return lowerUnary(UO);
+    if (const auto *BO = dyn_cast<BinaryOperator>(E))
+      return lowerBinary(BO);
+    if (const auto *Cond = dyn_cast<ConditionalOperator>(E)) {
+      bool Taken;
+      if (Cond->getCond()->EvaluateAsBooleanCondition(Taken, Context))
+        return lowerExpr(Taken ? Cond->getTrueExpr() : Cond->getFalseExpr());
+      return M.expr(PyExprKind::Conditional, PrecConditional, "",
+                    {lowerExpr(Cond->getCond()), lowerExpr(Cond->getTrueExpr()),
+                     lowerExpr(Cond->getFalseExpr())});
+    }
+    if (const auto *Op = dyn_cast<CXXOperatorCallExpr>(E))
+      return lowerOperatorCall(Op);
+    if (const auto *Call = dyn_cast<CallExpr>(E))
+      return lowerCall(Call);
+    if (const auto *Member = dyn_cast<MemberExpr>(E)) {
+      StringRef Name = getName(Member->getMemberDecl());
+      if (Member->isImplicitAccess())
+        return M.atom(Name);
+      return M.expr(PyExprKind::Attribute, PrecPostfix, Name,
+                    {lowerExpr(Member->getBase())});
+    }
+    if (const auto *Subscript = dyn_cast<ArraySubscriptExpr>(E)) {
+      if (const VarDecl *Index = getReferencedVar(Subscript->getIdx())) {
+        auto Item = IteratedArrays.find(Index);
+        if (Item != IteratedArrays.end())
+          return M.atom(Item->second);
+      }
+      return M.subscript(lowerExpr(Subscript->getBase()),
+                         lowerExpr(Subscript->getIdx()));
+    }
+    if (const auto *Construct = dyn_cast<CXXConstructExpr>(E))
+      return lowerConstruct(Construct);
+    if (const auto *Init = dyn_cast<InitListExpr>(E))
+      return lowerInitList(Init);
+
+    // sizeof and the other constant expressions without a Python spelling.
+    Expr::EvalResult Result;
+    if (E->EvaluateAsInt(Result, Context))
+      return integer(Result.Val.getInt());
+    return unsupported(E);
+  }
 
-class isAsciiHandler : public MatchFinder::MatchCallback {
-public:
-   isAsciiHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  const PyExpr *lowerDeclRef(const DeclRefExpr *Ref) {
+    const ValueDecl *D = Ref->getDecl();
+    // The enums of the headers are not part of the module.
+    if (const auto *Enumerator = dyn_cast<EnumConstantDecl>(D))
+      if (!isInMainFile(Enumerator->getLocation()))
+        return integer(Enumerator->getInitVal());
+
+    StringRef Name = getName(D);
+    if (isa<VarDecl>(D))
+      if (const RewriteRule *Rule = Rules.findVariable(D->getName()))
+        Name = applyRule(*Rule, Name);
+    if (isa<UsingShadowDecl>(Ref->getFoundDecl()))
+      if (const RewriteRule *Rule = Rules.findUsingRef(D->getName()))
+        Name = applyRule(*Rule, Name);
+    return M.atom(Name);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isAsciifinder = Results.Nodes.getNodeAs<clang::CallExpr>("isAscii");
-    Rewrite.ReplaceText(isAsciifinder->getBeginLoc(), "ure.match");
+  const PyExpr *lowerUnary(const UnaryOperator *UO) {
+    StringRef Op;
+    switch (UO->getOpcode()) {
+    case UO_Minus:
+      Op = "-";
+      break;
+    case UO_Plus:
+      Op = "+";
+      break;
+    case UO_Not:
+      Op = "~";
+      break;
+    case UO_LNot:
+      Op = "not";
+      break;
+    case UO_Extension:
+      return lowerExpr(UO->getSubExpr());
+    default:
+      // Increments whose value is used, pointers and addresses.
+      return unsupported(UO);
+    }
+    return M.unary(Op, lowerExpr(UO->getSubExpr()));
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *lowerBinary(const BinaryOperator *BO) {
+    BinaryOperatorKind Opcode = BO->getOpcode();
+    if (Opcode == BO_Assign) {
+      // An assignment whose value is used becomes an assignment expression.
+      const auto *Target = dyn_cast<DeclRefExpr>(BO->getLHS()->IgnoreParens());
+      if (!Target || !isa<VarDecl>(Target->getDecl()))
+        return unsupported(BO);
+      noteAssigned(Target);
+      return M.expr(PyExprKind::NamedExpr, PrecNamedExpr,
+                    getName(Target->getDecl()), {lowerExpr(BO->getRHS())});
+    }
+    if (BO->isAssignmentOp() || Opcode == BO_Comma || BO->isPtrMemOp())
+      return unsupported(BO);
+
+    // DEBUG && x is x when DEBUG is 1, DEBUG || x is x when DEBUG is 0.
+    bool Left;
+    if ((Opcode == BO_LAnd || Opcode == BO_LOr) &&
+        BO->getLHS()->EvaluateAsBooleanCondition(Left, Context) &&
+        Left == (Opcode == BO_LAnd))
+      return lowerExpr(BO->getRHS());
+
+    StringRef Op = BinaryOperator::getOpcodeStr(Opcode);
+    if (Opcode == BO_LAnd)
+      Op = "and";
+    else if (Opcode == BO_LOr)
+      Op = "or";
+    else if ((Opcode == BO_Div || Opcode == BO_Rem) &&
+             BO->getType()->isIntegerType()) {
+      if (!isFloorDivisionExact(BO))
+        return lowerTruncatingDivision(BO);
+      if (Opcode == BO_Div)
+        Op = "//";
+    }
+    return M.binary(Op, lowerExpr(BO->getLHS()), lowerExpr(BO->getRHS()));
+  }
 
-//Handler for variable in isAscii function: regex is inserted.
+  // C truncates the integer division toward zero, Python's // and % round
+  // down. They agree when no operand is negative.
+  bool isFloorDivisionExact(const BinaryOperator *BO) const {
+    QualType Type = BO->getType();
+    if (const auto *Compound = dyn_cast<CompoundAssignOperator>(BO))
+      Type = Compound->getComputationResultType();
+    if (Type->isUnsignedIntegerType())
+      return true;
+    return !canBeNegative(BO->getLHS()) && !canBeNegative(BO->getRHS());
+  }
 
-class isAsciiVarHandler : public MatchFinder::MatchCallback {
-public:
-   isAsciiVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Returns false if the integer E is never negative: it has an unsigned
+  // type before the promotions or it's a constant that is not negative.
+  bool canBeNegative(const Expr *E) const {
+    E = E->IgnoreParenImpCasts();
+    if (E->getType()->isUnsignedIntegerType())
+      return false;
+    Expr::EvalResult Result;
+    return !E->EvaluateAsInt(Result, Context) ||
+           Result.Val.getInt().isNegative();
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isAsciiVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isAsciiVar");
-    Rewrite.InsertText(isAsciiVarfinder->getBeginLoc(), "'\\w\\W' ");
+  // _cdiv(a, b) or _cmod(a, b) for a / b and a % b, also of a /= b and
+  // a %= b.
+  const PyExpr *lowerTruncatingDivision(const BinaryOperator *BO) {
+    BinaryOperatorKind Opcode = BO->getOpcode();
+    if (BO->isCompoundAssignmentOp())
+      Opcode = BinaryOperator::getOpForCompoundAssignment(Opcode);
+    UsesTruncatingDivision = true;
+    return M.call(Opcode == BO_Div ? "_cdiv" : "_cmod",
+                  {lowerExpr(BO->getLHS()), lowerExpr(BO->getRHS())});
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // def _cdiv(a, b): the quotient rounded down is one less than the
+  // truncated one when it is negative and inexact.
+  void defineTruncatingDivision(StmtList &Out) {
+    if (!UsesTruncatingDivision)
+      return;
+    auto A = [&](StringRef Text) { return M.atom(Text); };
+    auto Return = [&](const PyExpr *Value) {
+      return M.stmt(PyStmtKind::Return, {Value});
+    };
+    PyStmt *Div = M.stmt(
+        PyStmtKind::Def, {A("a"), A("b")},
+        {M.assign(A("q"), M.binary("//", A("a"), A("b"))),
+         M.stmt(PyStmtKind::If,
+                {M.binary("and", M.binary("<", A("q"), A("0")),
+                          M.binary("!=", M.binary("*", A("q"), A("b")),
+                                   A("a")))},
+                {M.assign(A("q"), A("1"), "+=")}),
+         Return(A("q"))});
+    Div->Text = "_cdiv";
+    Out.push_back(Div);
+    PyStmt *Mod = M.stmt(
+        PyStmtKind::Def, {A("a"), A("b")},
+        {Return(M.binary("-", A("a"),
+                         M.binary("*", A("b"),
+                                  M.call("_cdiv", {A("a"), A("b")}))))});
+    Mod->Text = "_cmod";
+    Out.push_back(Mod);
+  }
 
-//Handler for isDigit function: isDigit is rewritten as ure.match()
+  const PyExpr *lowerOperatorCall(const CXXOperatorCallExpr *Op) {
+    OverloadedOperatorKind Kind = Op->getOperator();
+    if (Kind == OO_Subscript)
+      return M.expr(PyExprKind::Subscript, PrecPostfix, "",
+                    {lowerExpr(Op->getArg(0)), lowerExpr(Op->getArg(1))});
+    if (Kind == OO_Call) {
+      SmallVector<const PyExpr *, 4> Args;
+      for (unsigned I = 1; I < Op->getNumArgs(); ++I)
+        Args.push_back(lowerExpr(Op->getArg(I)));
+      return M.call(lowerExpr(Op->getArg(0)), Args);
+    }
+    if (Kind == OO_Exclaim)
+      return M.unary("not", lowerExpr(Op->getArg(0)));
+    if (Op->getNumArgs() == 2) {
+      StringRef Spelling = getOperatorSpelling(Kind);
+      StringRef PyOp = llvm::StringSwitch<StringRef>(Spelling)
+                           .Case("&&", "and")
+                           .Case("||", "or")
+                           .Cases("+", "-", "*", "/", "%", Spelling)
+                           .Cases("==", "!=", "<", ">", "<=", ">=", Spelling)
+                           .Cases("&", "|", "^", "<<", ">>", Spelling)
+                           .Default("");
+      if (!PyOp.empty())
+        return M.binary(PyOp, lowerExpr(Op->getArg(0)),
+                        lowerExpr(Op->getArg(1)));
+    }
+    return unsupported(Op);
+  }
 
-class isDigitHandler : public MatchFinder::MatchCallback {
-public:
-   isDigitHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  const PyExpr *lowerCall(const CallExpr *Call) {
+    if (const PyExpr *Pin = lowerPinCall(Call))
+      return Pin;
+    if (const PyExpr *Class = lowerCharacterClass(Call))
+      return Class;
+    // Serial.begin(9600) sets the baud rate of the UART.
+    if (const auto *Member = dyn_cast<CXXMemberCallExpr>(Call)) {
+      const CXXMethodDecl *Method = Member->getMethodDecl();
+      StringRef Port = getSerialPort(Member->getImplicitObjectArgument());
+      if (!Port.empty() && Method && Method->getIdentifier() &&
+          Method->getName() == "begin" && Member->getNumArgs() >= 1) {
+        SerialPorts.insert(Port);
+        return M.call(M.save(Port + ".init"), {lowerExpr(Member->getArg(0))});
+      }
+    }
+
+    const PyExpr *Callee = nullptr;
+    const RewriteRule *Rule = nullptr;
+    const FunctionDecl *Function = Call->getDirectCallee();
+    if (Function && Function->getIdentifier() && !isa<CXXMethodDecl>(Function)) {
+      StringRef Name = getName(Function);
+      Rule = Rules.findCall(Function->getName());
+      if (Rule)
+        Name = applyRule(*Rule, Name);
+      const auto *Ref =
+          dyn_cast<DeclRefExpr>(Call->getCallee()->IgnoreParenImpCasts());
+      if (Ref && isa<UsingShadowDecl>(Ref->getFoundDecl()))
+        if (const RewriteRule *Using = Rules.findUsingRef(Function->getName()))
+          Name = applyRule(*Using, Name);
+      Callee = M.atom(Name);
+    } else {
+      Callee = lowerExpr(Call->getCallee());
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isDigitfinder = Results.Nodes.getNodeAs<clang::CallExpr>("isDigit");
-    Rewrite.ReplaceText(isDigitfinder->getBeginLoc(), "ure.match");
+    // The argument prefixes of the rule apply to everything below the call.
+    const RewriteRule *SavedRule = ArgumentRule;
+    if (Rule && (!Rule->ArgumentVarPrefix.empty() ||
+                 !Rule->ArgumentLiteralPrefix.empty()))
+      ArgumentRule = Rule;
+    SmallVector<const PyExpr *, 4> Args;
+    for (const Expr *Arg : Call->arguments()) {
+      // Python fills in the default arguments itself.
+      if (isa<CXXDefaultArgExpr>(Arg))
+        break;
+      Args.push_back(lowerExpr(Arg));
+    }
+    ArgumentRule = SavedRule;
+    return M.call(Callee, Args);
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // The calls of a constant pin use the machine.Pin object of the pin,
+  // created once at the top of the module:
+  //   pinMode(13, OUTPUT)    p13.init(machine.Pin.OUT)
+  //   digitalWrite(13, HIGH) p13.on()
+  //   digitalWrite(13, x)    p13.value(x)
+  //   digitalRead(13)        p13.value()
+  // The pins only known at run time are left to the rules.
+  const PyExpr *lowerPinCall(const CallExpr *Call) {
+    unsigned Args = Call->getNumArgs();
+    if (isCoreCall(Call, "digitalRead") && Args == 1) {
+      StringRef Pin = getPin(Call->getArg(0));
+      return Pin.empty() ? nullptr : M.call(getPinMethod(Pin, "value"), {});
+    }
+    if (isCoreCall(Call, "digitalWrite") && Args == 2) {
+      StringRef Pin = getPin(Call->getArg(0));
+      if (Pin.empty())
+        return nullptr;
+      Expr::EvalResult Value;
+      if (!Call->getArg(1)->EvaluateAsInt(Value, Context))
+        return M.call(getPinMethod(Pin, "value"),
+                      {lowerExpr(Call->getArg(1))});
+      return M.call(getPinMethod(Pin, Value.Val.getInt().getBoolValue()
+                                          ? "on"
+                                          : "off"),
+                    {});
+    }
+    Expr::EvalResult Mode;
+    if (!isCoreCall(Call, "pinMode") || Args != 2 ||
+        !Call->getArg(1)->EvaluateAsInt(Mode, Context))
+      return nullptr;
+    SmallVector<const PyExpr *, 2> Modes;
+    // INPUT, OUTPUT and INPUT_PULLUP
+    switch (Mode.Val.getInt().getExtValue()) {
+    case 0:
+      Modes.push_back(M.atom("machine.Pin.IN"));
+      break;
+    case 1:
+      Modes.push_back(M.atom("machine.Pin.OUT"));
+      break;
+    case 2:
+      Modes.push_back(M.atom("machine.Pin.IN"));
+      Modes.push_back(M.atom("machine.Pin.PULL_UP"));
+      break;
+    default:
+      return nullptr;
+    }
+    StringRef Pin = getPin(Call->getArg(0));
+    return Pin.empty() ? nullptr : M.call(getPinMethod(Pin, "init"), Modes);
+  }
 
-//Handler for variable in isDigit function: regex is inserted.
+  // The character classes of WCharacter.h made of a single range are
+  // comparisons, isDigit(c) is 48 <= c <= 57. The others test their bit in
+  // the table _ctype defined once, isAlpha(c) is _ctype[c & 0xFF] & 0x1.
+  const PyExpr *lowerCharacterClass(const CallExpr *Call) {
+    const FunctionDecl *Function = Call->getDirectCallee();
+    if (Call->getNumArgs() != 1 || !Function || !Function->getIdentifier() ||
+        !isCoreCall(Call, Function->getName()))
+      return nullptr;
+    StringRef Name = Function->getName();
+    const Expr *Arg = Call->getArg(0);
+    std::pair<unsigned, unsigned> Range =
+        llvm::StringSwitch<std::pair<unsigned, unsigned>>(Name)
+            .Case("isAscii", {0, 127})
+            .Case("isDigit", {'0', '9'})
+            .Case("isLowerCase", {'a', 'z'})
+            .Case("isUpperCase", {'A', 'Z'})
+            .Case("isGraph", {'!', '~'})
+            .Case("isPrintable", {' ', '~'})
+            .Default({1, 0});
+    if (Range.first <= Range.second)
+      return M.between(M.atom(M.save(llvm::utostr(Range.first))),
+                       lowerExpr(Arg),
+                       M.atom(M.save(llvm::utostr(Range.second))));
+    unsigned Class = llvm::StringSwitch<unsigned>(Name)
+                         .Case("isAlpha", ClassAlpha)
+                         .Case("isAlphaNumeric", ClassAlphaNumeric)
+                         .Case("isHexadecimalDigit", ClassHexadecimalDigit)
+                         .Case("isPunct", ClassPunct)
+                         .Case("isSpace", ClassSpace)
+                         .Case("isWhitespace", ClassWhitespace)
+                         .Case("isControl", ClassControl)
+                         .Default(0);
+    if (!Class)
+      return nullptr;
+    UsesCharacterTable = true;
+    // A negative char or the -1 of Serial.read() must not index from the
+    // end of the table.
+    const PyExpr *Index = lowerExpr(Arg);
+    QualType T = Arg->IgnoreParenImpCasts()->getType().getCanonicalType();
+    if (!T->isSpecificBuiltinType(BuiltinType::UChar))
+      Index = M.binary("&", Index, M.atom("0xFF"));
+    return M.binary("&", M.subscript(M.atom("_ctype"), Index),
+                    M.atom(M.save("0x" + llvm::utohexstr(Class))));
+  }
 
-class isDigitVarHandler : public MatchFinder::MatchCallback {
-public:
-   isDigitVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // _ctype = b'...', the classes of every byte.
+  void defineCharacterTable(StmtList &Out) {
+    if (!UsesCharacterTable)
+      return;
+    std::string Table;
+    for (unsigned C = 0; C < 256; ++C)
+      Table += static_cast<char>(getCharacterClasses(C));
+    Out.push_back(M.assign(M.atom("_ctype"),
+                           M.atom(M.save(quotePython(Table, /*Bytes=*/true)))));
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isDigitVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isDigitVar");
-    Rewrite.InsertText(isDigitVarfinder->getBeginLoc(), "'\\d' ");
+  // Returns true if Call calls the function Name of the Arduino core.
+  bool isCoreCall(const CallExpr *Call, StringRef Name) const {
+    const FunctionDecl *Function = Call->getDirectCallee();
+    return Function && Function->getIdentifier() &&
+           Function->getName() == Name &&
+           !isInMainFile(Function->getLocation());
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Returns the name of the machine.Pin object of E if E is a constant pin.
+  StringRef getPin(const Expr *E) {
+    Expr::EvalResult Result;
+    if (!E->EvaluateAsInt(Result, Context) || Result.Val.getInt().isNegative())
+      return StringRef();
+    uint64_t Number = Result.Val.getInt().getZExtValue();
+    StringRef &Name = Pins[Number];
+    if (Name.empty())
+      Name = M.save("p" + llvm::utostr(Number));
+    return Name;
+  }
 
-//Handler for isLowerCase function: isLowerCase is rewritten as ure.match()
+  // In the loop the bound method is looked up once before it.
+  StringRef getPinMethod(StringRef Pin, StringRef Method) {
+    StringRef Attribute = M.save(Pin + "." + Method);
+    return Scope == FunctionScope::Loop ? getLoopAlias(Attribute) : Attribute;
+  }
 
-class isLowerCaseHandler : public MatchFinder::MatchCallback {
-public:
-   isLowerCaseHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // p13 = machine.Pin(13)
+  void definePins(StmtList &Out) {
+    if (Pins.empty())
+      return;
+    M.Imports.insert("import machine");
+    for (const auto &Pin : Pins)
+      Out.push_back(M.assign(
+          M.atom(Pin.second),
+          M.call("machine.Pin", {M.atom(M.save(llvm::utostr(Pin.first)))})));
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isLowerCasefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isLowerCase");
-    Rewrite.ReplaceText(isLowerCasefinder->getBeginLoc(), "ure.match");
+  const PyExpr *lowerConstruct(const CXXConstructExpr *Construct) {
+    if (const auto *Array =
+            Context.getAsConstantArrayType(Construct->getType()))
+      return getDefaultValue(QualType(Array, 0));
+    const CXXRecordDecl *Record = Construct->getConstructor()->getParent();
+    // Copies, and the conversions to String of String s = "text".
+    if (Construct->getNumArgs() == 1 &&
+        (Construct->isElidable() ||
+         Construct->getConstructor()->isCopyOrMoveConstructor() ||
+         Record->getName() == "String"))
+      return lowerExpr(Construct->getArg(0));
+    if (Construct->getNumArgs() == 0)
+      return getDefaultValue(Construct->getType());
+    SmallVector<const PyExpr *, 4> Args;
+    for (const Expr *Arg : Construct->arguments()) {
+      if (isa<CXXDefaultArgExpr>(Arg))
+        break;
+      Args.push_back(lowerExpr(Arg));
+    }
+    return M.call(getName(Record), Args);
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *lowerInitList(const InitListExpr *Init) {
+    const auto *Array = Context.getAsConstantArrayType(Init->getType());
+    if (!Array)
+      return Init->getNumInits() == 1 ? lowerExpr(Init->getInit(0))
+                                      : unsupported(Init);
+    // char buf[] = "text"
+    if (Init->isStringLiteralInit())
+      return lowerExpr(Init->getInit(0));
+    SmallVector<const PyExpr *, 16> Items;
+    for (const Expr *Item : Init->inits())
+      Items.push_back(isa<InitListExpr>(Item)
+                          ? lowerInitList(cast<InitListExpr>(Item))
+                          : lowerExpr(Item));
+    const PyExpr *List = M.expr(PyExprKind::List, PrecAtom, "", Items);
+    // The elements without an initializer are zero, int buf[64] = {1} is
+    // [1] + [0] * 63.
+    uint64_t Size = Array->getSize().getZExtValue();
+    if (Items.size() >= Size)
+      return List;
+    const PyExpr *Rest = M.binary(
+        "*",
+        M.expr(PyExprKind::List, PrecAtom, "",
+               {getDefaultValue(Array->getElementType())}),
+        M.atom(M.save(llvm::utostr(Size - Items.size()))));
+    return Items.empty() ? Rest : M.binary("+", List, Rest);
+  }
 
-//Handler for variable in isLowerCase function: regex is inserted.
+  // Returns the value of a variable of type T declared without initializer.
+  const PyExpr *getDefaultValue(QualType T) {
+    T = T.getCanonicalType();
+    if (const auto *Array = Context.getAsConstantArrayType(T)) {
+      QualType Element = Array->getElementType();
+      const PyExpr *Size = integer(Array->getSize(), /*Signed=*/false);
+      if (Element->isCharType())
+        return M.call("bytearray", {Size});
+      const PyExpr *Value = getDefaultValue(Element);
+      // Every row of a matrix is a list of its own.
+      if (Element->isArrayType() || Element->isRecordType())
+        return M.expr(PyExprKind::Comprehension, PrecAtom, "_",
+                      {Value, M.call("range", {Size})});
+      return M.binary("*", M.expr(PyExprKind::List, PrecAtom, "", {Value}),
+                      Size);
+    }
+    if (T->isBooleanType())
+      return M.atom("False");
+    if (T->isIntegerType() || T->isEnumeralType())
+      return M.atom("0");
+    if (T->isRealFloatingType())
+      return M.atom("0.0");
+    if (const CXXRecordDecl *Record = T->getAsCXXRecordDecl()) {
+      if (Record->getName() == "String")
+        return M.atom("\"\"");
+      return M.call(getName(Record), {});
+    }
+    return M.atom("None");
+  }
 
-class isLowerCaseVarHandler : public MatchFinder::MatchCallback {
-public:
-   isLowerCaseVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Returns the name of the object-like macro E was expanded from, renamed by
+  // its rule, or null if E is not the whole expansion of such a macro. The
+  // constants defined in the main file are defined once at the top of the
+  // module, the macros of the headers are replaced by their value unless a
+  // rule names them.
+  const PyExpr *lowerMacro(const Expr *E) {
+    SourceLocation Begin = E->getBeginLoc(), ExpansionBegin, ExpansionEnd;
+    if (InMacroDefinition || !Begin.isMacroID() ||
+        !Lexer::isAtStartOfMacroExpansion(Begin, SM, LangOpts,
+                                          &ExpansionBegin) ||
+        !Lexer::isAtEndOfMacroExpansion(E->getEndLoc(), SM, LangOpts,
+                                        &ExpansionEnd) ||
+        ExpansionBegin != ExpansionEnd || !ExpansionBegin.isFileID() ||
+        !SM.isInMainFile(ExpansionBegin))
+      return nullptr;
+    StringRef Name = Lexer::getSourceText(
+        CharSourceRange::getTokenRange(ExpansionBegin), SM, LangOpts);
+    const MacroInfo *Info = PP.getMacroInfo(PP.getIdentifierInfo(Name));
+    if (!Info || !Info->isObjectLike())
+      return nullptr;
+
+    if (const RewriteRule *Rule = Rules.findVariable(Name))
+      return M.atom(applyRule(*Rule, Name));
+    if (!SM.isInMainFile(Info->getDefinitionLoc()) ||
+        !E->isEvaluatable(Context))
+      return nullptr;
+    if (DefinedMacros.insert(Name).second) {
+      const PyExpr *Value;
+      Expr::EvalResult Constant;
+      if (isConstantType(E->getType()) && E->EvaluateAsInt(Constant, Context)) {
+        Value = constant(Constant.Val.getInt());
+      } else {
+        const RewriteRule *SavedRule = ArgumentRule;
+        ArgumentRule = nullptr;
+        InMacroDefinition = true;
+        Value = lowerExpr(E);
+        InMacroDefinition = false;
+        ArgumentRule = SavedRule;
+      }
+      MacroDefinitions.push_back(M.assign(M.atom(Name), Value));
+    }
+    return M.atom(Name);
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isLowerCaseVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isLowerCaseVar");
-    Rewrite.InsertText(isLowerCaseVarfinder->getBeginLoc(), "'[a-z]', ");
+  // Folds the integer expressions computed from literals and from the
+  // constants of the headers, F_CPU / 1000 or sizeof(buf) for example. The
+  // constants of the sketch keep their names, MicroPython folds them itself.
+  const PyExpr *foldConstant(const Expr *E) {
+    const Expr *Inner = E->IgnoreParenImpCasts();
+    if (!isa<BinaryOperator>(Inner) && !isa<UnaryOperator>(Inner) &&
+        !isa<ConditionalOperator>(Inner) && !isa<ExplicitCastExpr>(Inner) &&
+        !isa<UnaryExprOrTypeTraitExpr>(Inner))
+      return nullptr;
+    Expr::EvalResult Result;
+    if (!isConstantType(E->getType()) || usesSketchConstants(Inner) ||
+        !E->EvaluateAsInt(Result, Context))
+      return nullptr;
+    count("ConstantFold", [] {});
+    return integer(Result.Val.getInt());
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Returns true if S names a declaration or a macro of the sketch.
+  bool usesSketchConstants(const Stmt *S) {
+    if (const auto *Ref = dyn_cast<DeclRefExpr>(S))
+      if (isInMainFile(Ref->getDecl()->getLocation()))
+        return true;
+    SourceLocation Loc = S->getBeginLoc();
+    if (Loc.isMacroID()) {
+      StringRef Name = Lexer::getImmediateMacroName(Loc, SM, LangOpts);
+      const MacroInfo *Info = PP.getMacroInfo(PP.getIdentifierInfo(Name));
+      if (Info && isInMainFile(Info->getDefinitionLoc()))
+        return true;
+    }
+    for (const Stmt *Child : S->children())
+      if (Child && usesSketchConstants(Child))
+        return true;
+    return false;
+  }
 
-//Handler for isPunct function: isPunct is rewritten as ure.match
+  // Returns the name of the function-like macro of the Arduino core whose
+  // whole expansion is E, or an empty string.
+  StringRef getCoreMacro(const Expr *E) {
+    SourceLocation Begin = E->getBeginLoc(), End = E->getEndLoc();
+    if (!Begin.isMacroID() || !End.isMacroID() ||
+        !Lexer::isAtStartOfMacroExpansion(Begin, SM, LangOpts) ||
+        !Lexer::isAtEndOfMacroExpansion(End, SM, LangOpts) ||
+        SM.getImmediateExpansionRange(Begin).getBegin() !=
+            SM.getImmediateExpansionRange(End).getBegin())
+      return "";
+    StringRef Name = Lexer::getImmediateMacroName(Begin, SM, LangOpts);
+    const MacroInfo *Info = PP.getMacroInfo(PP.getIdentifierInfo(Name));
+    if (!Info || !Info->isFunctionLike() ||
+        isInMainFile(Info->getDefinitionLoc()))
+      return "";
+    return Name;
+  }
 
-class isPunctHandler : public MatchFinder::MatchCallback {
-public:
-   isPunctHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Lowers bit(b), bitRead(v, b), lowByte(w) and highByte(w) from their
+  // expansion, with the mask folded when the bit is a constant:
+  //
+  //   bitRead(v, 3)   v >> 3 & 1
+  //   bit(3)          0x8
+  //   highByte(w)     w >> 8 & 255
+  const PyExpr *lowerBitMacro(const Expr *E) {
+    StringRef Name = getCoreMacro(E);
+    if (Name.empty())
+      return nullptr;
+    const Expr *Body = E->IgnoreParenImpCasts();
+    const auto *Op = dyn_cast<BinaryOperator>(Body);
+    if (Name == "bit") {
+      // (1UL << (b))
+      if (!Op || Op->getOpcode() != BO_Shl)
+        return nullptr;
+      return lowerBitMask(Op->getRHS());
+    }
+    if (Name == "bitRead") {
+      // (((value) >> (bit)) & 0x01)
+      const auto *Shift =
+          Op ? dyn_cast<BinaryOperator>(Op->getLHS()->IgnoreParenImpCasts())
+             : nullptr;
+      if (!Shift || Op->getOpcode() != BO_And || Shift->getOpcode() != BO_Shr)
+        return nullptr;
+      return M.binary("&",
+                      M.binary(">>", lowerExpr(Shift->getLHS()),
+                               lowerExpr(Shift->getRHS())),
+                      M.atom("1"));
+    }
+    if (Name == "lowByte" || Name == "highByte") {
+      // ((uint8_t) ((w) & 0xff)) and ((uint8_t) ((w) >> 8)), Python does not
+      // truncate to uint8_t.
+      const auto *Cast = dyn_cast<ExplicitCastExpr>(Body);
+      Op = Cast ? dyn_cast<BinaryOperator>(
+                      Cast->getSubExpr()->IgnoreParenImpCasts())
+                : nullptr;
+      BinaryOperatorKind Opcode = Name == "lowByte" ? BO_And : BO_Shr;
+      if (!Op || Op->getOpcode() != Opcode)
+        return nullptr;
+      const PyExpr *Word = lowerExpr(Op->getLHS());
+      if (Opcode == BO_Shr)
+        Word = M.binary(">>", Word, M.atom("8"));
+      return M.binary("&", Word, M.atom("255"));
+    }
+    return nullptr;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isPunctfinder = Results.Nodes.getNodeAs<clang::CallExpr>("isPunct");
-    Rewrite.ReplaceText(isPunctfinder->getBeginLoc(), "ure.match");
+  // Lowers bitSet(v, b), bitClear(v, b) and bitWrite(v, b, x) used as
+  // statements into augmented assignments:
+  //
+  //   bitSet(v, 3)        v |= 0x8
+  //   bitClear(v, 3)      v &= ~0x8
+  //   bitWrite(v, 3, x)   if x: v |= 0x8 else: v &= ~0x8
+  bool lowerBitMacroStmt(const Expr *E, StmtList &Out) {
+    StringRef Name = getCoreMacro(E);
+    const Expr *Body = E->IgnoreParenImpCasts();
+    if (Name == "bitSet" || Name == "bitClear")
+      return lowerBitAssign(Body, Out);
+    if (Name != "bitWrite")
+      return false;
+    // ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+    const auto *Cond = dyn_cast<ConditionalOperator>(Body);
+    const Expr *Target, *Bit;
+    bool Set;
+    if (!Cond || !matchBitAssign(Cond->getTrueExpr(), Target, Bit, Set) ||
+        !matchBitAssign(Cond->getFalseExpr(), Target, Bit, Set))
+      return false;
+    bool Value;
+    if (Cond->getCond()->EvaluateAsBooleanCondition(Value, Context))
+      return lowerBitAssign(Value ? Cond->getTrueExpr() : Cond->getFalseExpr(),
+                            Out);
+    const PyExpr *Test = lowerExpr(Cond->getCond());
+    StringRef Note = takeNote();
+    SmallVector<const PyStmt *, 1> Then, Else;
+    lowerBitAssign(Cond->getTrueExpr(), Then);
+    lowerBitAssign(Cond->getFalseExpr(), Else);
+    PyStmt *If = M.stmt(PyStmtKind::If, {Test}, Then, Else);
+    If->Note = Note;
+    Out.push_back(If);
+    return true;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Matches ((value) |= (1UL << (bit))) and ((value) &= ~(1UL << (bit))).
+  static bool matchBitAssign(const Expr *E, const Expr *&Target,
+                             const Expr *&Bit, bool &Set) {
+    const auto *Assign = dyn_cast<CompoundAssignOperator>(E->IgnoreParens());
+    if (!Assign)
+      return false;
+    const Expr *Mask = Assign->getRHS()->IgnoreParenImpCasts();
+    Set = Assign->getOpcode() == BO_OrAssign;
+    if (!Set) {
+      const auto *Not = dyn_cast<UnaryOperator>(Mask);
+      if (Assign->getOpcode() != BO_AndAssign || !Not ||
+          Not->getOpcode() != UO_Not)
+        return false;
+      Mask = Not->getSubExpr()->IgnoreParenImpCasts();
+    }
+    const auto *Shift = dyn_cast<BinaryOperator>(Mask);
+    if (!Shift || Shift->getOpcode() != BO_Shl)
+      return false;
+    Target = Assign->getLHS();
+    Bit = Shift->getRHS();
+    return true;
+  }
 
-//Handler for variable in isPunct function: regex is inserted.
+  bool lowerBitAssign(const Expr *E, StmtList &Out) {
+    const Expr *Target, *Bit;
+    bool Set;
+    if (!matchBitAssign(E, Target, Bit, Set))
+      return false;
+    noteAssigned(Target);
+    const PyExpr *Mask = lowerBitMask(Bit);
+    Out.push_back(withNote(M.assign(lowerExpr(Target),
+                                    Set ? Mask : M.unary("~", Mask),
+                                    Set ? "|=" : "&=")));
+    return true;
+  }
 
-class isPunctVarHandler : public MatchFinder::MatchCallback {
-public:
-   isPunctVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // 1 << Bit, folded when Bit is a constant.
+  const PyExpr *lowerBitMask(const Expr *Bit) {
+    Expr::EvalResult Result;
+    if (Bit->EvaluateAsInt(Result, Context) &&
+        Result.Val.getInt().isNonNegative() && Result.Val.getInt() < 64)
+      return M.atom(M.save(
+          "0x" + llvm::utohexstr(1ULL << Result.Val.getInt().getZExtValue())));
+    return M.binary("<<", M.atom("1"), lowerExpr(Bit));
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isPunctVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isPunctVar");
-    Rewrite.InsertText(isPunctVarfinder->getBeginLoc(), "'\\W' ");
+  // Keeps the C++ text of E and flags the statement it belongs to.
+  const PyExpr *unsupported(const Expr *E) {
+    count("Unsupported", [] {});
+    NeedsNote = true;
+    // On a single line, the statement around it is still valid Python.
+    std::string Text;
+    for (char C : getSourceText(E->getSourceRange())) {
+      bool Space = isWhitespace(C);
+      if (Space && (Text.empty() || Text.back() == ' '))
+        continue;
+      Text += Space ? ' ' : C;
+    }
+    return M.atom(M.save(StringRef(Text).rtrim()));
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  // Keeps the C++ text of a statement or declaration as a comment.
+  void unsupported(SourceRange Range, StmtList &Out) {
+    count("Unsupported", [] {});
+    PyStmt *S = M.stmt(PyStmtKind::Comment);
+    S->Text = M.save("unsupported C++:\n" + getSourceText(Range).str());
+    Out.push_back(S);
+  }
 
-//Handler for isSpace function: isSpace is rewritten as ure.match
+  StringRef getSourceText(SourceRange Range) const {
+    return Lexer::getSourceText(SM.getExpansionRange(Range), SM, LangOpts);
+  }
 
-class isSpaceHandler : public MatchFinder::MatchCallback {
-public:
-   isSpaceHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Sets the note of S if one of its expressions kept C++ text.
+  PyStmt *withNote(PyStmt *S) {
+    S->Note = takeNote();
+    return S;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isSpacefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isSpace");
-    Rewrite.ReplaceText(isSpacefinder->getBeginLoc(), "ure.match");
+  StringRef takeNote() {
+    StringRef Note = NeedsNote ? "unsupported C++ kept as is" : "";
+    NeedsNote = false;
+    return Note;
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *integer(const llvm::APInt &Value, bool Signed) {
+    SmallString<24> Text;
+    Value.toString(Text, 10, Signed);
+    return M.atom(M.save(Text));
+  }
 
-//Handler for variable in isSpace function: regex is inserted.
+  const PyExpr *integer(const llvm::APSInt &Value) {
+    return integer(Value, Value.isSigned());
+  }
 
-class isSpaceVarHandler : public MatchFinder::MatchCallback {
-public:
-   isSpaceVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // MicroPython inlines the names bound to const() when it compiles the module
+  // and their value is never looked up at run time. Only integers qualify,
+  // booleans excluded.
+  static bool isConstantType(QualType T) {
+    return isIntegerType(T) && !T->isBooleanType();
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isSpaceVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isSpaceVar");
-    Rewrite.InsertText(isSpaceVarfinder->getBeginLoc(), "'\\f\\n\\r\\t\\v\\s', ");
+  const PyExpr *constant(const llvm::APSInt &Value) {
+    M.Imports.insert("from micropython import const");
+    return M.call("const", {integer(Value)});
   }
 
-private:
-  Rewriter &Rewrite;
-};
+  const PyExpr *prefix(StringRef Prefix, const PyExpr *Operand) {
+    return M.expr(PyExprKind::Prefixed, Operand->Precedence, Prefix, {Operand});
+  }
 
-//Handler for isUpperCase function: isUpperCase is rewritten as ure.match
+  // Returns the new name of a call or reference renamed by Rule and records
+  // the module the name comes from. In the loop, a module attribute is read
+  // from a local alias, set once before the loop.
+  StringRef applyRule(const RewriteRule &Rule, StringRef Name) {
+    llvm::TimeTraceScope TraceScope("Rule", Rule.QualifiedName);
+    StatsClock::time_point Start = StatsClock::now();
+    StringRef NewName = Rule.NewName.empty() ? Name : StringRef(Rule.NewName);
+    if (!Rule.Prefix.empty())
+      NewName = M.save(Rule.Prefix + NewName.str());
+    // utime.sleep_ms needs import utime, Pin.mode is not a module.
+    StringRef Module = NewName.split('.').first;
+    if (Module.size() != NewName.size() && Module == Module.lower()) {
+      M.Imports.insert(M.save("import " + Module));
+      if (Scope == FunctionScope::Loop)
+        NewName = getLoopAlias(NewName);
+    }
+    if (Counters) {
+      HandlerCounter &Counter = Counters->Rules[Rule.QualifiedName];
+      Counter.Seconds += secondsSince(Start);
+      ++Counter.Hits;
+    }
+    return NewName;
+  }
 
-class isUpperCaseHandler : public MatchFinder::MatchCallback {
-public:
-   isUpperCaseHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  // Returns the local alias of Attribute, set once before the loop:
+  // utime_sleep_ms = utime.sleep_ms.
+  StringRef getLoopAlias(StringRef Attribute) {
+    StringRef &Alias = LoopAliases[Attribute];
+    if (Alias.empty()) {
+      std::string Local = Attribute.str();
+      std::replace(Local.begin(), Local.end(), '.', '_');
+      Alias = M.save(Local);
+    }
+    return Alias;
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isUpperCasefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isUpperCase");
-    Rewrite.ReplaceText(isUpperCasefinder->getBeginLoc(), "ure.match");
+  // Runs Lower under a trace scope and, with --stats, counts it under Name,
+  // including the constructs nested in it.
+  template <typename Fn> void count(const char *Name, Fn &&Lower) {
+    llvm::TimeTraceScope TraceScope(Name);
+    if (!Counters) {
+      Lower();
+      return;
+    }
+    StatsClock::time_point Start = StatsClock::now();
+    Lower();
+    HandlerCounter &Counter = Counters->Constructs[Name];
+    Counter.Seconds += secondsSince(Start);
+    ++Counter.Hits;
   }
 
-private:
-  Rewriter &Rewrite;
+  // Records the globals assigned by the function being lowered.
+  void noteAssigned(const Expr *Target) {
+    const auto *Ref = dyn_cast<DeclRefExpr>(Target->IgnoreParenImpCasts());
+    if (const auto *Var = Ref ? dyn_cast<VarDecl>(Ref->getDecl()) : nullptr)
+      noteAssigned(Var);
+  }
+
+  void noteAssigned(const VarDecl *Var) {
+    if (AssignedGlobals && Var->hasGlobalStorage())
+      AssignedGlobals->insert(getName(Var));
+  }
+
+  // Returns the Python name of D, Python keywords get a trailing underscore.
+  // The static locals are named after their function, _loop_count for count
+  // in loop().
+  StringRef getName(const NamedDecl *D) {
+    if (!D->getIdentifier())
+      return M.save(D->getNameAsString());
+    StringRef Name = D->getName();
+    const auto *Var = dyn_cast<VarDecl>(D);
+    if (Var && Var->isStaticLocal())
+      if (const auto *Function =
+              dyn_cast_or_null<FunctionDecl>(Var->getParentFunctionOrMethod()))
+        return M.save("_" + getName(Function) + "_" + Name);
+    bool IsKeyword = llvm::StringSwitch<bool>(Name)
+                         .Cases("and", "as", "assert", "async", "await", true)
+                         .Cases("class", "def", "del", "elif", "except", true)
+                         .Cases("finally", "from", "global", "import", "in",
+                                true)
+                         .Cases("is", "lambda", "nonlocal", "not", "or", true)
+                         .Cases("pass", "raise", "try", "with", "yield", true)
+                         .Cases("None", "True", "False", true)
+                         .Default(false);
+    return IsKeyword ? M.save(Name + "_") : Name;
+  }
+
+  bool isInMainFile(SourceLocation Loc) const {
+    return Loc.isValid() && SM.isInMainFile(SM.getExpansionLoc(Loc));
+  }
+
+  ASTContext &Context;
+  SourceManager &SM;
+  const LangOptions &LangOpts;
+  Preprocessor &PP;
+  const RuleIndex &Rules;
+  PyModule &M;
+  // Null unless --stats is used.
+  HandlerCounters *Counters;
+
+  // The rule whose argument prefixes apply to the expressions being lowered.
+  const RewriteRule *ArgumentRule = nullptr;
+  // Set when an expression of the statement being lowered kept C++ text.
+  bool NeedsNote = false;
+  // The globals assigned by the function being lowered, null at module level.
+  llvm::SetVector<StringRef> *AssignedGlobals = nullptr;
+  // Run before every continue of the innermost loop, null for plain loops.
+  const StmtList *LoopIncrement = nullptr;
+  unsigned LoopDepth = 0;
+  // Whether setup(), loop() or another function is being lowered.
+  enum class FunctionScope { Other, Setup, Loop };
+  FunctionScope Scope = FunctionScope::Other;
+  // The local aliases of the module attributes used by loop(), by attribute.
+  llvm::MapVector<StringRef, StringRef> LoopAliases;
+  // The loop variables that replace a[i] in the loops iterating an array, by
+  // counter.
+  llvm::DenseMap<const VarDecl *, StringRef> IteratedArrays;
+  unsigned SwitchTemps = 0;
+  // The static locals of the function being lowered, assigned at module
+  // level before it.
+  SmallVector<const PyStmt *, 4> StaticLocals;
+  // The constants of the main file, defined at the top of the module.
+  llvm::StringSet<> DefinedMacros;
+  SmallVector<const PyStmt *, 8> MacroDefinitions;
+  bool InMacroDefinition = false;
+  // The Serial output: the UARTs written to, the length of the shared buffer
+  // of the prints, the buffers of the String variables and the formatting
+  // functions used.
+  llvm::SetVector<StringRef> SerialPorts;
+  unsigned SerialBufferSize = 0;
+  llvm::MapVector<const VarDecl *, StringBuffer> StringBuffers;
+  llvm::StringSet<> BufferNames;
+  llvm::SetVector<StringRef> OutputHelpers;
+  // The machine.Pin objects of the constant pins, by pin number.
+  llvm::MapVector<uint64_t, StringRef> Pins;
+  bool UsesCharacterTable = false;
+  // Set when _cdiv() and _cmod() are called.
+  bool UsesTruncatingDivision = false;
 };
 
-//Handler for variable in isUpperCase function: regex is inserted.
+// Result of converting a single source file. Every file of a batch gets its
+// own slot, so workers never share mutable state while converting.
+struct ConversionResult {
+  std::string FileName;
+  std::string Output;
+  bool Converted = false;
+  // Set when Output comes from the --cache-dir cache.
+  bool FromCache = false;
+  int Status = 0;
+  PhaseTimes Times;
+  HandlerCounters Counters;
+  // Every file read by the conversion, recorded for the cache.
+  std::vector<std::string> Inputs;
+};
 
-class isUpperCaseVarHandler : public MatchFinder::MatchCallback {
+// Implementation of the ASTConsumer interface for reading an AST produced
+// by the Clang parser. Once the whole TU is parsed it is lowered into a
+// PyModule, which is printed into the result of the file.
+class MyASTConsumer : public ASTConsumer {
 public:
-   isUpperCaseVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  MyASTConsumer(Preprocessor &PP, const RuleIndex &Rules,
+                ConversionResult &Result, HandlerCounters *Counters)
+      : PP(PP), Rules(Rules), Result(Result), Counters(Counters) {}
+
+  void HandleTranslationUnit(ASTContext &Context) override {
+    PyModule Module;
+    {
+      llvm::TimeTraceScope Scope("Lower");
+      StatsClock::time_point Start = StatsClock::now();
+      PyLowering(Context, PP, Rules, Module, Counters)
+          .lowerTranslationUnit(Context.getTranslationUnitDecl());
+      Result.Times.Lower += secondsSince(Start);
+    }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isUpperCaseVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isUpperCaseVar");
-    Rewrite.InsertText(isUpperCaseVarfinder->getBeginLoc(), "'[A-Z]', ");
+    // Keep the generated code, it is emitted once the whole batch is done
+    llvm::TimeTraceScope Scope("Generate");
+    StatsClock::time_point Start = StatsClock::now();
+    Result.Output.clear();
+    llvm::raw_string_ostream OS(Result.Output);
+    PyEmitter(OS).emitModule(Module);
+    OS.flush();
+    Result.Converted = true;
+    Result.Times.Generate += secondsSince(Start);
   }
 
 private:
-  Rewriter &Rewrite;
+  Preprocessor &PP;
+  const RuleIndex &Rules;
+  ConversionResult &Result;
+  HandlerCounters *Counters;
 };
 
-//Handler for isWhitespace function: isWhitespace is rewritten as ure.match
-
-class isWhitespaceHandler : public MatchFinder::MatchCallback {
+// For each source file provided to the tool, a new FrontendAction is created.
+class MyFrontendAction : public ASTFrontendAction {
 public:
-   isWhitespaceHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  MyFrontendAction(const RuleIndex &Rules, ConversionResult &Result,
+                   HandlerCounters *Counters)
+      : Rules(Rules), Result(Result), Counters(Counters) {}
+  void EndSourceFileAction() override {
+    SourceManager &SM = getCompilerInstance().getSourceManager();
+    Result.FileName = SM.getFileEntryForID(SM.getMainFileID())->getName().str();
+    for (auto I = SM.fileinfo_begin(), E = SM.fileinfo_end(); I != E; ++I) {
+      StringRef Name = I->first->tryGetRealPathName();
+      Result.Inputs.push_back((Name.empty() ? I->first->getName() : Name).str());
+    }
+  }
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::CallExpr* isWhitespacefinder = Results.Nodes.getNodeAs<clang::CallExpr>("isWhitespace");
-    Rewrite.ReplaceText(isWhitespacefinder->getBeginLoc(), "ure.match");
+  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
+                                                 StringRef file) override {
+    return std::make_unique<MyASTConsumer>(CI.getPreprocessor(), Rules, Result,
+                                           Counters);
   }
 
 private:
-  Rewriter &Rewrite;
+  const RuleIndex &Rules;
+  ConversionResult &Result;
+  HandlerCounters *Counters;
 };
 
-//Handler for variable in isWhitespace function: regex is inserted.
-
-class isWhitespaceVarHandler : public MatchFinder::MatchCallback {
+// Creates the frontend action for one worker, bound to the result slot of the
+// file it is converting.
+class MyFrontendActionFactory : public FrontendActionFactory {
 public:
-   isWhitespaceVarHandler(Rewriter &Rewrite) : Rewrite(Rewrite)  {}
+  MyFrontendActionFactory(const RuleIndex &Rules, ConversionResult &Result,
+                          HandlerCounters *Counters)
+      : Rules(Rules), Result(Result), Counters(Counters) {}
 
-virtual void run(const MatchFinder::MatchResult &Results) {
-    const clang::DeclRefExpr* isWhitespaceVarfinder = Results.Nodes.getNodeAs<clang::DeclRefExpr>("isWhitespaceVar");
-    Rewrite.InsertText(isWhitespaceVarfinder->getBeginLoc(), "'\\s\\t', ");
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<MyFrontendAction>(Rules, Result, Counters);
   }
 
 private:
-  Rewriter &Rewrite;
+  const RuleIndex &Rules;
+  ConversionResult &Result;
+  HandlerCounters *Counters;
 };
 
+static llvm::cl::opt<unsigned> Jobs(
+    "jobs",
+    llvm::cl::desc("Number of files to convert in parallel (0 = one per core)"),
+    llvm::cl::init(1), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> OutputDir(
+    "output-dir",
+    llvm::cl::desc("Write every converted file as <name>.py under this "
+                   "directory, mirroring the input tree, instead of printing "
+                   "it"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> StatsFile(
+    "stats",
+    llvm::cl::desc("Write the per-phase timings, the throughput and the peak "
+                   "memory of the run as JSON to this file"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> TraceFile(
+    "trace-json",
+    llvm::cl::desc("Write a timeline of the run in the Chrome trace event "
+                   "format (chrome://tracing) to this file"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<unsigned> TraceGranularity(
+    "trace-granularity",
+    llvm::cl::desc("Minimum duration in microseconds of the events kept in "
+                   "the --trace-json timeline"),
+    llvm::cl::init(0), llvm::cl::cat(MatcherSampleCategory));
+
+// Returns where the converted Input goes inside OutputDir. Inputs below the
+// current directory keep their relative path, any other input keeps its
+// absolute path without the root, so files with the same name never collide.
+static std::string getOutputPath(StringRef Input) {
+  SmallString<256> Abs(Input);
+  llvm::sys::fs::make_absolute(Abs);
+  llvm::sys::path::remove_dots(Abs, true);
+  SmallString<256> Cwd;
+  llvm::sys::fs::current_path(Cwd);
+
+  StringRef Rel = Abs;
+  if (Rel.startswith(Cwd) && Rel.size() > Cwd.size() &&
+      llvm::sys::path::is_separator(Rel[Cwd.size()]))
+    Rel = Rel.drop_front(Cwd.size() + 1);
+  else
+    Rel = llvm::sys::path::relative_path(Rel);
+
+  SmallString<256> Out(OutputDir);
+  llvm::sys::path::append(Out, Rel);
+  llvm::sys::path::replace_extension(Out, "py");
+  return Out.str().str();
+}
 
+// Writes the converted buffer of Result to its mirrored .py file with a single
+// write, then drops the buffer so large batches do not pile up in memory.
+static void writeOutputFile(ConversionResult &Result) {
+  std::string Path = getOutputPath(Result.FileName);
+  std::error_code EC =
+      llvm::sys::fs::create_directories(llvm::sys::path::parent_path(Path));
+  if (!EC) {
+    llvm::raw_fd_ostream OS(Path, EC, llvm::sys::fs::F_None);
+    if (!EC) {
+      OS << Result.Output;
+      OS.close();
+      EC = OS.error();
+    }
+  }
+  if (EC) {
+    llvm::errs() << "error: cannot write " << Path << ": " << EC.message()
+                 << "\n";
+    Result.Status = 1;
+  }
+  std::string().swap(Result.Output);
+}
 
-// Implementation of the ASTConsumer interface for reading an AST produced
-// by the Clang parser. It registers a couple of matchers and runs them on
-// the AST.
-class MyASTConsumer : public ASTConsumer {
-public:
-  MyASTConsumer(Rewriter &R) : HandlerForIf(R), HandlerForFor(R), HandlerForpinMode(R), HandlerForLoopExpr(R), HandlerForDelay(R), HandlerForSetup(R), HandlerForCompoundStmt(R), 
-  HandlerForPower(R), HandlerForSqrt(R), HandlerForSin(R), HandlerForCos(R), HandlerForTan(R), HandlerForDelayMicroseconds(R), HandlerForMillis(R), HandlerForMicros(R), HandlerForPulseIn(R),
-  HandlerForPinModePin(R), HandlerForINPUT(R), HandlerForOUTPUT(R), HandlerForINPUTPULLUP(R), HandlerForIsAlpha(R),HandlerForIsAlphaVar(R), HandlerForIsAlphaNumeric(R), 
-  HandlerForIsAlphaNumericVar(R), HandlerForIsAscii(R), HandlerForIsAsciiVar(R), HandlerForIsDigit(R), HandlerForIsDigitVar(R), HandlerForIsLowerCase(R), HandlerForIsLowerCaseVar(R),
-   HandlerForIsPunct(R), HandlerForIsPunctVar(R), HandlerForIsSpace(R), HandlerForIsSpaceVar(R), HandlerForIsUpperCase(R), HandlerForIsUpperCaseVar(R), HandlerForIsWhitespace(R), HandlerForIsWhitespaceVar(R)  
+static llvm::cl::opt<std::string> PreambleHeader(
+    "preamble",
+    llvm::cl::desc("Precompile this header (usually Arduino.h) once and reuse "
+                   "it for every converted file"),
+    llvm::cl::value_desc("header"), llvm::cl::cat(MatcherSampleCategory));
+
+static llvm::cl::opt<std::string> PreambleCacheDir(
+    "preamble-cache",
+    llvm::cl::desc("Where the precompiled preambles are kept (default: the "
+                   "system temporary directory)"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(MatcherSampleCategory));
+
+// Returns the hash of the contents of the file at Path, or 0 if it cannot be
+// read.
+static uint64_t hashFile(StringRef Path) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
+      llvm::MemoryBuffer::getFile(Path);
+  if (!Buffer)
+    return 0;
+  return llvm::xxHash64((*Buffer)->getBuffer());
+}
+
+// Writes Contents to Path through a temporary file and a rename, so
+// concurrent readers never see a partially written file.
+static bool writeFileAtomically(StringRef Path, StringRef Contents) {
+  SmallString<256> TmpPath;
+  int FD;
+  if (llvm::sys::fs::createUniqueFile(Path + ".tmp-%%%%%%", FD, TmpPath))
+    return false;
   {
-    // Add a simple matcher for finding 'if' statements.
-    Matcher.addMatcher(ifStmt().bind("ifStmt"), &HandlerForIf);
-
-    // Add a complex matcher for finding 'for' loops with an initializer set
-    // to 0, < comparison in the codition and an increment. For example:
-    //
-    //  for (int i = 0; i < N; ++i)
-    Matcher.addMatcher(
-        forStmt(hasLoopInit(declStmt(hasSingleDecl(
-                    varDecl(hasInitializer(integerLiteral(equals(0))))
-                        .bind("initVarName")))),
-                hasIncrement(unaryOperator(
-                    hasOperatorName("++"),
-                    hasUnaryOperand(declRefExpr(to(
-                        varDecl(hasType(isInteger())).bind("incVarName")))))),
-                hasCondition(binaryOperator(
-                    hasOperatorName("<"),
-                    hasLHS(ignoringParenImpCasts(declRefExpr(to(
-                        varDecl(hasType(isInteger())).bind("condVarName"))))),
-                    hasRHS(expr(hasType(isInteger()))))))
-            .bind("forLoop"),
-        &HandlerForFor);
-
-//Add A matcher for PinMode
-
-Matcher.addMatcher(
-	callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("pinMode")))).bind("pinMode"), &HandlerForpinMode);
-
-//Add A matcher for void_loop function of Arduino
-
-Matcher.addMatcher(
-  functionDecl(isExpansionInMainFile(), hasName("loop"), parameterCountIs(0)).bind("loopexpr"), &HandlerForLoopExpr); 
-
- //Add A matcher for delay() function
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("delay")))).bind("delay"), &HandlerForDelay);
-
- //Add A matcher to delete Void Setup() 
- Matcher.addMatcher(
-   functionDecl(isExpansionInMainFile(), hasName("setup")).bind("setupfunc"), &HandlerForSetup); 
-
-//Add A matcher to remove { } braces
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), compoundStmt()).bind("compoundstmt"), &HandlerForCompoundStmt);
-
-//Add a matcher to convert power to math.pow
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), has(declRefExpr(throughUsingDecl(hasName("pow"))))).bind("pow"), &HandlerForPower);
-
-//Add a matcher to convert sqrt to math.sqrt
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), has(declRefExpr(throughUsingDecl(hasName("sqrt"))))).bind("sqrt"), &HandlerForSqrt);
-
-//Add a matcher to convert sin to math.sin
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), has(declRefExpr(throughUsingDecl(hasName("sin"))))).bind("sin"), &HandlerForSin);
-
-//Add a matcher to convert cos to math.cos
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), has(declRefExpr(throughUsingDecl(hasName("cos"))))).bind("cos"), &HandlerForCos);
-
-//Add a matcher to convert tan to math.tan
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), has(declRefExpr(throughUsingDecl(hasName("tan"))))).bind("tan"), &HandlerForTan);
-
-//Add a matcher to convert delayMicroseconds() to its Micropython equivalent.
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("delayMicroseconds")))).bind("delayMicroseconds"), &HandlerForDelayMicroseconds);
-
-//Add a matcher to convert millis() to its Micropython equivalent.
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("millis")))).bind("millis"), &HandlerForMillis);
+    llvm::raw_fd_ostream OS(FD, /*shouldClose=*/true);
+    OS << Contents;
+    OS.close();
+    if (OS.has_error()) {
+      OS.clear_error();
+      llvm::sys::fs::remove(TmpPath);
+      return false;
+    }
+  }
+  if (llvm::sys::fs::rename(TmpPath, Path)) {
+    llvm::sys::fs::remove(TmpPath);
+    return false;
+  }
+  return true;
+}
 
-//Add a matcher to convert micros() to its Micropython equivalent.
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("micros")))).bind("micros"), &HandlerForMicros);
+// Generates the PCH of the preamble header into OutputFile and records every
+// file that went into it.
+class BuildPreambleAction : public GeneratePCHAction {
+public:
+  BuildPreambleAction(StringRef OutputFile, std::vector<std::string> &Inputs)
+      : OutputFile(OutputFile), Inputs(Inputs) {}
 
-  //Add a matcher to convert micros() to its Micropython equivalent.
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("pulseIn")))).bind("pulseIn"), &HandlerForPulseIn);
+  bool BeginInvocation(CompilerInstance &CI) override {
+    CI.getFrontendOpts().OutputFile = OutputFile;
+    return GeneratePCHAction::BeginInvocation(CI);
+  }
 
-  //Add a matcher to convert pin numbers to pin numbers with prefix 'p' inside Pin.Mode.
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), hasAncestor(callExpr(callee(functionDecl(hasName("pinMode"))))), has(integerLiteral())).bind("pinModePin"), &HandlerForPinModePin);
+  void EndSourceFileAction() override {
+    SourceManager &SM = getCompilerInstance().getSourceManager();
+    for (auto I = SM.fileinfo_begin(), E = SM.fileinfo_end(); I != E; ++I)
+      Inputs.push_back(I->first->getName().str());
+    GeneratePCHAction::EndSourceFileAction();
+  }
 
-    //Add a matcher to convert INPUT to IN. pinmode uses Pin.Mode(PIN.IN)
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), declRefExpr(to(varDecl(hasName("INPUT"))))).bind("INPUT"), &HandlerForINPUT);
+private:
+  std::string OutputFile;
+  std::vector<std::string> &Inputs;
+};
 
-//Add a matcher to convert Output to OUT. pinmode uses Pin.Mode(PIN.OUT)
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), declRefExpr(to(varDecl(hasName("OUTPUT"))))).bind("OUTPUT"), &HandlerForOUTPUT);
+class BuildPreambleActionFactory : public FrontendActionFactory {
+public:
+  BuildPreambleActionFactory(StringRef OutputFile,
+                             std::vector<std::string> &Inputs)
+      : OutputFile(OutputFile), Inputs(Inputs) {}
 
-//Add a matcher to convert INPUT_PULLUP to PULLUP pinmode uses Pin.Mode(PIN.PULL_UP)
-Matcher.addMatcher(
-  stmt(isExpansionInMainFile(), declRefExpr(to(varDecl(hasName("INPUT_PULLUP"))))).bind("INPUT_PULLUP"), &HandlerForINPUTPULLUP);
+  std::unique_ptr<FrontendAction> create() override {
+    return std::make_unique<BuildPreambleAction>(OutputFile, Inputs);
+  }
 
-//Add a matcher to convert isAlpha to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isAlpha")))).bind("isAlpha"), &HandlerForIsAlpha);
+private:
+  std::string OutputFile;
+  std::vector<std::string> &Inputs;
+};
 
-//Add a matcher to add the regex string inside the isAlpha()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isAlpha")))))).bind("isAlphaVar"), &HandlerForIsAlphaVar);
+// Precompiled preamble headers, one per set of compiler flags.
+//
+// A PCH is kept in the cache directory as micropy-preamble-<key>.pch, where
+// the key hashes the clang version, the header path, the directory of the
+// compile command and the flags. Next to it a .deps file lists the hash of
+// every file it was built from; the hashes are checked before the PCH is
+// reused, so editing any core header rebuilds it.
+class PreambleCache {
+public:
+  PreambleCache(StringRef Header, StringRef CacheDir)
+      : Header(Header), CacheDir(CacheDir) {}
+
+  // Returns the PCH to use for a file compiled with Command, building it the
+  // first time it is needed. Returns an empty string if it cannot be built.
+  std::string get(const CompileCommand &Command) {
+    std::vector<std::string> Flags = getFlags(Command);
+    // Relative include paths are resolved against the directory, and the
+    // PCH is loaded without validation: a PCH built in another directory
+    // would be used unnoticed.
+    std::string KeyText = getClangFullVersion() + '\0' + Header + '\0' +
+                          Command.Directory;
+    for (const std::string &Flag : Flags)
+      KeyText += '\0' + Flag;
+    uint64_t Key = llvm::xxHash64(KeyText);
+
+    // Workers needing the same preamble wait for the first one to build it.
+    std::lock_guard<std::mutex> Guard(Lock);
+    auto It = PCHs.find(Key);
+    if (It != PCHs.end())
+      return It->second;
+
+    SmallString<256> Base(CacheDir);
+    llvm::sys::path::append(Base, "micropy-preamble-" + llvm::utohexstr(Key));
+    std::string PCH = Base.str().str() + ".pch";
+    std::string Deps = Base.str().str() + ".deps";
+    if (!isUpToDate(PCH, Deps) && !build(Command.Directory, Flags, PCH, Deps)) {
+      llvm::errs() << "warning: cannot precompile " << Header
+                   << ", parsing it for every file\n";
+      PCH.clear();
+    }
+    PCHs[Key] = PCH;
+    return PCH;
+  }
 
-//Add a matcher to convert isAlphaNumeric to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isAlphaNumeric")))).bind("isAlphaNumeric"), &HandlerForIsAlphaNumeric);
+private:
+  // The flags of Command that matter for the preamble: everything but the
+  // compiler, the input, the output and the input language.
+  static std::vector<std::string> getFlags(const CompileCommand &Command) {
+    std::vector<std::string> Flags;
+    const std::vector<std::string> &Args = Command.CommandLine;
+    for (size_t I = 1; I < Args.size(); ++I) {
+      if (Args[I] == "-o" || Args[I] == "-x") {
+        ++I;
+        continue;
+      }
+      if (Args[I] == Command.Filename || Args[I] == "-c")
+        continue;
+      Flags.push_back(Args[I]);
+    }
+    return Flags;
+  }
 
-//Add a matcher to add the regex string inside the isAlphaNumeric()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isAlphaNumeric")))))).bind("isAlphaNumericVar"), &HandlerForIsAlphaNumericVar);
+  static bool isUpToDate(StringRef PCH, StringRef Deps) {
+    if (!llvm::sys::fs::exists(PCH))
+      return false;
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
+        llvm::MemoryBuffer::getFile(Deps);
+    if (!Buffer)
+      return false;
+    SmallVector<StringRef, 64> Lines;
+    (*Buffer)->getBuffer().split(Lines, '\n', -1, false);
+    for (StringRef Line : Lines) {
+      // <hash> <path>
+      StringRef Hash, Path;
+      std::tie(Hash, Path) = Line.split(' ');
+      uint64_t Expected;
+      if (Hash.getAsInteger(16, Expected) || hashFile(Path) != Expected)
+        return false;
+    }
+    return true;
+  }
 
-//Add a matcher to convert isAscii to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isAscii")))).bind("isAscii"), &HandlerForIsAscii);
+  bool build(StringRef Directory, const std::vector<std::string> &Flags,
+             StringRef PCH, StringRef Deps) {
+    FixedCompilationDatabase Compilations(Directory, Flags);
+    llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS =
+        llvm::vfs::createPhysicalFileSystem().release();
+    ClangTool Tool(Compilations, {Header},
+                   std::make_shared<PCHContainerOperations>(), FS);
+    Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(
+        {"-x", "c++-header"}, ArgumentInsertPosition::BEGIN));
+
+    // Build into a temporary file, other processes may share the cache.
+    SmallString<256> TmpPCH;
+    if (llvm::sys::fs::createUniqueFile(PCH + ".tmp-%%%%%%", TmpPCH))
+      return false;
+    std::vector<std::string> Inputs;
+    BuildPreambleActionFactory Factory(TmpPCH, Inputs);
+    if (Tool.run(&Factory) != 0 || llvm::sys::fs::rename(TmpPCH, PCH)) {
+      llvm::sys::fs::remove(TmpPCH);
+      return false;
+    }
 
-//Add a matcher to add the regex string inside the isAscii()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isAscii")))))).bind("isAsciiVar"), &HandlerForIsAsciiVar);
+    std::string DepsContents;
+    for (const std::string &Input : Inputs)
+      DepsContents += llvm::utohexstr(hashFile(Input)) + " " + Input + "\n";
+    return writeFileAtomically(Deps, DepsContents);
+  }
 
-//Add a matcher to convert isDigit to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isDigit")))).bind("isDigit"), &HandlerForIsDigit);
+  std::string Header;
+  std::string CacheDir;
+  std::mutex Lock;
+  std::map<uint64_t, std::string> PCHs;
+};
 
-//Add a matcher to add the regex string inside the isDigit()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isDigit")))))).bind("isDigitVar"), &HandlerForIsDigitVar);
+// What every worker of a batch needs, shared read-only between them.
+static llvm::cl::opt<std::string> ConversionCacheDir(
+    "cache-dir",
+    llvm::cl::desc("Keep the converted files in this directory and reuse "
+                   "them while the input, its headers, the rules, the "
+                   "options and the tool are unchanged"),
+    llvm::cl::value_desc("dir"), llvm::cl::cat(MatcherSampleCategory));
+
+// On-disk cache of converted files, shared by the workers of a batch and by
+// concurrent processes. Every input has one entry, named after the hash of
+// its compile command, the rules, the options that change the generated code
+// and the tool build. The entry lists every file read by the conversion with
+// its size, modification time and content hash, and is reused only while all
+// of them are unchanged. The contents are hashed again only when the size or
+// the time differ. Entries are replaced atomically, so readers never see a
+// partial one.
+class ConversionCache {
+public:
+  ConversionCache(StringRef Dir, uint64_t RulesHash, StringRef Executable)
+      : Dir(Dir) {
+    Salt = getClangFullVersion() + '\0' + llvm::utohexstr(RulesHash);
+    // The options that change the generated code.
+    Salt += '\0' + std::to_string(static_cast<int>(
+                        CodeEmitterForIntegers.getValue())) +
+            " " + std::to_string(SerialUart) + " " +
+            std::to_string(static_cast<int>(PortWrites.getValue()));
+    // A rebuilt micropy-convert may generate other code for the same input.
+    llvm::sys::fs::file_status Status;
+    if (!llvm::sys::fs::status(Executable, Status))
+      Salt += '\0' + std::to_string(Status.getSize()) + " " +
+              std::to_string(getMTime(Status));
+  }
 
-//Add a matcher to convert isLowerCase to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isLowerCase")))).bind("isLowerCase"), &HandlerForIsLowerCase);
+  // Fills the output of Result from the cache, returns false on a miss.
+  bool lookup(const CompileCommand &Command, ConversionResult &Result) {
+    llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
+        llvm::MemoryBuffer::getFile(getEntryPath(Command));
+    if (!Buffer)
+      return false;
+
+    // <magic>\n<count>\n<count lines: size mtime hash path>\n<output>
+    StringRef Line, Rest = (*Buffer)->getBuffer();
+    std::tie(Line, Rest) = Rest.split('\n');
+    if (Line != Magic)
+      return false;
+    std::tie(Line, Rest) = Rest.split('\n');
+    unsigned Count;
+    if (Line.getAsInteger(10, Count))
+      return false;
+    for (unsigned I = 0; I < Count; ++I) {
+      std::tie(Line, Rest) = Rest.split('\n');
+      StringRef Size, MTime, Hash, Path;
+      std::tie(Size, Line) = Line.split(' ');
+      std::tie(MTime, Line) = Line.split(' ');
+      std::tie(Hash, Path) = Line.split(' ');
+      uint64_t ExpectedSize, ExpectedHash;
+      int64_t ExpectedMTime;
+      if (Size.getAsInteger(10, ExpectedSize) ||
+          MTime.getAsInteger(10, ExpectedMTime) ||
+          Hash.getAsInteger(16, ExpectedHash) ||
+          !isUnchanged(Path, ExpectedSize, ExpectedMTime, ExpectedHash))
+        return false;
+    }
+    Result.Output = Rest.str();
+    Result.Converted = true;
+    Result.FromCache = true;
+    return true;
+  }
 
-//Add a matcher to add the regex string inside the isLowerCase()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isLowerCase")))))).bind("isLowerCaseVar"), &HandlerForIsLowerCaseVar);
+  void store(const CompileCommand &Command, const ConversionResult &Result) {
+    std::string Entry = std::string(Magic) + "\n" +
+                        std::to_string(Result.Inputs.size()) + "\n";
+    for (const std::string &Input : Result.Inputs) {
+      llvm::sys::fs::file_status Status;
+      if (llvm::sys::fs::status(Input, Status))
+        return;
+      Entry += std::to_string(Status.getSize()) + " " +
+               std::to_string(getMTime(Status)) + " " +
+               llvm::utohexstr(getHash(Input)) + " " + Input + "\n";
+    }
+    Entry += Result.Output;
+    if (!writeFileAtomically(getEntryPath(Command), Entry))
+      llvm::errs() << "warning: cannot write the cache entry of "
+                   << Result.FileName << "\n";
+  }
 
-//Add a matcher to convert isPunct to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isPunct")))).bind("isPunct"), &HandlerForIsPunct);
+private:
+  static constexpr const char *Magic = "micropy-convert-cache-1";
+
+  std::string getEntryPath(const CompileCommand &Command) const {
+    std::string KeyText = Salt + '\0' + Command.Directory;
+    for (const std::string &Arg : Command.CommandLine)
+      KeyText += '\0' + Arg;
+    SmallString<256> Path(Dir);
+    llvm::sys::path::append(Path, llvm::utohexstr(llvm::xxHash64(KeyText)) +
+                                      ".micropy-cache");
+    return Path.str().str();
+  }
 
-//Add a matcher to add the regex string inside the isPunct()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isPunct")))))).bind("isPunctVar"), &HandlerForIsPunctVar);
+  static int64_t getMTime(const llvm::sys::fs::file_status &Status) {
+    return Status.getLastModificationTime().time_since_epoch().count();
+  }
 
-//Add a matcher to convert isSpace to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isSpace")))).bind("isSpace"), &HandlerForIsSpace);
+  bool isUnchanged(StringRef Path, uint64_t Size, int64_t MTime,
+                   uint64_t Hash) {
+    llvm::sys::fs::file_status Status;
+    if (llvm::sys::fs::status(Path, Status) || Status.getSize() != Size)
+      return false;
+    return getMTime(Status) == MTime || getHash(Path) == Hash;
+  }
 
-//Add a matcher to add the regex string inside the isSpace()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isSpace")))))).bind("isSpaceVar"), &HandlerForIsSpaceVar);
+  // The headers are shared by most files of a batch, hash each one once.
+  uint64_t getHash(StringRef Path) {
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      auto It = Hashes.find(Path);
+      if (It != Hashes.end())
+        return It->second;
+    }
+    uint64_t Hash = hashFile(Path);
+    std::lock_guard<std::mutex> Guard(Lock);
+    Hashes[Path] = Hash;
+    return Hash;
+  }
 
-//Add a matcher to convert isUpperCase to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isUpperCase")))).bind("isUpperCase"), &HandlerForIsUpperCase);
+  std::string Dir;
+  std::string Salt;
+  std::mutex Lock;
+  llvm::StringMap<uint64_t> Hashes;
+};
 
-//Add a matcher to add the regex string inside the isUpperCase()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isUpperCase")))))).bind("isUpperCaseVar"), &HandlerForIsUpperCaseVar);
+struct BatchContext {
+  const CompilationDatabase &Compilations;
+  const RuleIndex &Rules;
+  // Null unless --preamble is used.
+  PreambleCache *Preambles;
+  // Null unless --cache-dir is used.
+  ConversionCache *Cache;
+};
 
-//Add a matcher to convert isWhitespace to ure.match()
-Matcher.addMatcher(
-  callExpr(isExpansionInMainFile(), callee(functionDecl(hasName("isWhitespace")))).bind("isWhitespace"), &HandlerForIsWhitespace);
+// Converts a single file with its own ClangTool, so a batch can be spread over
+// a thread pool.
+static void convertFile(const BatchContext &Batch, const std::string &Path,
+                        ConversionResult &Result) {
+  // Each worker gets an independent VFS so ClangTool does not change the
+  // process-wide working directory under the other workers.
+  llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> FS =
+      llvm::vfs::createPhysicalFileSystem().release();
+  ClangTool Tool(Batch.Compilations, {Path},
+                 std::make_shared<PCHContainerOperations>(), FS);
+
+  std::vector<CompileCommand> Commands =
+      Batch.Compilations.getCompileCommands(Path);
+  std::string PCH;
+  if (Batch.Preambles) {
+    PCH = Commands.empty() ? "" : Batch.Preambles->get(Commands.front());
+    // The cache already checked the contents of every input of the PCH, so
+    // clang does not need to compare their timestamps again.
+    if (!PCH.empty())
+      Tool.appendArgumentsAdjuster(getInsertArgumentAdjuster(
+          {"-include-pch", PCH, "-Xclang", "-fno-validate-pch"},
+          ArgumentInsertPosition::BEGIN));
+  }
 
-//Add a matcher to add the regex string inside the isWhitespace()
-Matcher.addMatcher(
-  declRefExpr(isExpansionInMainFile(), to(varDecl()), hasAncestor(callExpr(callee(functionDecl(hasName("isWhitespace")))))).bind("isWhitespaceVar"), &HandlerForIsWhitespaceVar);
+  llvm::TimeTraceScope Scope("Convert", Path);
+  Result.FileName = Path;
+  bool Cacheable = Batch.Cache && Commands.size() == 1;
+  if (!Cacheable || !Batch.Cache->lookup(Commands.front(), Result)) {
+    // Counting costs two clock reads per construct, only pay for it when
+    // the counters are reported.
+    MyFrontendActionFactory Factory(
+        Batch.Rules, Result, StatsFile.empty() ? nullptr : &Result.Counters);
+    StatsClock::time_point Start = StatsClock::now();
+    Result.Status = Tool.run(&Factory);
+    Result.Times.Parse = secondsSince(Start) - Result.Times.Lower -
+                         Result.Times.Generate;
+    // The PCH is rebuilt whenever one of its headers changes, so it stands
+    // for all of them in the cache entry.
+    if (!PCH.empty())
+      Result.Inputs.push_back(PCH);
+    if (Cacheable && Result.Status == 0 && Result.Converted)
+      Batch.Cache->store(Commands.front(), Result);
+  }
+  if (!OutputDir.empty() && Result.Converted) {
+    llvm::TimeTraceScope Scope("Emit", Result.FileName);
+    StatsClock::time_point Start = StatsClock::now();
+    writeOutputFile(Result);
+    Result.Times.Emit += secondsSince(Start);
+  }
+}
 
+// Returns the peak resident set size of the process in kilobytes, or 0 where
+// it is not available.
+static uint64_t getPeakRSSKilobytes() {
+#ifdef LLVM_ON_UNIX
+  struct rusage Usage;
+  if (getrusage(RUSAGE_SELF, &Usage) == 0) {
+#ifdef __APPLE__
+    return Usage.ru_maxrss / 1024;
+#else
+    return Usage.ru_maxrss;
+#endif
   }
+#endif
+  return 0;
+}
 
-  void HandleTranslationUnit(ASTContext &Context) override {
-    // Run the matchers when we have the whole TU parsed.
-    Matcher.matchAST(Context);
+static void writeStats(const std::vector<ConversionResult> &Results,
+                       double WallSeconds) {
+  std::error_code EC;
+  llvm::raw_fd_ostream OS(StatsFile, EC, llvm::sys::fs::F_None);
+  if (EC) {
+    llvm::errs() << "error: cannot write " << StatsFile << ": "
+                 << EC.message() << "\n";
+    return;
+  }
 
+  PhaseTimes Total;
+  HandlerCounters Counters;
+  unsigned Converted = 0, Cached = 0;
+  auto addCounters = [](llvm::StringMap<HandlerCounter> &To,
+                        const llvm::StringMap<HandlerCounter> &From) {
+    for (const auto &Entry : From) {
+      HandlerCounter &C = To[Entry.getKey()];
+      C.Hits += Entry.getValue().Hits;
+      C.Seconds += Entry.getValue().Seconds;
+    }
+  };
+  for (const ConversionResult &R : Results) {
+    Total.Parse += R.Times.Parse;
+    Total.Lower += R.Times.Lower;
+    Total.Generate += R.Times.Generate;
+    Total.Emit += R.Times.Emit;
+    Converted += R.Converted;
+    Cached += R.FromCache;
+    addCounters(Counters.Constructs, R.Counters.Constructs);
+    addCounters(Counters.Rules, R.Counters.Rules);
   }
 
-private:
-  IfStmtHandler HandlerForIf;
-  IncrementForLoopHandler HandlerForFor;
-  pinModeVariableHandler HandlerForpinMode;
-  loopExprHandler HandlerForLoopExpr;
-  delayHandler HandlerForDelay;
-  setupHandler HandlerForSetup;
-  compoundStmtHandler HandlerForCompoundStmt;
-  powerHandler HandlerForPower;
-  sqrtHandler HandlerForSqrt;
-  sinHandler HandlerForSin;
-  cosHandler HandlerForCos;
-  tanHandler HandlerForTan;
-  delayMicrosecondsHandler HandlerForDelayMicroseconds;
-  millisHandler HandlerForMillis;
-  microsHandler HandlerForMicros;
-  pulseInHandler HandlerForPulseIn;
-  pinModePinHandler HandlerForPinModePin;
-  inputHandler HandlerForINPUT;
-  outputHandler HandlerForOUTPUT;
-  inputpullupHandler HandlerForINPUTPULLUP;
-  isAlphaHandler HandlerForIsAlpha;
-  isAlphaVarHandler HandlerForIsAlphaVar;
-  isAlphaNumericHandler HandlerForIsAlphaNumeric;
-  isAlphaNumericVarHandler HandlerForIsAlphaNumericVar;
-  isAsciiHandler HandlerForIsAscii;
-  isAsciiVarHandler HandlerForIsAsciiVar;
-  isDigitHandler HandlerForIsDigit;
-  isDigitVarHandler HandlerForIsDigitVar;
-  isLowerCaseHandler HandlerForIsLowerCase;
-  isLowerCaseVarHandler HandlerForIsLowerCaseVar;
-  isPunctHandler HandlerForIsPunct;
-  isPunctVarHandler HandlerForIsPunctVar;
-  isSpaceHandler HandlerForIsSpace;
-  isSpaceVarHandler HandlerForIsSpaceVar;
-  isUpperCaseHandler HandlerForIsUpperCase;
-  isUpperCaseVarHandler HandlerForIsUpperCaseVar;
-  isWhitespaceHandler HandlerForIsWhitespace;
-  isWhitespaceVarHandler HandlerForIsWhitespaceVar;
-
-  MatchFinder Matcher;
-};
+  auto writePhases = [](llvm::json::OStream &J, const PhaseTimes &T) {
+    J.attribute("parse", T.Parse);
+    J.attribute("lower", T.Lower);
+    J.attribute("generate", T.Generate);
+    J.attribute("emit", T.Emit);
+  };
+  // Sorted by name, so two reports can be diffed
+  auto writeCounters = [](llvm::json::OStream &J,
+                          const llvm::StringMap<HandlerCounter> &Map) {
+    std::vector<StringRef> Names;
+    for (const auto &Entry : Map)
+      Names.push_back(Entry.getKey());
+    llvm::sort(Names);
+    for (StringRef Name : Names)
+      J.attributeObject(Name, [&] {
+        J.attribute("hits", int64_t(Map.lookup(Name).Hits));
+        J.attribute("seconds", Map.lookup(Name).Seconds);
+      });
+  };
+
+  llvm::json::OStream J(OS, /*IndentSize=*/2);
+  J.object([&] {
+    J.attribute("tool", "micropy-convert");
+    J.attribute("files", int64_t(Results.size()));
+    J.attribute("converted", int64_t(Converted));
+    J.attribute("cached", int64_t(Cached));
+    J.attribute("jobs", int64_t(Jobs));
+    J.attribute("wall_seconds", WallSeconds);
+    J.attribute("sketches_per_second",
+                WallSeconds > 0 ? Results.size() / WallSeconds : 0.0);
+    J.attribute("peak_rss_kb", int64_t(getPeakRSSKilobytes()));
+    J.attributeObject("phases", [&] { writePhases(J, Total); });
+    J.attributeObject("constructs",
+                      [&] { writeCounters(J, Counters.Constructs); });
+    J.attributeObject("rules", [&] { writeCounters(J, Counters.Rules); });
+    J.attributeArray("per_file", [&] {
+      for (const ConversionResult &R : Results)
+        J.object([&] {
+          J.attribute("file", R.FileName);
+          J.attribute("cached", R.FromCache);
+          writePhases(J, R.Times);
+        });
+    });
+  });
+  OS << "\n";
+}
 
-// For each source file provided to the tool, a new FrontendAction is created.
-class MyFrontendAction : public ASTFrontendAction {
-public:
-  MyFrontendAction() {}
-  void EndSourceFileAction() override {
-   SourceManager &SM = TheRewriter.getSourceMgr();
-   llvm::errs() << "** EndSourceFileAction for: "
-                 << SM.getFileEntryForID(SM.getMainFileID())->getName() << "\n";
-//Now emit the Rewritten Buffer
-    TheRewriter.getEditBuffer(TheRewriter.getSourceMgr().getMainFileID())
-        .write(llvm::outs());
-
-std::error_code error_code;
-        llvm::raw_fd_ostream outFile("output.txt", error_code, llvm::sys::fs::F_None);
-     TheRewriter.getEditBuffer(SM.getMainFileID()).write(outFile); // --> this will write the result>
-    outFile.close();
+static llvm::cl::opt<std::string> RulesFile(
+    "rules",
+    llvm::cl::desc("Rewrite rules to use (default: micropy-rules.yaml next to "
+                   "the micropy-convert executable)"),
+    llvm::cl::value_desc("file"), llvm::cl::cat(MatcherSampleCategory));
+
+// Returns the rules file shipped next to the executable.
+static std::string getDefaultRulesFile(const char *Argv0) {
+  SmallString<256> Path(llvm::sys::fs::getMainExecutable(
+      Argv0, reinterpret_cast<void *>(&getDefaultRulesFile)));
+  llvm::sys::path::remove_filename(Path);
+  llvm::sys::path::append(Path, "micropy-rules.yaml");
+  return Path.str().str();
+}
 
+int main(int argc, const char **argv) {
+  CommonOptionsParser op(argc, argv, MatcherSampleCategory);
+
+  RuleIndex Rules;
+  std::string Error;
+  std::string RulesPath =
+      RulesFile.empty() ? getDefaultRulesFile(argv[0]) : RulesFile;
+  if (!Rules.load(RulesPath, Error)) {
+    llvm::errs() << "error: " << Error << "\n";
+    return 1;
   }
 
-  std::unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI,
-                                                 StringRef file) override {
-    TheRewriter.setSourceMgr(CI.getSourceManager(), CI.getLangOpts());
-    return std::make_unique<MyASTConsumer>(TheRewriter);
+  std::unique_ptr<PreambleCache> Preambles;
+  if (!PreambleHeader.empty()) {
+    SmallString<256> Header(PreambleHeader);
+    llvm::sys::fs::make_absolute(Header);
+    SmallString<256> CacheDir(PreambleCacheDir);
+    if (CacheDir.empty())
+      llvm::sys::path::system_temp_directory(/*ErasedOnReboot=*/true, CacheDir);
+    llvm::sys::fs::create_directories(CacheDir);
+    Preambles = std::make_unique<PreambleCache>(Header, CacheDir);
   }
 
-private:
-  Rewriter TheRewriter;
-};
+  std::unique_ptr<ConversionCache> Cache;
+  if (!ConversionCacheDir.empty()) {
+    SmallString<256> CacheDir(ConversionCacheDir);
+    llvm::sys::fs::make_absolute(CacheDir);
+    llvm::sys::fs::create_directories(CacheDir);
+    Cache = std::make_unique<ConversionCache>(
+        CacheDir, hashFile(RulesPath),
+        llvm::sys::fs::getMainExecutable(
+            argv[0], reinterpret_cast<void *>(&getDefaultRulesFile)));
+  }
+  BatchContext Batch{op.getCompilations(), Rules, Preambles.get(),
+                     Cache.get()};
 
-int main(int argc, const char **argv) {
-  CommonOptionsParser op(argc, argv, MatcherSampleCategory);
-  ClangTool Tool(op.getCompilations(), op.getSourcePathList());
+  const std::vector<std::string> &Paths = op.getSourcePathList();
+  std::vector<ConversionResult> Results(Paths.size());
+
+  // Every thread records its own timeline, they are merged when written out.
+  bool Tracing = !TraceFile.empty();
+  if (Tracing)
+    llvm::timeTraceProfilerInitialize(TraceGranularity, "micropy-convert");
 
-  return Tool.run(newFrontendActionFactory<MyFrontendAction>().get());
+  StatsClock::time_point BatchStart = StatsClock::now();
+  {
+    llvm::ThreadPool Pool(llvm::hardware_concurrency(Jobs));
+    for (size_t I = 0; I < Paths.size(); ++I)
+      Pool.async([&, I] {
+        if (Tracing)
+          llvm::timeTraceProfilerInitialize(TraceGranularity,
+                                            "micropy-convert");
+        convertFile(Batch, Paths[I], Results[I]);
+        if (Tracing)
+          llvm::timeTraceProfilerFinishThread();
+      });
+    Pool.wait();
+  }
+
+  // Emit the converted files in input order, whatever order they finished in.
+  int Status = 0;
+  for (ConversionResult &R : Results) {
+    if (R.Status != 0)
+      Status = R.Status;
+    if (!R.Converted || !OutputDir.empty())
+      continue;
+    llvm::TimeTraceScope Scope("Emit", R.FileName);
+    StatsClock::time_point Start = StatsClock::now();
+    llvm::errs() << "** EndSourceFileAction for: " << R.FileName << "\n";
+    llvm::outs() << R.Output;
+
+    std::error_code error_code;
+    llvm::raw_fd_ostream outFile("output.txt", error_code, llvm::sys::fs::F_None);
+    outFile << R.Output; // --> this will write the result>
+    outFile.close();
+    R.Times.Emit += secondsSince(Start);
+  }
+
+  if (!StatsFile.empty())
+    writeStats(Results, secondsSince(BatchStart));
+  if (Tracing) {
+    std::error_code EC;
+    llvm::raw_fd_ostream OS(TraceFile, EC, llvm::sys::fs::F_None);
+    if (EC)
+      llvm::errs() << "error: cannot write " << TraceFile << ": "
+                   << EC.message() << "\n";
+    else
+      llvm::timeTraceProfilerWrite(OS);
+    llvm::timeTraceProfilerCleanup();
+  }
+  return Status;
 }
@@ -0,0 +1,124 @@
+#!/bin/bash
+#
+# Conversion tests for micropy-convert.
+#
+# Every testdata/test_*.cpp is converted and the Python output is checked
+# against the patterns of the .expected file next to it: one extended regular
+# expression per line, matched in order against the lines of the output. A
+# pattern that starts with ! must match no line. A "// ARGS:" line of the test
+# gives extra options to micropy-convert. The --cache-dir key is checked
+# with testdata/cache_sketch.cpp.
+#
+# Usage: run_tests.sh [micropy-convert]
+#
+# The tool defaults to $MICROPY_CONVERT.
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+TESTSUITE="$ROOT/testsuite"
+MICROPY_CONVERT=${1:-${MICROPY_CONVERT:-micropy-convert}}
+
+source "$ROOT/arduino-preprocessor/testsuite/term.sh"
+
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# The tool writes a copy of its output in the working directory
+cd "$WORK"
+
+# check_expected <output> <expected>
+check_expected() {
+	local LINE=0
+	local PATTERN FOUND
+	while IFS= read -r PATTERN; do
+		case "$PATTERN" in
+		'' | '#'*)
+			continue
+			;;
+		'!'*)
+			if grep -qE -- "${PATTERN:1}" "$1"; then
+				say "@red[[Unexpected line: ${PATTERN:1}]]"
+				return 1
+			fi
+			;;
+		*)
+			FOUND=$(tail -n +$(($LINE + 1)) "$1" | grep -nE -m1 -- "$PATTERN" | cut -d: -f1)
+			if [ -z "$FOUND" ]; then
+				say "@red[[Not found in order: $PATTERN]]"
+				return 1
+			fi
+			LINE=$(($LINE + $FOUND))
+			;;
+		esac
+	done < "$2"
+	return 0
+}
+
+test_conversion() {
+	TEST=$1
+	say "@cyan[[Testing micropy-convert on @b$(basename $TEST)]]"
+	ARGS=$(sed -n 's|^// ARGS: ||p' "$TEST")
+	"$MICROPY_CONVERT" $ARGS "$TEST" -- -std=c++11 -I"$TESTSUITE/testdata" > "$WORK/out.py" 2> "$WORK/err.log"
+	if [ $? -ne 0 ]; then
+		cat "$WORK/err.log"
+		fail "Error running micropy-convert"
+		return 1
+	fi
+	if ! check_expected "$WORK/out.py" "${TEST%.cpp}.expected"; then
+		echo ""
+		say "@cyan[[Output:]]"
+		cat "$WORK/out.py"
+		fail $TEST
+		return 1
+	fi
+	pass $TEST
+	return 0
+}
+
+hr
+FAILS=0
+TOTAL=0
+for TEST in "$TESTSUITE"/testdata/test_*.cpp; do
+	test_conversion $TEST
+	FAILS=$(($FAILS+$?))
+	TOTAL=$(($TOTAL+1))
+	hr
+done
+
+# cached_runs <args...>: converts the cache test with --cache-dir and prints
+# how many files came from the cache
+cached_runs() {
+	rm -f "$WORK/stats.json"
+	"$MICROPY_CONVERT" --cache-dir="$WORK/cache" --stats="$WORK/stats.json" "$@" \
+		"$TESTSUITE/testdata/cache_sketch.cpp" -- -std=c++11 -I"$TESTSUITE/testdata" > /dev/null 2>&1
+	sed -n 's/^  "cached": \([0-9]*\),$/\1/p' "$WORK/stats.json"
+}
+
+# Every option that changes the generated code must miss the cache entry
+# written without it
+test_cache_options() {
+	say "@cyan[[Testing the --cache-dir key]]"
+	rm -rf "$WORK/cache"
+	cached_runs > /dev/null
+	if [ "$(cached_runs)" != "1" ]; then
+		fail "A second run with the same options doesn't use the cache"
+		return 1
+	fi
+	for OPTION in --code-emitter=native --serial-uart=1 --port-writes=rp2; do
+		if [ "$(cached_runs $OPTION)" != "0" ]; then
+			fail "$OPTION uses the cache entry written without it"
+			return 1
+		fi
+	done
+	pass "cache options"
+	return 0
+}
+
+test_cache_options
+FAILS=$(($FAILS+$?))
+TOTAL=$(($TOTAL+1))
+hr
+
+echo $TOTAL tests run
+echo $FAILS tests failed
+
+exit $FAILS
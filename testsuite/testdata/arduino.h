@@ -0,0 +1,12 @@
+// Minimal Arduino API, enough to convert the tests without a core
+
+#define HIGH 0x1
+#define LOW 0x0
+#define INPUT 0x0
+#define OUTPUT 0x1
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int val);
+int digitalRead(int pin);
+void delay(unsigned long ms);
+unsigned long millis();
@@ -0,0 +1,19 @@
+// Converted by the cache test of run_tests.sh, once with each option that
+// changes the generated code.
+
+#include "arduino.h"
+
+int twice(int x) {
+  return 2 * x;
+}
+
+void setup() {
+  pinMode(2, OUTPUT);
+  pinMode(3, OUTPUT);
+}
+
+void loop() {
+  digitalWrite(2, HIGH);
+  digitalWrite(3, LOW);
+  delay(twice(100));
+}
@@ -0,0 +1,28 @@
+// The if statements with a constant condition keep only the branch that
+// runs, with or without an else.
+
+#include "arduino.h"
+
+#define DEBUG 0
+#define VERBOSE 1
+
+int state = 0;
+
+void step() {
+  if (DEBUG) {
+    state = 1;
+  } else {
+    state = 2;
+  }
+  if (VERBOSE) {
+    state = 3;
+  } else {
+    state = 4;
+  }
+  if (VERBOSE) {
+    state = 5;
+  }
+  if (DEBUG) {
+    state = 6;
+  }
+}
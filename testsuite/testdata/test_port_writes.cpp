@@ -0,0 +1,18 @@
+// ARGS: --port-writes=rp2
+// The digitalWrite() calls of constant pins become a store to the clear
+// register of the RP2040 SIO, then a store to its set register.
+
+#include "arduino.h"
+
+void setup() {
+  pinMode(2, OUTPUT);
+  pinMode(3, OUTPUT);
+  pinMode(4, OUTPUT);
+}
+
+void loop() {
+  digitalWrite(2, HIGH);
+  digitalWrite(3, LOW);
+  digitalWrite(4, HIGH);
+  delay(100);
+}
@@ -0,0 +1,23 @@
+// A static local keeps its value between the calls of loop(), it must not be
+// reset on every iteration of the main loop.
+
+#include "arduino.h"
+
+int ticks = 0;
+
+int next() {
+  static int calls = 0;
+  calls++;
+  return calls;
+}
+
+void setup() {
+}
+
+void loop() {
+  static unsigned long last = 0;
+  if (millis() - last > 1000) {
+    last = millis();
+    ticks += next();
+  }
+}